@@ -8,64 +8,85 @@
 #include "scene/ray.h"
 #include "fileio/read.h"
 #include "fileio/parse.h"
-#include "ui/TraceUI.h"
+#include "render/WorkerPool.h"
+#include "render/ShadeBatch.h"
+#include "render/Sampler.h"
 
-extern TraceUI* traceUI;
-extern std::vector<vec3f> distributedRays(vec3f ray, double radius, int count);
+// What this thread has traced, added to the tracer's counts by
+// flushRayCounts() when a band or a pixel is done.
+static thread_local RayCounts t_rays;
 
 // Trace a top-level ray through normalized window coordinates (x,y)
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
-// in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
+// in an initial ray weight of (1.0,1.0,1.0) and an initial recursion depth of 0.
+//
+// With motion blur on and something in the scene moving, the color is
+// averaged over the shutter interval instead.  Times are drawn from the
+// sampler, a few to begin with and then one more at a time until the
+// standard error of the average is under blurThreshold in every channel
+// or motionBlurSamples + 1 have been traced, so that a pixel nothing
+// moves across costs only the few.
 vec3f RayTracer::trace( Scene *scene, double x, double y )
 {
-    ray r( vec3f(0,0,0), vec3f(0,0,0) );
-    scene->getCamera()->rayThrough( x,y,r );
-
-	stack<Material> materialStack = stack<Material>();
-	materialStack.push(Material::worldMaterial());
-
-	vec3f color = traceRay( scene, r, vec3f(1.0,1.0,1.0), 0, materialStack).clamp();
-
-	if (traceUI->getMotionBlur()) {
-
-		vec3f ray = r.getDirection();
-		vec3f up = vec3f(0, 1, 0);
-
-		if ((ray.normalize() - up).length() < RAY_EPSILON) {
-			up = vec3f(1, 0, 0);
-		}
-
-		vec3f right = ray.cross(up);
-		up = right.cross(ray);
-
-		vec3f blur = ray;
-
-		for (int i = 0; i < 9; i++) {
-			blur += right * 0.003;
-			class::ray blurRay(r.getPosition(), blur.normalize());
+	if( !settings.motionBlur || !scene->hasMotion() )
+		return traceAt( scene, x, y, 0.0 );
+
+	int most = max( 1, settings.motionBlurSamples + 1 );
+	int least = min( most, 4 );
+	Sampler sampler( settings.sampler, most, Sampler::seedFor( vec3f( x, y, 0 ), vec3f( 0, 0, 1 ), 6 ) );
+	double limit = settings.blurThreshold * settings.blurThreshold;
+
+	// the running mean, and sums of squared differences from it
+	vec3f mean, spread;
+	int n = 0;
+	while( n < most )
+	{
+		double u, v;
+		sampler.get( n, u, v );
+		vec3f c = traceAt( scene, x, y, u );
+
+		++n;
+		vec3f delta = c - mean;
+		mean += delta / n;
+		spread += prod( delta, c - mean );
+
+		double worst = max( spread[0], max( spread[1], spread[2] ) );
+		if( n >= least && worst <= limit * n * ( n - 1 ) )
+			break;
+	}
 
-			color += traceRay(scene, blurRay, vec3f(1.0, 1.0, 1.0), 0, materialStack).clamp();
-		}
+	return mean;
+}
 
-		color = color / 10;
+// The color seen through (x, y) at time in the shutter interval.
+vec3f RayTracer::traceAt( Scene *scene, double x, double y, double time )
+{
+    ray r( vec3f(0,0,0), vec3f(0,0,0) );
+    scene->getCamera()->rayThrough( x,y,time,r );
 
-	}
+	MediumStack media( Material::worldMaterial().index );
 
-	return color;
+	return traceRay( scene, r, vec3f(1.0,1.0,1.0), 0, settings.glossySamples + 1, media);
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+//
+// media holds the objects r is travelling inside; it is the same on return
+// as it was on entry.
 vec3f RayTracer::traceRay( Scene *scene, const ray& r, 
-	const vec3f& thresh, int depth, stack<Material> materials )
+	const vec3f& weight, int depth, int glossyRays, MediumStack& media )
 {
 	isect i;
 	
-	if (depth > traceUI->getDepth()) {
+	if (depth > settings.depth) {
 		return vec3f(0, 0, 0);
 	}
 
+	if (depth > 0)
+		++t_rays.traced;
+
 	if( scene->intersect( r, i ) ) {
 		// YOUR CODE HERE
 
@@ -79,79 +100,167 @@ vec3f RayTracer::traceRay( Scene *scene, const ray& r,
 		// rays.
 
 		const Material& m = i.getMaterial();
-		vec3f I = m.shade(scene, r, i);
+		vec3f I = m.shade(scene, r, i, settings);
 
-		if (traceUI->getThresh() > I.length()) {
-			return I;
-		}
+		return traceBounces( scene, r, i, I, weight, depth, glossyRays, media );
+	
+	} else {
+		// No intersection.  This ray travels to infinity, so we color
+		// it according to the background color, which in this (simple) case
+		// is just black.
 
-		vec3f P = r.at(i.t);
-		vec3f N = i.N;
-		vec3f V = r.getDirection();
+		return vec3f( 0.0, 0.0, 0.0 );
+	}
+}
 
-		if (&materials.top() == &m) {
-			N = -N;
-		}
+// The rest of traceRay, once the hit i of r has been shaded to local: add in
+// the contributions from reflected and refracted rays.  weight is how
+// much r counts for in the pixel; each ray spawned here counts for that
+// times kr or kt, and isn't traced at all if survival() says so.
+//
+// glossyRays is how many rays a glossy reflection here may send: the
+// whole budget until the path has split, and one after.
+vec3f RayTracer::traceBounces( Scene *scene, const ray& r, const isect& i, const vec3f& local,
+	const vec3f& weight, int depth, int glossyRays, MediumStack& media )
+{
+	vec3f I = local;
+	const Material& m = i.getMaterial();
 
-		vec3f L = V - 2 * (N * V) * N;
+	vec3f P = r.at(i.t);
+	vec3f N = i.N;
+	vec3f V = r.getDirection();
 
-		vec3f reflectionColor;
-		ray reflectionRay(P, L);
+	// a ray that hits the back of a surface is leaving that object
+	bool exiting = N * V > 0;
+	if (exiting) {
+		N = -N;
+	}
 
-		reflectionColor = 
-			prod(traceRay(scene, reflectionRay, thresh, depth + 1, materials), m.kr);
+	vec3f L = V - 2 * (N * V) * N;
 
-		if (traceUI->getGlossyRefl()) {
+	// Only surfaces that reflect or transmit at all spawn a ray, so that
+	// "culled" counts just the rays the weight actually did away with.
+	vec3f reflectionWeight = prod(weight, m.kr);
+	double p = m.kr.iszero() ? 0 : survival(reflectionWeight, depth + 1, P, L, 4);
 
-			std::vector<vec3f> rays = distributedRays(L, 0.02, 39);
+	if (p > 0) {
+		reflectionWeight = reflectionWeight / p;
+
+		vec3f reflectionColor;
 
-			for (const vec3f& r : rays) {
-				ray reflectionRay(P, r);
-				reflectionColor += 
-					prod(traceRay(scene, reflectionRay, thresh, max(depth+1, traceUI->getDepth()), materials), m.kr);
+		if (!settings.glossyReflection) {
+			ray reflectionRay(offsetRayOrigin(P, N, L), L, r.getTime());
+			reflectionColor = traceRay(scene, reflectionRay, reflectionWeight, depth + 1,
+				glossyRays, media);
+		}
+		else {
+			// Split into the sharp ray and the rest jittered, or, once
+			// split, send just one jittered ray.  Rays below either way
+			// send one each.
+			int n = glossyRays > 1 ? glossyRays - 1 : 1;
+			DirectionJitter jitter(L, 0.02);
+			Sampler sampler(settings.sampler, n, Sampler::seedFor(P, L, 1));
+
+			if (glossyRays > 1) {
+				ray reflectionRay(offsetRayOrigin(P, N, L), L, r.getTime());
+				reflectionColor = traceRay(scene, reflectionRay, reflectionWeight, depth + 1, 1, media);
+			}
+
+			for (int k = 0; k < n; ++k) {
+				double u, v;
+				sampler.get(k, u, v);
+				vec3f d = jitter.at(u, v);
+				ray reflectionRay(offsetRayOrigin(P, N, d), d, r.getTime());
+				reflectionColor += traceRay(scene, reflectionRay, reflectionWeight, depth + 1, 1, media);
 			}
 
-			reflectionColor = reflectionColor / (rays.size()+1);
+			reflectionColor = reflectionColor / max(glossyRays, 1);
 		}
 
-		I = I + reflectionColor;
+		I = I + prod(reflectionColor, m.kr) / p;
+	}
 
 
 
-		//refraction
-		if (m.kt.length() > 0) {
+	//refraction
+	vec3f refractionWeight = prod(weight, m.kt);
+	if (m.kt.length() > 0 && (p = survival(refractionWeight, depth + 1, P, V, 5)) > 0) {
 
-			double n1 = materials.top().index;
-			double n2;
+		const void *medium = i.obj->getMedium();
+		double n1 = media.index();
+		double n2;
+		int pos = -1;
+		MediumStack::Medium left;
+		bool pushed = false;
 
-			if (&materials.top() == &m) { //inside
-				materials.pop();
-				n2 = materials.top().index;
-			}
-			else { //outside
-				materials.push(m);
-				n2 = m.index;
-			}
+		if (exiting) {
+			pos = media.find(medium);
+			if (pos >= 0)
+				left = media.removeAt(pos);
+			else
+				n1 = m.index;	// started inside, e.g. the camera is
+			n2 = media.index();
+		}
+		else {
+			pushed = media.push(medium, m.index);
+			n2 = m.index;
+		}
 
-			reflectionRay = ray(P, calculateRefractedRay(V, N, n1, n2));
+		vec3f T = calculateRefractedRay(V, N, n1, n2);
 
-			vec3f refractionColor = traceRay(scene, reflectionRay, thresh, depth + 1, materials);
-			I = I + prod(refractionColor, m.kt);
+		// no refracted ray under total internal reflection
+		if (!T.iszero()) {
+			ray refractionRay(offsetRayOrigin(P, N, T), T, r.getTime());
 
+			vec3f refractionColor = traceRay(scene, refractionRay, refractionWeight / p, depth + 1,
+				glossyRays, media);
+			I = I + prod(refractionColor, m.kt) / p;
 		}
 
-		return I;
-	
-	} else {
-		// No intersection.  This ray travels to infinity, so we color
-		// it according to the background color, which in this (simple) case
-		// is just black.
+		// leave the stack as the caller passed it
+		if (pos >= 0)
+			media.insertAt(pos, left);
+		if (pushed)
+			media.pop();
+	}
 
-		return vec3f( 0.0, 0.0, 0.0 );
+	return I;
+}
+
+// The chance that a ray spawned at P along d, at depth and counting for
+// weight in the pixel, is traced; 0 if it isn't.  Rays that can add
+// nothing never are.  Otherwise, before rouletteDepth, rays weighted
+// under the threshold are dropped; from it on every ray plays Russian
+// roulette, surviving with probability its largest weight (up to 1), and
+// the caller divides what a survivor brings back by that probability so
+// that the image stays unbiased.
+double RayTracer::survival( const vec3f& weight, int depth, const vec3f& P, const vec3f& d,
+	uint32_t salt )
+{
+	double w = max(weight[0], max(weight[1], weight[2]));
+
+	if (w <= 0) {
+		++t_rays.culled;
+		return 0;
+	}
+
+	if (settings.rouletteDepth > 0 && depth >= settings.rouletteDepth) {
+		double p = min(w, 1.0);
+		if (Sampler::uniform(Sampler::seedFor(P, d, salt)) < p)
+			return p;
+		++t_rays.rouletted;
+		return 0;
+	}
+
+	if (w < settings.threshold) {
+		++t_rays.culled;
+		return 0;
 	}
+
+	return 1;
 }
 
-vec3f RayTracer::calculateRefractedRay(vec3f i, vec3f n, double n1, double n2) {
+vec3f RayTracer::calculateRefractedRay(const vec3f& i, const vec3f& n, double n1, double n2) {
 	if (abs(abs(n * i) - 1) < RAY_EPSILON)
 		return i;
 
@@ -187,24 +296,37 @@ vec3f RayTracer::calculateRefractedRay(vec3f i, vec3f n, double n1, double n2) {
 	return (i * d + (-n)).normalize();
 }
 
-RayTracer::RayTracer() : distribution(0.0, 1.0)
+RayTracer::RayTracer() : bufferMemory(MEM_FRAMEBUFFER)
 {
 	buffer = NULL;
 	buffer_width = buffer_height = 256;
 	scene = NULL;
 
 	m_bSceneLoaded = false;
+	m_bOwnsScene = false;
+	m_bClearOnTrace = false;
+	m_nDirtyStart = m_nDirtyStop = 0;
+	m_nSamples = 0;
+	m_nTraced = m_nCulled = m_nRouletted = 0;
 }
 
 
 RayTracer::~RayTracer()
 {
 	delete [] buffer;
-	delete scene;
+	if( m_bOwnsScene )
+		delete scene;
 }
 
+// Rows that tracePixel has added samples to are resolved first.
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 {
+	if( m_nDirtyStart < m_nDirtyStop )
+	{
+		accum.resolve( m_nDirtyStart, m_nDirtyStop, buffer, settings );
+		m_nDirtyStart = m_nDirtyStop = 0;
+	}
+
 	buf = buffer;
 	w = buffer_width;
 	h = buffer_height;
@@ -222,9 +344,11 @@ bool RayTracer::sceneLoaded()
 
 bool RayTracer::loadScene( char* fn )
 {
+	Scene *s;
 	try
 	{
-		scene = readScene( fn );
+		WorkerPool pool;
+		s = readScene( fn, &pool );
 	}
 	catch( ParseError pe )
 	{
@@ -232,27 +356,68 @@ bool RayTracer::loadScene( char* fn )
 		return false;
 	}
 
-	if( !scene )
+	if( !s )
 		return false;
+
+	// separate objects into bounded and unbounded
+	s->initScene();
 	
+	// Add any specialized scene loading code here
+
+	return adoptScene( s );
+}
+
+// Take over a scene that was read elsewhere, e.g. on a SceneLoader's
+// thread.  initScene() must already have been called on it; it is deleted
+// along with this tracer.
+bool RayTracer::adoptScene( Scene *s )
+{
+	if( !useScene( s ) )
+		return false;
+
+	m_bOwnsScene = true;
+	return true;
+}
+
+// Render a scene that somebody else loaded and owns, such as one shared
+// between several batch jobs.  initScene() must already have been called
+// on it, and it is not deleted along with this tracer.
+bool RayTracer::useScene( Scene *s )
+{
+	if( !s )
+		return false;
+
+	if( m_bOwnsScene && scene != s )
+		delete scene;
+
+	scene = s;
+	m_bOwnsScene = false;
+
 	buffer_width = 256;
 	buffer_height = (int)(buffer_width / scene->getCamera()->getAspectRatio() + 0.5);
 
 	bufferSize = buffer_width * buffer_height * 3;
+	delete [] buffer;
 	buffer = new unsigned char[ bufferSize ];
-	
-	// separate objects into bounded and unbounded
-	scene->initScene();
-	
-	// Add any specialized scene loading code here
-	
+	bufferMemory.set( bufferSize );
+	accum.resize( buffer_width, buffer_height );
+	accum.clearRows( 0, buffer_height );
+	m_nDirtyStart = m_nDirtyStop = 0;
+
 	m_bSceneLoaded = true;
 
 	return true;
 }
 
-void RayTracer::traceSetup( int w, int h )
+// Starts a new image.  With clear false the buffers are left untouched,
+// and traceLines clears the rows it is given before it traces them, so
+// that every row's pages are first written by whichever thread traces
+// that row.
+void RayTracer::traceSetup( int w, int h, const RenderSettings& s, bool clear )
 {
+	settings = s;
+
+
 	if( buffer_width != w || buffer_height != h )
 	{
 		buffer_width = w;
@@ -261,11 +426,46 @@ void RayTracer::traceSetup( int w, int h )
 		bufferSize = buffer_width * buffer_height * 3;
 		delete [] buffer;
 		buffer = new unsigned char[ bufferSize ];
+		bufferMemory.set( bufferSize );
 	}
-	memset( buffer, 0, w*h*3 );
+	accum.resize( w, h );
+	if( clear )
+	{
+		memset( buffer, 0, w*h*3 );
+		accum.clearRows( 0, h );
+	}
+	m_bClearOnTrace = !clear;
+	m_nDirtyStart = m_nDirtyStop = 0;
+	m_nSamples = 0;
+	m_nTraced = m_nCulled = m_nRouletted = 0;
+}
+
+// Samples traced through the image, whether by traceLines or tracePixel,
+// per pixel, since traceSetup.
+double RayTracer::samplesPerPixel() const
+{
+	return double( m_nSamples ) / ( double( buffer_width ) * buffer_height );
 }
 
-void RayTracer::traceLines( int start, int stop )
+RayCounts RayTracer::rayCounts() const
+{
+	RayCounts c;
+	c.traced = m_nTraced;
+	c.culled = m_nCulled;
+	c.rouletted = m_nRouletted;
+	return c;
+}
+
+void RayTracer::flushRayCounts()
+{
+	m_nTraced += t_rays.traced;
+	m_nCulled += t_rays.culled;
+	m_nRouletted += t_rays.rouletted;
+	t_rays = RayCounts();
+}
+
+// s, if given, is an identical copy of the scene to trace instead of our own.
+void RayTracer::traceLines( int start, int stop, Scene *s )
 {
 	vec3f col;
 	if( !scene )
@@ -274,26 +474,173 @@ void RayTracer::traceLines( int start, int stop )
 	if( stop > buffer_height )
 		stop = buffer_height;
 
-	for( int j = start; j < stop; ++j )
-		for( int i = 0; i < buffer_width; ++i )
-			tracePixel(i,j);
+	if( m_bClearOnTrace )
+		accum.clearRows( start, stop );
+
+	if( !s )
+		s = scene;
+
+	ShadeBatch batch;
+	vector<vec3f> top, bottom;
+	long long samples = 0;
+	double dx = 1.0 / double(buffer_width);
+	double dy = 1.0 / double(buffer_height);
+
+	if( settings.aaDepth > 0 )
+	{
+		// Sample the corners of the pixels, which neighbours share, and
+		// only look inside the pixels whose corners disagree.
+		sampleRow( s, start * dy, buffer_width + 1, top, batch );
+		samples += buffer_width + 1;
+		for( int j = start; j < stop; ++j )
+		{
+			sampleRow( s, ( j + 1 ) * dy, buffer_width + 1, bottom, batch );
+			samples += buffer_width + 1;
+			for( int i = 0; i < buffer_width; ++i )
+			{
+				vec3f c[4] = { top[i], top[i+1], bottom[i], bottom[i+1] };
+				accum.add( i, j, adaptiveSample( s, i * dx, j * dy, dx, dy, c,
+					settings.aaDepth, samples ) );
+			}
+			top.swap( bottom );
+		}
+	}
+	else
+	{
+		for( int j = start; j < stop; ++j )
+		{
+			sampleRow( s, j * dy, buffer_width, top, batch );
+			for( int i = 0; i < buffer_width; ++i )
+				accum.add( i, j, top[i] );
+		}
+		samples += (long long)buffer_width * ( stop - start );
+	}
+
+	m_nSamples += samples;
+	flushRayCounts();
+	accum.resolve( start, stop, buffer, settings );
 }
 
-void RayTracer::tracePixel( int i, int j )
+// The colors seen through (x, y) for x = i / buffer_width, i from 0 to
+// n-1, into colors.  The camera rays' hits are all shaded together by
+// batch, and only then do they go on to their reflected and refracted
+// rays one by one.  Motion blur traces each at several times, which
+// trace() does.
+void RayTracer::sampleRow( Scene *scene, double y, int n, vector<vec3f>& colors,
+	ShadeBatch& batch )
 {
-	vec3f col;
+	colors.assign( n, vec3f( 0.0, 0.0, 0.0 ) );
 
+	if( settings.motionBlur && scene->hasMotion() )
+	{
+		for( int i = 0; i < n; ++i )
+			colors[i] = trace( scene, double(i)/double(buffer_width), y );
+		return;
+	}
+
+	batch.clear();
+	for( int i = 0; i < n; ++i )
+	{
+		ray r( vec3f(0,0,0), vec3f(0,0,0) );
+		scene->getCamera()->rayThrough( double(i)/double(buffer_width), y, r );
+
+		isect hit;
+		if( settings.depth >= 0 && scene->intersect( r, hit ) )
+			batch.add( r, hit, i );
+	}
+
+	batch.shade( scene, settings );
+
+	for( int k = 0; k < batch.size(); ++k )
+	{
+		MediumStack media( Material::worldMaterial().index );
+		colors[ batch.tagAt( k ) ] = traceBounces( scene, batch.rayAt( k ), batch.hitAt( k ),
+			batch.color( k ), vec3f(1.0,1.0,1.0), 0, settings.glossySamples + 1, media );
+	}
+}
+
+// The average color over the dx by dy rectangle at (x, y), whose corners
+// -- top left, top right, bottom left, bottom right -- are colored c.  If
+// they differ by more than the threshold in any channel, the rectangle is
+// split in four, at the cost of five more samples, and each quarter is
+// looked at the same way, down to depth levels.
+vec3f RayTracer::adaptiveSample( Scene *scene, double x, double y, double dx, double dy,
+	const vec3f c[4], int depth, long long& samples )
+{
+	vec3f lo = c[0].clamp(), hi = lo;
+	for( int k = 1; k < 4; ++k )
+	{
+		lo = minimum( lo, c[k].clamp() );
+		hi = maximum( hi, c[k].clamp() );
+	}
+	vec3f range = hi - lo;
+	if( depth == 0 || maximum( maximum( range[0], range[1] ), range[2] ) <= settings.aaThreshold )
+		return ( c[0] + c[1] + c[2] + c[3] ) / 4.0;
+
+	double hx = dx / 2, hy = dy / 2;
+	vec3f top = trace( scene, x + hx, y );
+	vec3f left = trace( scene, x, y + hy );
+	vec3f mid = trace( scene, x + hx, y + hy );
+	vec3f right = trace( scene, x + dx, y + hy );
+	vec3f bottom = trace( scene, x + hx, y + dy );
+	samples += 5;
+
+	vec3f q0[4] = { c[0], top, left, mid };
+	vec3f q1[4] = { top, c[1], mid, right };
+	vec3f q2[4] = { left, mid, c[2], bottom };
+	vec3f q3[4] = { mid, right, bottom, c[3] };
+	return ( adaptiveSample( scene, x, y, hx, hy, q0, depth - 1, samples )
+		+ adaptiveSample( scene, x + hx, y, hx, hy, q1, depth - 1, samples )
+		+ adaptiveSample( scene, x, y + hy, hx, hy, q2, depth - 1, samples )
+		+ adaptiveSample( scene, x + hx, y + hy, hx, hy, q3, depth - 1, samples ) ) / 4.0;
+}
+
+void RayTracer::tracePixel( int i, int j, Scene *s )
+{
 	if( !scene )
 		return;
 
-	double x = double(i)/double(buffer_width);
-	double y = double(j)/double(buffer_height);
+	addSample( i, j, 0.0, 0.0, s );
+
+	// The pixel's row is resolved when the buffer is next asked for.
+	if( m_nDirtyStart == m_nDirtyStop )
+	{
+		m_nDirtyStart = j;
+		m_nDirtyStop = j + 1;
+	}
+	else
+	{
+		m_nDirtyStart = min( m_nDirtyStart, j );
+		m_nDirtyStop = max( m_nDirtyStop, j + 1 );
+	}
+}
+
+// One more sample of pixel (i, j), at (u, v) across it from its top left
+// corner, which is where traceLines samples it.  Nothing is resolved, so
+// threads may add to different pixels at once; resolveLines() shows them.
+vec3f RayTracer::addSample( int i, int j, double u, double v, Scene *s )
+{
+	if( !scene )
+		return vec3f( 0.0, 0.0, 0.0 );
+
+	double x = ( i + u ) / double(buffer_width);
+	double y = ( j + v ) / double(buffer_height);
 
-	col = trace( scene,x,y );
+	vec3f col = trace( s ? s : scene, x, y );
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+	accum.add( i, j, col );
+	++m_nSamples;
+	flushRayCounts();
+	return col;
+}
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
-}
\ No newline at end of file
+void RayTracer::resolveLines( int start, int stop )
+{
+	accum.resolve( start, min( stop, buffer_height ), buffer, settings );
+}
+
+// The average of the samples pixel (i, j) has had, before tone mapping.
+vec3f RayTracer::pixelAverage( int i, int j ) const
+{
+	return accum.average( i, j );
+}
@@ -5,9 +5,25 @@
 
 #include "scene/scene.h"
 #include "scene/ray.h"
+#include "render/RenderSettings.h"
+#include "render/MediumStack.h"
+#include "render/MemoryStats.h"
+#include "render/AccumBuffer.h"
 
-#include <stack>
-#include <random>
+#include <atomic>
+#include <cstdint>
+
+class ShadeBatch;
+
+// Reflected and refracted rays since traceSetup: how many were traced,
+// how many were never traced because their weight was under the
+// threshold, and how many lost at Russian roulette.
+struct RayCounts
+{
+	RayCounts() : traced( 0 ), culled( 0 ), rouletted( 0 ) {}
+
+	long long traced, culled, rouletted;
+};
 
 class RayTracer
 {
@@ -16,33 +32,56 @@ public:
     ~RayTracer();
 
     vec3f trace( Scene *scene, double x, double y );
-	vec3f traceRay( Scene *scene, const ray& r, const vec3f& thresh, int depth, stack<Material> materials );
+	vec3f traceAt( Scene *scene, double x, double y, double time );
+	vec3f traceRay( Scene *scene, const ray& r, const vec3f& weight, int depth,
+		int glossyRays, MediumStack& media );
+	vec3f traceBounces( Scene *scene, const ray& r, const isect& i, const vec3f& local,
+		const vec3f& weight, int depth, int glossyRays, MediumStack& media );
 
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
-	void traceSetup( int w, int h );
-	void traceLines( int start = 0, int stop = 10000000 );
-	void tracePixel( int i, int j );
+	void traceSetup( int w, int h, const RenderSettings& s, bool clear = true );
+	void traceLines( int start = 0, int stop = 10000000, Scene *s = NULL );
+	void tracePixel( int i, int j, Scene *s = NULL );
+	vec3f addSample( int i, int j, double u, double v, Scene *s = NULL );
+	void resolveLines( int start, int stop );
+	vec3f pixelAverage( int i, int j ) const;
+	double samplesPerPixel() const;
+	RayCounts rayCounts() const;
 
 	bool loadScene( char* fn );
+	bool adoptScene( Scene *s );
+	bool useScene( Scene *s );
 
 	bool sceneLoaded();
 
 	Scene* getScene() { return scene; }
+	const RenderSettings& getSettings() const { return settings; }
 
-	vec3f calculateRefractedRay(vec3f i, vec3f n, double n1, double n2);
+	vec3f calculateRefractedRay(const vec3f& i, const vec3f& n, double n1, double n2);
 
 private:
+	void sampleRow( Scene *scene, double y, int n, vector<vec3f>& colors, ShadeBatch& batch );
+	vec3f adaptiveSample( Scene *scene, double x, double y, double dx, double dy,
+		const vec3f c[4], int depth, long long& samples );
+	double survival( const vec3f& weight, int depth, const vec3f& P, const vec3f& d, uint32_t salt );
+	void flushRayCounts();
+
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
 	int bufferSize;
+	MemoryCharge bufferMemory;
+	AccumBuffer accum;
+	bool m_bClearOnTrace;		// traceLines clears its rows first
+	int m_nDirtyStart, m_nDirtyStop;	// rows tracePixel added to since the last resolve
+	std::atomic<long long> m_nSamples;
+	std::atomic<long long> m_nTraced, m_nCulled, m_nRouletted;
 	Scene *scene;
+	RenderSettings settings;
 
 	bool m_bSceneLoaded;
-
-	std::default_random_engine generator;
-	std::uniform_real_distribution<double> distribution;
+	bool m_bOwnsScene;
 };
 
 #endif // __RAYTRACER_H__
@@ -7,7 +7,7 @@ class Box
 	: public MaterialSceneObject
 {
 public:
-	Box( Scene *scene, Material *mat )
+	Box( Scene *scene, MaterialTable::Index mat )
 		: MaterialSceneObject( scene, mat )
 	{
 	}
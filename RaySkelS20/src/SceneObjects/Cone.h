@@ -7,7 +7,7 @@ class Cone
 	: public MaterialSceneObject
 {
 public:
-	Cone( Scene *scene, Material *mat, 
+	Cone( Scene *scene, MaterialTable::Index mat, 
 			double h = 1.0, double br = 1.0, double tr = 0.0, 
 			bool cap = false )
 		: MaterialSceneObject( scene, mat )
@@ -23,7 +23,7 @@ public:
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
-    virtual BoundingBox ComputeLocalBoundingBox()
+    virtual BoundingBox ComputeLocalBoundingBox() const
     {
         BoundingBox localbounds;
 		double biggest_radius = (b_radius > t_radius)?(b_radius):(t_radius);
@@ -7,7 +7,7 @@ class Cylinder
 	: public MaterialSceneObject
 {
 public:
-	Cylinder( Scene *scene, Material *mat , bool cap = true)
+	Cylinder( Scene *scene, MaterialTable::Index mat , bool cap = true)
 		: MaterialSceneObject( scene, mat ), capped( cap )
 	{
 	}
@@ -15,7 +15,7 @@ public:
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
-    virtual BoundingBox ComputeLocalBoundingBox()
+    virtual BoundingBox ComputeLocalBoundingBox() const
     {
         BoundingBox localbounds;
 		localbounds.min = vec3f(-1.0f, -1.0f, 0.0f);
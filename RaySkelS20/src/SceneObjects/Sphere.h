@@ -7,7 +7,7 @@ class Sphere
 	: public MaterialSceneObject
 {
 public:
-	Sphere( Scene *scene, Material *mat )
+	Sphere( Scene *scene, MaterialTable::Index mat )
 		: MaterialSceneObject( scene, mat )
 	{
 	}
@@ -15,7 +15,7 @@ public:
 	virtual bool intersectLocal( const ray& r, isect& i ) const;
 	virtual bool hasBoundingBoxCapability() const { return true; }
 
-    virtual BoundingBox ComputeLocalBoundingBox()
+    virtual BoundingBox ComputeLocalBoundingBox() const
     {
         BoundingBox localbounds;
 		localbounds.min = vec3f(-1.0f, -1.0f, -1.0f);
@@ -0,0 +1,322 @@
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "SphereCloud.h"
+
+// Splits ids[0..n) about the median of the centers along the axis they
+// spread furthest on, at a multiple of leaf so that the leaves come out
+// full.  n must be more than leaf.
+static int splitSpheres( const vector<vec3g>& centers, int *ids, int n, int leaf )
+{
+	vec3g lo = centers[ ids[0] ];
+	vec3g hi = lo;
+	for( int k = 1; k < n; ++k ) {
+		lo = minimum( lo, centers[ ids[k] ] );
+		hi = maximum( hi, centers[ ids[k] ] );
+	}
+
+	vec3g extent = hi - lo;
+	int axis = extent[0] > extent[1] ? ( extent[0] > extent[2] ? 0 : 2 )
+	                                 : ( extent[1] > extent[2] ? 1 : 2 );
+
+	int mid = ( n / 2 + leaf - 1 ) / leaf * leaf;
+	nth_element( ids, ids + mid, ids + n, [&]( int a, int b ) {
+		return centers[a][axis] < centers[b][axis];
+	} );
+	return mid;
+}
+
+bool SphereCloud::build( vector<vec3g>& centers, vector<geomreal>& radii, geomreal r,
+	const mat4f& xform )
+{
+	if( !radii.empty() && radii.size() != centers.size() )
+		return false;
+	if( radii.empty() )
+		radii.assign( centers.size(), r );
+
+	mat3f m = xform.upper33();
+	double scale = maximum( maximum( m.column( 0 ).length(), m.column( 1 ).length() ),
+		m.column( 2 ).length() );
+	for( size_t k = 0; k < centers.size(); ++k ) {
+		centers[k] = vec3g( xform * vec3f( centers[k] ) );
+		radii[k] = geomreal( radii[k] * scale );
+	}
+
+	count = (int)centers.size();
+	x.clear();
+	y.clear();
+	z.clear();
+	radius.clear();
+	nodes.clear();
+	worldBounds = BoundingBox();
+
+	if( count ) {
+		int leaves = ( count + LEAF - 1 ) / LEAF;
+		x.reserve( leaves * LEAF );
+		y.reserve( leaves * LEAF );
+		z.reserve( leaves * LEAF );
+		radius.reserve( leaves * LEAF );
+		nodes.reserve( leaves / ( BoxPacket::SIZE - 1 ) + 1 );
+
+		vector<int> ids( count );
+		for( int k = 0; k < count; ++k )
+			ids[k] = k;
+		root = buildNode( centers, radii, &ids[0], count, worldBounds );
+	}
+
+	vector<vec3g>().swap( centers );
+	vector<geomreal>().swap( radii );
+	return true;
+}
+
+// Builds the subtree over spheres ids[0..n), appending its leaves to the
+// sphere arrays, and returns its root with its bounds in box.
+int SphereCloud::buildNode( vector<vec3g>& centers, vector<geomreal>& radii,
+	int *ids, int n, BoundingBox& box )
+{
+	if( n <= LEAF ) {
+		int leaf = (int)x.size() / LEAF;
+		for( int k = 0; k < LEAF; ++k ) {
+			if( k < n ) {
+				const vec3g& c = centers[ ids[k] ];
+				geomreal rk = radii[ ids[k] ];
+				x.push_back( c[0] );
+				y.push_back( c[1] );
+				z.push_back( c[2] );
+				radius.push_back( rk );
+
+				vec3f lo = vec3f( c ) - vec3f( rk, rk, rk );
+				vec3f hi = vec3f( c ) + vec3f( rk, rk, rk );
+				box.min = k ? minimum( box.min, lo ) : lo;
+				box.max = k ? maximum( box.max, hi ) : hi;
+			} else {
+				x.push_back( 0 );
+				y.push_back( 0 );
+				z.push_back( 0 );
+				radius.push_back( -1 );
+			}
+		}
+		box.addMargin();
+		return ~leaf;
+	}
+
+	// Two levels of halving make up to four children.
+	int cuts[ BoxPacket::SIZE + 1 ];
+	int parts = 0;
+	int mid = splitSpheres( centers, ids, n, LEAF );
+	cuts[ parts++ ] = 0;
+	if( mid > LEAF )
+		cuts[ parts++ ] = splitSpheres( centers, ids, mid, LEAF );
+	cuts[ parts++ ] = mid;
+	if( n - mid > LEAF )
+		cuts[ parts++ ] = mid + splitSpheres( centers, ids + mid, n - mid, LEAF );
+	cuts[ parts ] = n;
+
+	int index = (int)nodes.size();
+	nodes.push_back( Node() );
+	for( int k = 0; k < BoxPacket::SIZE; ++k )
+		nodes[ index ].child[k] = 0;
+
+	for( int k = 0; k < parts; ++k ) {
+		BoundingBox b;
+		int child = buildNode( centers, radii, ids + cuts[k], cuts[k+1] - cuts[k], b );
+		nodes[ index ].child[k] = child;
+		nodes[ index ].boxes.set( k, b );
+		box.min = k ? minimum( box.min, b.min ) : b.min;
+		box.max = k ? maximum( box.max, b.max ) : b.max;
+	}
+	return index;
+}
+
+size_t SphereCloud::memoryBytes() const
+{
+	return sizeof( SphereCloud )
+		+ ( x.capacity() + y.capacity() + z.capacity() + radius.capacity() ) * sizeof( geomreal )
+		+ nodes.capacity() * sizeof( Node );
+}
+
+// The spheres of a leaf that the ray o + t d, with d a unit vector, may
+// hit for 0 < t <= tMax, as a bit mask.  This runs in geomreal, so the radii are grown by a
+// margin relative to the distance along the ray, which covers its
+// rounding error: a sphere it passes over can't be hit.  Padding spheres
+// have a negative radius and never pass.  The sphere's distance from the
+// ray is found as the length of the part of o - c across the ray, rather
+// than as b*b - |o - c|^2 + r*r, which loses everything to cancellation
+// for a small sphere far from the origin.
+int SphereCloud::leafCandidates( int leaf, const geomreal o[3], const geomreal d[3],
+	geomreal tMax ) const
+{
+	const geomreal margin = geomreal( 1.0e-5 );
+	const geomreal *cx = &x[ LEAF * leaf ];
+	const geomreal *cy = &y[ LEAF * leaf ];
+	const geomreal *cz = &z[ LEAF * leaf ];
+	const geomreal *cr = &radius[ LEAF * leaf ];
+
+#if defined(RAY_SIMD_AVX2) && !defined(RAY_DOUBLE_GEOMETRY)
+	__m256 dx = _mm256_set1_ps( d[0] ), dy = _mm256_set1_ps( d[1] ), dz = _mm256_set1_ps( d[2] );
+	__m256 vx = _mm256_sub_ps( _mm256_loadu_ps( cx ), _mm256_set1_ps( o[0] ) );
+	__m256 vy = _mm256_sub_ps( _mm256_loadu_ps( cy ), _mm256_set1_ps( o[1] ) );
+	__m256 vz = _mm256_sub_ps( _mm256_loadu_ps( cz ), _mm256_set1_ps( o[2] ) );
+	__m256 b = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, dx ), _mm256_mul_ps( vy, dy ) ),
+		_mm256_mul_ps( vz, dz ) );
+	__m256 qx = _mm256_sub_ps( vx, _mm256_mul_ps( b, dx ) );
+	__m256 qy = _mm256_sub_ps( vy, _mm256_mul_ps( b, dy ) );
+	__m256 qz = _mm256_sub_ps( vz, _mm256_mul_ps( b, dz ) );
+	__m256 q2 = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( qx, qx ), _mm256_mul_ps( qy, qy ) ),
+		_mm256_mul_ps( qz, qz ) );
+	__m256 r = _mm256_loadu_ps( cr );
+	__m256 absb = _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), b );
+	__m256 rr = _mm256_add_ps( r, _mm256_mul_ps( _mm256_set1_ps( margin ), _mm256_add_ps( absb, r ) ) );
+	__m256 disc = _mm256_sub_ps( _mm256_mul_ps( rr, rr ), q2 );
+	__m256 s = _mm256_sqrt_ps( _mm256_max_ps( disc, _mm256_setzero_ps() ) );
+	__m256 ok = _mm256_and_ps(
+		_mm256_and_ps( _mm256_cmp_ps( disc, _mm256_setzero_ps(), _CMP_GE_OQ ),
+		               _mm256_cmp_ps( r, _mm256_setzero_ps(), _CMP_GE_OQ ) ),
+		_mm256_and_ps( _mm256_cmp_ps( _mm256_add_ps( b, s ), _mm256_setzero_ps(), _CMP_GE_OQ ),
+		               _mm256_cmp_ps( _mm256_sub_ps( b, s ), _mm256_set1_ps( tMax ), _CMP_LE_OQ ) ) );
+	return _mm256_movemask_ps( ok );
+#elif defined(RAY_SIMD_SSE2) && !defined(RAY_DOUBLE_GEOMETRY)
+	int hits = 0;
+	for( int h = 0; h < LEAF; h += 4 ) {
+		__m128 dx = _mm_set1_ps( d[0] ), dy = _mm_set1_ps( d[1] ), dz = _mm_set1_ps( d[2] );
+		__m128 vx = _mm_sub_ps( _mm_loadu_ps( cx + h ), _mm_set1_ps( o[0] ) );
+		__m128 vy = _mm_sub_ps( _mm_loadu_ps( cy + h ), _mm_set1_ps( o[1] ) );
+		__m128 vz = _mm_sub_ps( _mm_loadu_ps( cz + h ), _mm_set1_ps( o[2] ) );
+		__m128 b = _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, dx ), _mm_mul_ps( vy, dy ) ),
+			_mm_mul_ps( vz, dz ) );
+		__m128 qx = _mm_sub_ps( vx, _mm_mul_ps( b, dx ) );
+		__m128 qy = _mm_sub_ps( vy, _mm_mul_ps( b, dy ) );
+		__m128 qz = _mm_sub_ps( vz, _mm_mul_ps( b, dz ) );
+		__m128 q2 = _mm_add_ps( _mm_add_ps( _mm_mul_ps( qx, qx ), _mm_mul_ps( qy, qy ) ),
+			_mm_mul_ps( qz, qz ) );
+		__m128 r = _mm_loadu_ps( cr + h );
+		__m128 absb = _mm_andnot_ps( _mm_set1_ps( -0.0f ), b );
+		__m128 rr = _mm_add_ps( r, _mm_mul_ps( _mm_set1_ps( margin ), _mm_add_ps( absb, r ) ) );
+		__m128 disc = _mm_sub_ps( _mm_mul_ps( rr, rr ), q2 );
+		__m128 s = _mm_sqrt_ps( _mm_max_ps( disc, _mm_setzero_ps() ) );
+		__m128 ok = _mm_and_ps(
+			_mm_and_ps( _mm_cmpge_ps( disc, _mm_setzero_ps() ), _mm_cmpge_ps( r, _mm_setzero_ps() ) ),
+			_mm_and_ps( _mm_cmpge_ps( _mm_add_ps( b, s ), _mm_setzero_ps() ),
+			            _mm_cmple_ps( _mm_sub_ps( b, s ), _mm_set1_ps( tMax ) ) ) );
+		hits |= _mm_movemask_ps( ok ) << h;
+	}
+	return hits;
+#else
+	int hits = 0;
+	for( int k = 0; k < LEAF; ++k ) {
+		geomreal vx = cx[k] - o[0], vy = cy[k] - o[1], vz = cz[k] - o[2];
+		geomreal b = vx*d[0] + vy*d[1] + vz*d[2];
+		geomreal qx = vx - b*d[0], qy = vy - b*d[1], qz = vz - b*d[2];
+		geomreal q2 = qx*qx + qy*qy + qz*qz;
+		geomreal rr = cr[k] + margin * ( fabs( b ) + cr[k] );
+		geomreal disc = rr*rr - q2;
+		if( disc < 0 || cr[k] < 0 )
+			continue;
+		geomreal s = sqrt( disc );
+		if( b + s >= 0 && b - s <= tMax )
+			hits |= 1 << k;
+	}
+	return hits;
+#endif
+}
+
+// The exact test, in double, with the same choice of root as a Sphere.
+// D has to be a unit vector.
+bool SphereCloud::hitSphere( int s, const vec3f& P, const vec3f& D, double& t ) const
+{
+	vec3f v = vec3f( x[s], y[s], z[s] ) - P;
+	double b = v * D;
+	vec3f q = v - D * b;
+	double R = radius[s];
+	double discriminant = R*R - q*q;
+
+	if( discriminant < 0.0 ) {
+		return false;
+	}
+
+	discriminant = sqrt( discriminant );
+	double t2 = b + discriminant;
+
+	if( t2 <= RAY_EPSILON ) {
+		return false;
+	}
+
+	double t1 = b - discriminant;
+	t = t1 > RAY_EPSILON ? t1 : t2;
+	return true;
+}
+
+bool SphereCloud::intersectLocal( const ray& r, isect& i ) const
+{
+	if( count == 0 ) {
+		return false;
+	}
+
+	// The tests take the direction to be a unit vector, which a jittered
+	// or transformed ray's needn't be, so they run along a unit one and
+	// the t found is scaled back to the ray's own at the end.
+	vec3f P = r.getPosition();
+	double length = r.getDirection().length();
+	vec3f D = r.getDirection() / length;
+	BoxRay br( ray( P, D ) );
+	geomreal o[3] = { geomreal( P[0] ), geomreal( P[1] ), geomreal( P[2] ) };
+	geomreal d[3] = { geomreal( D[0] ), geomreal( D[1] ), geomreal( D[2] ) };
+	const double farthest = numeric_limits<geomreal>::max();
+
+	double best = 1.0e308;
+	int hit = -1;
+
+	// Each level of the tree leaves at most three entries behind on the
+	// stack, and 20 levels is more spheres than fit in memory.
+	int stack[ 64 ];
+	int top = 0;
+	stack[ top++ ] = root;
+
+	while( top ) {
+		int entry = stack[ --top ];
+
+		if( entry < 0 ) {
+			int first = LEAF * ~entry;
+			int candidates = leafCandidates( ~entry, o, d, geomreal( minimum( best, farthest ) ) );
+			for( int k = 0; candidates; ++k, candidates >>= 1 ) {
+				double t;
+				if( ( candidates & 1 ) && hitSphere( first + k, P, D, t ) && t < best ) {
+					best = t;
+					hit = first + k;
+				}
+			}
+			continue;
+		}
+
+		// Push the children farthest first, so the nearest is tried
+		// first and the hit it gives can cull the rest.
+		const Node& node = nodes[ entry ];
+		double tNear[ BoxPacket::SIZE ];
+		int mask = node.boxes.intersect( br, best, tNear );
+		int order[ BoxPacket::SIZE ];
+		int n = 0;
+		for( int k = 0; k < BoxPacket::SIZE; ++k ) {
+			if( !( mask & ( 1 << k ) ) )
+				continue;
+			int j = n++;
+			while( j > 0 && tNear[ order[j-1] ] < tNear[k] ) {
+				order[j] = order[j-1];
+				--j;
+			}
+			order[j] = k;
+		}
+		for( int j = 0; j < n; ++j )
+			stack[ top++ ] = node.child[ order[j] ];
+	}
+
+	if( hit < 0 ) {
+		return false;
+	}
+
+	i.obj = this;
+	i.t = best / length;
+	i.N = ( P + D * best - vec3f( x[hit], y[hit], z[hit] ) ).normalize();
+	i.prim = hit;
+	return true;
+}
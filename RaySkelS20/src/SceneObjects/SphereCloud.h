@@ -0,0 +1,79 @@
+#ifndef __SPHERECLOUD_H__
+#define __SPHERECLOUD_H__
+
+#include <vector>
+
+#include "../scene/scene.h"
+
+// Many spheres -- particles, atoms -- as one SceneObject sharing one
+// material.  A sphere is just a center and a radius, kept in world space
+// as separate arrays of geomreal, about 16 bytes a sphere where a Sphere
+// object with its own TransformNode takes several hundred.
+//
+// The spheres are gathered into leaves of eight, which sit under a
+// four-way bounding volume hierarchy whose nodes are BoxPackets.  A leaf
+// is tested in one pass of an eight-wide single-precision kernel that
+// picks out, conservatively, the spheres the ray might hit; only those
+// are then tested exactly.
+class SphereCloud
+	: public MaterialSceneObject
+{
+public:
+	SphereCloud( Scene *scene, MaterialTable::Index mat )
+		: MaterialSceneObject( scene, mat ), count( 0 ), root( 0 ) {}
+
+	// Takes over centers and radii, leaving them empty, puts the spheres
+	// in world space with xform and builds the hierarchy over them.  With
+	// radii empty every sphere gets radius r.  Spheres stay spheres: a
+	// scale that isn't uniform scales them by its largest factor.
+	// Returns false if radii is given but isn't one per center.
+	bool build( vector<vec3g>& centers, vector<geomreal>& radii, geomreal r,
+		const mat4f& xform );
+
+	// The cloud is already in world space, so it doesn't go through
+	// Geometry::intersect's transform into local coordinates -- unless it
+	// moves, when the ray is taken back to where the cloud was at time 0.
+	virtual bool intersect( const ray& r, isect& i ) const
+	{
+		return isMoving() ? intersectMoving( r, i, transform->globalToLocal() )
+			: intersectLocal( r, i );
+	}
+	virtual bool intersectLocal( const ray& r, isect& i ) const;
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual void ComputeBoundingBox()
+	{
+		bounds = isMoving() ? transform->sweep( worldBounds, transform->globalToLocal() )
+			: worldBounds;
+	}
+
+	virtual size_t memoryBytes() const;
+
+	int size() const { return count; }
+
+private:
+	enum { LEAF = 8 };
+
+	// child[k] >= 0 is another node, child[k] < 0 is leaf ~child[k].
+	// Unused slots have empty boxes, which no ray hits.
+	struct Node
+	{
+		BoxPacket boxes;
+		int child[ BoxPacket::SIZE ];
+	};
+
+	int buildNode( vector<vec3g>& centers, vector<geomreal>& radii,
+		int *ids, int n, BoundingBox& box );
+	int leafCandidates( int leaf, const geomreal o[3], const geomreal d[3],
+		geomreal tMax ) const;
+	bool hitSphere( int s, const vec3f& P, const vec3f& D, double& t ) const;
+
+	// Leaf l holds spheres LEAF*l to LEAF*l + LEAF-1; the last leaf is
+	// padded out with spheres of radius -1.
+	vector<geomreal> x, y, z, radius;
+	vector<Node> nodes;
+	int count;
+	int root;				// a node, or ~leaf when there is only one
+	BoundingBox worldBounds;
+};
+
+#endif // __SPHERECLOUD_H__
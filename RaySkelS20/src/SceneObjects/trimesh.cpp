@@ -1,29 +1,22 @@
 #include <cmath>
-#include <float.h>
+#include <cstring>
+#include <limits>
 #include "trimesh.h"
 
-Trimesh::~Trimesh()
-{
-    for( Materials::iterator i = materials.begin(); i != materials.end(); ++i )
-    {
-        delete *i;
-    }
-}
-
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const vec3f &v )
 {
-    vertices.push_back( v );
+    vertices.push_back( vec3g( v ) );
 }
 
-void Trimesh::addMaterial( Material *m )
+void Trimesh::addMaterial( MaterialTable::Index m )
 {
     materials.push_back( m );
 }
 
 void Trimesh::addNormal( const vec3f &n )
 {
-    normals.push_back( n );
+    normals.push_back( vec3g( n ) );
 }
 
 // Returns false if the vertices a,b,c don't all exist
@@ -34,13 +27,75 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    faces.push_back( Face( a, b, c ) );
+    blockFace( (int)faces.size() - 1 );
+    return true;
+}
+
+void Trimesh::takeVertices( vector<vec3g>& v )
+{
+    vertices.swap( v );
+    vector<vec3g>().swap( v );
+}
+
+void Trimesh::takeNormals( vector<vec3g>& n )
+{
+    normals.swap( n );
+    vector<vec3g>().swap( n );
+}
+
+bool Trimesh::takeFaces( vector<Face>& f )
+{
+    int vcnt = vertices.size();
+
+    for( size_t i = 0; i < f.size(); ++i )
+        for( int k = 0; k < 3; ++k )
+            if( f[i][k] < 0 || f[i][k] >= vcnt )
+                return false;
+
+    faces.swap( f );
+    vector<Face>().swap( f );
+
+    FaceBlocks().swap( blocks );
+    blocks.reserve( ( faces.size() + BLOCK - 1 ) / BLOCK );
+    for( int i = 0; i < (int)faces.size(); ++i )
+        blockFace( i );
     return true;
 }
 
+// Copy face f into its lane of the blocks, starting a new block if it's
+// the first face of one.
+void Trimesh::blockFace( int f )
+{
+    if( f / BLOCK >= (int)blocks.size() )
+    {
+        FaceBlock empty;
+        memset( &empty, 0, sizeof( empty ) );
+        for( int k = 0; k < BLOCK; ++k )
+            empty.detMin[k] = numeric_limits<geomreal>::infinity();
+        blocks.push_back( empty );
+    }
+
+    FaceBlock& block = blocks[ f / BLOCK ];
+    int k = f % BLOCK;
+
+    const vec3g& a = vertices[faces[f][0]];
+    vec3g ab = vertices[faces[f][1]] - a;
+    vec3g ac = vertices[faces[f][2]] - a;
+
+    block.ax[k] = a[0];   block.ay[k] = a[1];   block.az[k] = a[2];
+    block.e1x[k] = ab[0]; block.e1y[k] = ab[1]; block.e1z[k] = ab[2];
+    block.e2x[k] = ac[0]; block.e2y[k] = ac[1]; block.e2z[k] = ac[2];
+
+    // The determinant is -v.(ab x ac); it must be at least NORMAL_EPSILON
+    // times |ab x ac| for the ray to be facing the triangle.  There exist
+    // some bad triangles such that two vertices coincide; they stay at
+    // infinity.
+    vec3g cv = ab.cross( ac );
+    if( !cv.iszero() )
+        block.detMin[k] = geomreal( NORMAL_EPSILON ) * cv.length();
+}
+
 char *
 Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
@@ -54,92 +109,237 @@ Trimesh::doubleCheck()
     return 0;
 }
 
-// Intersect ray r with the triangle abc.  If it hits returns true,
-// and put the parameter in t and the barycentric coordinates of the
-// intersection in bary.
-// Uses the algorithm and notation from _Graphic Gems 5_, p. 232.
-//
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+size_t Trimesh::memoryBytes() const
 {
-    const vec3f& a = parent->vertices[ids[0]];
-    const vec3f& b = parent->vertices[ids[1]];
-    const vec3f& c = parent->vertices[ids[2]];
-    
-    vec3f bary;
-    float t;
-    vec3f n;
-    
-    vec3f p = r.getPosition();
-    vec3f v = r.getDirection();
-    
-    vec3f ab = b - a;
-    vec3f ac = c - a;
-    vec3f ap = p - a;
-    
-	vec3f cv=ab.cross(ac);
-
-	// there exists some bad triangles such that two vertices coincide
-	// check this before normalize
-	if (cv.iszero()) return false;
-    n = (cv).normalize();
-	
-    double vdotn = v*n;
-    if( -vdotn < NORMAL_EPSILON )
-        return false;
-    
-    t = - (ap*n)/vdotn;
-    
-    if( t < RAY_EPSILON )
-        return false;
+    return sizeof( *this )
+        + vertices.capacity() * sizeof( vec3g )
+        + normals.capacity() * sizeof( vec3g )
+        + faces.capacity() * sizeof( Face )
+        + materials.capacity() * sizeof( MaterialTable::Index )
+        + blocks.capacity() * sizeof( FaceBlock );
+}
+
+BoundingBox Trimesh::ComputeLocalBoundingBox() const
+{
+    BoundingBox localbounds;
+    if( vertices.empty() )
+        return localbounds;
+
+    localbounds.min = localbounds.max = vec3f( vertices[0] );
+    for( Vertices::const_iterator vi = vertices.begin(); vi != vertices.end(); ++vi )
+    {
+        localbounds.max = maximum( vec3f( *vi ), localbounds.max );
+        localbounds.min = minimum( vec3f( *vi ), localbounds.min );
+    }
+    return localbounds;
+}
+
+// Find the closest of the mesh's triangles along r, a block at a time.
+// The barycentric coordinates, normal and material are only worked out for
+// that one.
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+    vec3g p( r.getPosition() );
+    vec3g v( r.getDirection() );
+    geomreal bestT = numeric_limits<geomreal>::infinity();
+    geomreal bestU = 0, bestW = 0;
+    int best = -1;
 
-    // find k where k is the index of the component
-    // of normal vector with greatest absolute value
-    float greatestMag = FLT_MIN;
-    int k = -1;
-    for( int j = 0; j < 3; ++j )
+    for( int b = 0; b < (int)blocks.size(); ++b )
     {
-        float val = n[j];
-        if( val < 0 )
-            val *= -1;
-        if( val > greatestMag )
+        geomreal t, u, w;
+        int k = intersectBlock( blocks[b], p.n, v.n, bestT, t, u, w );
+        if( k >= 0 )
         {
-            k = j;
-            greatestMag = val;
+            best = BLOCK * b + k;
+            bestT = t;
+            bestU = u;
+            bestW = w;
         }
     }
 
-    vec3f am = ap + t * v;
-    
-	bary[1] = (am.cross(ac))[k]/(ab.cross(ac))[k];
-    bary[2] = (ab.cross(am))[k]/(ab.cross(ac))[k];
-    bary[0] = 1-bary[1]-bary[2];
-    if( bary[0] < 0 || bary[1] < 0 || bary[1] > 1 || bary[2] < 0 || bary[2] > 1 )
+    if( best < 0 )
         return false;
 
+    const Face& face = faces[best];
+    vec3g bary( 1 - bestU - bestW, bestU, bestW );
+
     // if we get this far, we have an intersection.  Fill in the info.
-    i.setT( t );
-    if(parent->normals.size())
+    i.setT( bestT );
+    if(normals.size())
     {
         // use interpolated normals
-        i.setN( (bary[0] * parent->normals[ids[0]]
-                 + bary[1] * parent->normals[ids[1]]
-                 + bary[2] * parent->normals[ids[2]]).normalize() );
+        i.setN( vec3f( bary[0] * normals[face[0]]
+                       + bary[1] * normals[face[1]]
+                       + bary[2] * normals[face[2]] ).normalize() );
     } else {
-        i.setN( n );           // use face normal
+        // use face normal
+        const vec3g& a = vertices[face[0]];
+        i.setN( vec3f( ( vertices[face[1]] - a ).cross( vertices[face[2]] - a ).normalize() ) );
     }
     i.obj = this;
+    i.setBary( vec3f( bary ) );
+    i.setPrim( best );
+
+    return true;
+}
+
+// Intersect the ray from p in direction v with the eight faces of block,
+// by Moller and Trumbore's method, all lanes at once.  Returns the lane of
+// the nearest face hit at some t < tMax, the lowest lane on a tie, or -1;
+// the parameter and the barycentric coordinates of the second and third
+// corners of that face only are put in t, u and w.
+int Trimesh::intersectBlock( const FaceBlock& block, const geomreal p[3], const geomreal v[3],
+    geomreal tMax, geomreal& t, geomreal& u, geomreal& w ) const
+{
+    const geomreal eps = geomreal( RAY_EPSILON );
+
+#if defined(RAY_SIMD_AVX2) && !defined(RAY_DOUBLE_GEOMETRY)
+    __m256 vx = _mm256_set1_ps( v[0] ), vy = _mm256_set1_ps( v[1] ), vz = _mm256_set1_ps( v[2] );
+    __m256 e1x = _mm256_loadu_ps( block.e1x ), e1y = _mm256_loadu_ps( block.e1y ), e1z = _mm256_loadu_ps( block.e1z );
+    __m256 e2x = _mm256_loadu_ps( block.e2x ), e2y = _mm256_loadu_ps( block.e2y ), e2z = _mm256_loadu_ps( block.e2z );
+    __m256 sx = _mm256_sub_ps( _mm256_set1_ps( p[0] ), _mm256_loadu_ps( block.ax ) );
+    __m256 sy = _mm256_sub_ps( _mm256_set1_ps( p[1] ), _mm256_loadu_ps( block.ay ) );
+    __m256 sz = _mm256_sub_ps( _mm256_set1_ps( p[2] ), _mm256_loadu_ps( block.az ) );
+
+    __m256 hx = _mm256_sub_ps( _mm256_mul_ps( vy, e2z ), _mm256_mul_ps( vz, e2y ) );
+    __m256 hy = _mm256_sub_ps( _mm256_mul_ps( vz, e2x ), _mm256_mul_ps( vx, e2z ) );
+    __m256 hz = _mm256_sub_ps( _mm256_mul_ps( vx, e2y ), _mm256_mul_ps( vy, e2x ) );
+    __m256 det = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e1x, hx ), _mm256_mul_ps( e1y, hy ) ),
+        _mm256_mul_ps( e1z, hz ) );
+    __m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, e1z ), _mm256_mul_ps( sz, e1y ) );
+    __m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, e1x ), _mm256_mul_ps( sx, e1z ) );
+    __m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, e1y ), _mm256_mul_ps( sy, e1x ) );
+    __m256 inv = _mm256_div_ps( _mm256_set1_ps( 1.0f ), det );
+    __m256 lu = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, hx ), _mm256_mul_ps( sy, hy ) ),
+        _mm256_mul_ps( sz, hz ) ), inv );
+    __m256 lw = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( vx, qx ), _mm256_mul_ps( vy, qy ) ),
+        _mm256_mul_ps( vz, qz ) ), inv );
+    __m256 lt = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x, qx ), _mm256_mul_ps( e2y, qy ) ),
+        _mm256_mul_ps( e2z, qz ) ), inv );
 
-    // linearly interpolate materials
-    if( parent->materials.size() )
+    __m256 zero = _mm256_setzero_ps();
+    __m256 ok = _mm256_and_ps(
+        _mm256_and_ps( _mm256_cmp_ps( det, _mm256_loadu_ps( block.detMin ), _CMP_GE_OQ ),
+                       _mm256_and_ps( _mm256_cmp_ps( lu, zero, _CMP_GE_OQ ), _mm256_cmp_ps( lw, zero, _CMP_GE_OQ ) ) ),
+        _mm256_and_ps( _mm256_cmp_ps( _mm256_add_ps( lu, lw ), _mm256_set1_ps( 1.0f ), _CMP_LE_OQ ),
+                       _mm256_and_ps( _mm256_cmp_ps( lt, _mm256_set1_ps( eps ), _CMP_GE_OQ ),
+                                      _mm256_cmp_ps( lt, _mm256_set1_ps( tMax ), _CMP_LT_OQ ) ) ) );
+    if( !_mm256_movemask_ps( ok ) )
+        return -1;
+
+    // the least t over the lanes that hit, in every lane
+    __m256 tm = _mm256_blendv_ps( _mm256_set1_ps( numeric_limits<float>::infinity() ), lt, ok );
+    __m256 m = _mm256_min_ps( tm, _mm256_permute2f128_ps( tm, tm, 1 ) );
+    m = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    m = _mm256_min_ps( m, _mm256_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    int mask = _mm256_movemask_ps( _mm256_and_ps( ok, _mm256_cmp_ps( tm, m, _CMP_EQ_OQ ) ) );
+
+    int k = 0;
+    while( !( mask & ( 1 << k ) ) )
+        ++k;
+    __m256i lane = _mm256_set1_epi32( k );
+    t = _mm256_cvtss_f32( m );
+    u = _mm256_cvtss_f32( _mm256_permutevar8x32_ps( lu, lane ) );
+    w = _mm256_cvtss_f32( _mm256_permutevar8x32_ps( lw, lane ) );
+    return k;
+#elif defined(RAY_SIMD_SSE2) && !defined(RAY_DOUBLE_GEOMETRY)
+    __m128 vx = _mm_set1_ps( v[0] ), vy = _mm_set1_ps( v[1] ), vz = _mm_set1_ps( v[2] );
+    __m128 lt[2], lu[2], lw[2], tm[2], ok[2];
+    for( int h = 0; h < 2; ++h )
     {
-        Material *m = new Material();
-        for( int jj = 0; jj < 3; ++jj )
-            (*m) += bary[jj] * (*parent->materials[ ids[jj] ]);
-        i.setMaterial( m );
+        int o = 4 * h;
+        __m128 e1x = _mm_loadu_ps( block.e1x + o ), e1y = _mm_loadu_ps( block.e1y + o ), e1z = _mm_loadu_ps( block.e1z + o );
+        __m128 e2x = _mm_loadu_ps( block.e2x + o ), e2y = _mm_loadu_ps( block.e2y + o ), e2z = _mm_loadu_ps( block.e2z + o );
+        __m128 sx = _mm_sub_ps( _mm_set1_ps( p[0] ), _mm_loadu_ps( block.ax + o ) );
+        __m128 sy = _mm_sub_ps( _mm_set1_ps( p[1] ), _mm_loadu_ps( block.ay + o ) );
+        __m128 sz = _mm_sub_ps( _mm_set1_ps( p[2] ), _mm_loadu_ps( block.az + o ) );
+
+        __m128 hx = _mm_sub_ps( _mm_mul_ps( vy, e2z ), _mm_mul_ps( vz, e2y ) );
+        __m128 hy = _mm_sub_ps( _mm_mul_ps( vz, e2x ), _mm_mul_ps( vx, e2z ) );
+        __m128 hz = _mm_sub_ps( _mm_mul_ps( vx, e2y ), _mm_mul_ps( vy, e2x ) );
+        __m128 det = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ),
+            _mm_mul_ps( e1z, hz ) );
+        __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+        __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+        __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+        __m128 inv = _mm_div_ps( _mm_set1_ps( 1.0f ), det );
+        lu[h] = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ),
+            _mm_mul_ps( sz, hz ) ), inv );
+        lw[h] = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( vx, qx ), _mm_mul_ps( vy, qy ) ),
+            _mm_mul_ps( vz, qz ) ), inv );
+        lt[h] = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ),
+            _mm_mul_ps( e2z, qz ) ), inv );
+
+        __m128 zero = _mm_setzero_ps();
+        ok[h] = _mm_and_ps(
+            _mm_and_ps( _mm_cmpge_ps( det, _mm_loadu_ps( block.detMin + o ) ),
+                        _mm_and_ps( _mm_cmpge_ps( lu[h], zero ), _mm_cmpge_ps( lw[h], zero ) ) ),
+            _mm_and_ps( _mm_cmple_ps( _mm_add_ps( lu[h], lw[h] ), _mm_set1_ps( 1.0f ) ),
+                        _mm_and_ps( _mm_cmpge_ps( lt[h], _mm_set1_ps( eps ) ),
+                                    _mm_cmplt_ps( lt[h], _mm_set1_ps( tMax ) ) ) ) );
+        __m128 inf = _mm_set1_ps( numeric_limits<float>::infinity() );
+        tm[h] = _mm_or_ps( _mm_and_ps( ok[h], lt[h] ), _mm_andnot_ps( ok[h], inf ) );
     }
-    
-    return true;
+    if( !( _mm_movemask_ps( ok[0] ) | _mm_movemask_ps( ok[1] ) ) )
+        return -1;
+
+    // the least t over the lanes that hit, in every lane
+    __m128 m = _mm_min_ps( tm[0], tm[1] );
+    m = _mm_min_ps( m, _mm_shuffle_ps( m, m, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+    m = _mm_min_ps( m, _mm_shuffle_ps( m, m, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+    int mask = _mm_movemask_ps( _mm_and_ps( ok[0], _mm_cmpeq_ps( tm[0], m ) ) )
+        | _mm_movemask_ps( _mm_and_ps( ok[1], _mm_cmpeq_ps( tm[1], m ) ) ) << 4;
+
+    int k = 0;
+    while( !( mask & ( 1 << k ) ) )
+        ++k;
+    float lane[4];
+    t = _mm_cvtss_f32( m );
+    _mm_storeu_ps( lane, lu[k / 4] );
+    u = lane[k % 4];
+    _mm_storeu_ps( lane, lw[k / 4] );
+    w = lane[k % 4];
+    return k;
+#else
+    int best = -1;
+    for( int k = 0; k < BLOCK; ++k )
+    {
+        geomreal hx = v[1]*block.e2z[k] - v[2]*block.e2y[k];
+        geomreal hy = v[2]*block.e2x[k] - v[0]*block.e2z[k];
+        geomreal hz = v[0]*block.e2y[k] - v[1]*block.e2x[k];
+        geomreal det = block.e1x[k]*hx + block.e1y[k]*hy + block.e1z[k]*hz;
+        if( !( det >= block.detMin[k] ) )
+            continue;
+
+        geomreal sx = p[0] - block.ax[k], sy = p[1] - block.ay[k], sz = p[2] - block.az[k];
+        geomreal qx = sy*block.e1z[k] - sz*block.e1y[k];
+        geomreal qy = sz*block.e1x[k] - sx*block.e1z[k];
+        geomreal qz = sx*block.e1y[k] - sy*block.e1x[k];
+        geomreal inv = 1 / det;
+        geomreal lu = ( sx*hx + sy*hy + sz*hz ) * inv;
+        geomreal lw = ( v[0]*qx + v[1]*qy + v[2]*qz ) * inv;
+        geomreal lt = ( block.e2x[k]*qx + block.e2y[k]*qy + block.e2z[k]*qz ) * inv;
+        if( lu >= 0 && lw >= 0 && lu + lw <= 1 && lt >= eps && lt < tMax )
+        {
+            best = k;
+            tMax = t = lt;
+            u = lu;
+            w = lw;
+        }
+    }
+    return best;
+#endif
+}
+
+// linearly interpolate materials
+void Trimesh::interpolateMaterial( const isect& i, Material& m ) const
+{
+    const Face& face = faces[i.prim];
+
+    m = Material();
+    for( int jj = 0; jj < 3; ++jj )
+        m += i.bary[jj] * scene->materials[ materials[ face[jj] ] ];
 }
 
 void
@@ -154,16 +354,16 @@ Trimesh::generateNormals()
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        vec3f a = vertices[(**fi)[0]];
-        vec3f b = vertices[(**fi)[1]];
-        vec3f c = vertices[(**fi)[2]];
+        vec3g a = vertices[(*fi)[0]];
+        vec3g b = vertices[(*fi)[1]];
+        vec3g c = vertices[(*fi)[2]];
         
-        vec3f faceNormal = ((b-a).cross(c-a)).normalize();
+        vec3g faceNormal = ((b-a).cross(c-a)).normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += faceNormal;
+            ++numFaces[(*fi)[i]];
         }
     }
 
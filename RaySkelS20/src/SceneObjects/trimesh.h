@@ -7,74 +7,96 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
-
+// A triangle mesh.  The whole mesh is one SceneObject: triangles are just
+// index triples into the vertex array, and they all share the mesh's
+// material.  Vertices and normals are stored, and the triangle tests run,
+// in geomreal (single precision unless built with RAY_DOUBLE_GEOMETRY),
+// so the cost per triangle is
+//
+//     12 bytes            the Face itself
+//   + 12 bytes / vertex   positions, and as much again for normals or
+//                         4 for material indices when the mesh has them
+//
+// which for a typical closed mesh (about half as many vertices as faces)
+// comes to 18-24 bytes per triangle, against several hundred when every
+// face was its own SceneObject with its own copy of the material.
+//
+// The faces are also kept a second time, eight to a FaceBlock, as a corner
+// and two edges each laid out coordinate by coordinate, so that a ray can
+// be tested against a whole block at once.  That is another 40 bytes per
+// triangle, bought back many times over in intersection time.
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
-    typedef vector<vec3f> Normals;
-    typedef vector<vec3f> Vertices;
-    typedef vector<TrimeshFace*> Faces;
-    typedef vector<Material*> Materials;
+public:
+    typedef vec3<int> Face;             // indices of the three vertices
+
+private:
+    typedef vector<vec3g> Normals;
+    typedef vector<vec3g> Vertices;
+    typedef vector<Face> Faces;
+    typedef vector<MaterialTable::Index> Materials;
     Vertices vertices;
     Faces faces;
     Normals normals;
     Materials materials;
+
+    enum { BLOCK = 8 };
+
+    // Faces BLOCK*b to BLOCK*b + BLOCK-1, lane by lane: the first corner,
+    // the edges from it to the other two, and the least determinant that
+    // counts as the ray meeting the front of the face.  Lanes past the last
+    // face, and faces with no area, have an infinite detMin and never hit.
+    struct FaceBlock
+    {
+        geomreal ax[BLOCK], ay[BLOCK], az[BLOCK];
+        geomreal e1x[BLOCK], e1y[BLOCK], e1z[BLOCK];
+        geomreal e2x[BLOCK], e2y[BLOCK], e2z[BLOCK];
+        geomreal detMin[BLOCK];
+    };
+    typedef vector<FaceBlock> FaceBlocks;
+    FaceBlocks blocks;
+
+    void blockFace( int f );
+    int intersectBlock( const FaceBlock& block, const geomreal p[3], const geomreal v[3],
+        geomreal tMax, geomreal& t, geomreal& u, geomreal& w ) const;
+
 public:
-    Trimesh( Scene *scene, Material *mat, TransformNode *transform )
+    Trimesh( Scene *scene, MaterialTable::Index mat, TransformNode *transform )
         : MaterialSceneObject(scene, mat)
     {
         this->transform = transform;
     }
 
-    ~Trimesh();
-    
     // must add vertices, normals, and materials IN ORDER
     void addVertex( const vec3f & );
-    void addMaterial( Material *m );
+    void addMaterial( MaterialTable::Index m );
     void addNormal( const vec3f & );
 
     bool addFace( int a, int b, int c );
 
+    // Take over whole arrays, as the scene reader builds them, leaving the
+    // arguments empty.  takeFaces() returns false (and takes nothing) if a
+    // face refers to a vertex that doesn't exist.
+    void takeVertices( vector<vec3g>& v );
+    void takeNormals( vector<vec3g>& n );
+    bool takeFaces( vector<Face>& f );
+
     char *doubleCheck();
     
     void generateNormals();
-};
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
+    int numFaces() const { return (int)faces.size(); }
 
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
+    virtual size_t memoryBytes() const;
 
     virtual bool intersectLocal( const ray& r, isect& i ) const;
 
+    // per-vertex materials are interpolated over the face that was hit
+    virtual bool hasInterpolatedMaterial() const { return !materials.empty(); }
+    virtual void interpolateMaterial( const isect& i, Material& m ) const;
+
     virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
-    }
-    
+    virtual BoundingBox ComputeLocalBoundingBox() const;
 };
 
 
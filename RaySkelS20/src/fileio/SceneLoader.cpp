@@ -0,0 +1,55 @@
+#include "SceneLoader.h"
+#include "read.h"
+
+SceneLoader::SceneLoader()
+	: m_bFinished( false ), m_progress( 0.0 ), m_bBusy( false ), m_scene( NULL )
+{
+}
+
+SceneLoader::~SceneLoader()
+{
+	if( m_thread.joinable() )
+		m_thread.join();
+	delete m_scene;
+}
+
+bool SceneLoader::start( const string& filename )
+{
+	if( m_bBusy )
+		return false;
+
+	m_filename = filename;
+	m_progress = 0.0;
+	m_bFinished = false;
+	m_bBusy = true;
+	m_thread = std::thread( &SceneLoader::load, this );
+
+	return true;
+}
+
+void SceneLoader::load()
+{
+	Scene *s = readScene( m_filename, &m_pool, &m_progress );
+
+	// separate objects into bounded and unbounded
+	if( s )
+		s->initScene();
+
+	m_scene = s;
+	m_progress = 1.0;
+	m_bFinished = true;
+}
+
+Scene *SceneLoader::takeScene()
+{
+	if( !m_bBusy || !m_bFinished )
+		return NULL;
+
+	m_thread.join();
+
+	Scene *s = m_scene;
+	m_scene = NULL;
+	m_bBusy = false;
+
+	return s;
+}
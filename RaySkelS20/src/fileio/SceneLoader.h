@@ -0,0 +1,53 @@
+//
+// SceneLoader.h
+//
+// Reads a scene on a background thread, so that the UI can keep drawing
+// and show progress while a big file is parsed.  The UI polls finished()
+// and progress(), then collects the result with takeScene().
+//
+
+#ifndef __SCENELOADER_H__
+#define __SCENELOADER_H__
+
+#include <string>
+#include <thread>
+#include <atomic>
+
+#include "../render/WorkerPool.h"
+
+using namespace std;
+
+class Scene;
+
+class SceneLoader
+{
+public:
+	SceneLoader();
+	~SceneLoader();
+
+	// Start reading filename.  Returns false if a load is already under
+	// way (or finished but not yet collected).
+	bool start( const string& filename );
+
+	bool busy() const { return m_bBusy; }
+	bool finished() const { return m_bFinished; }
+	double progress() const { return m_progress; }
+	const string& filename() const { return m_filename; }
+
+	// Once finished(), hand over the scene, with initScene() already done,
+	// or NULL if it couldn't be read.  The caller owns it.
+	Scene *takeScene();
+
+private:
+	void load();
+
+	WorkerPool m_pool;
+	std::thread m_thread;
+	std::atomic<bool> m_bFinished;
+	std::atomic<double> m_progress;
+	bool m_bBusy;
+	string m_filename;
+	Scene *m_scene;
+};
+
+#endif // __SCENELOADER_H__
@@ -97,7 +97,8 @@ unsigned char *readBMP(char *fname, int& width, int& height)
 	return data; 
 } 
  
-void writeBMP(char *iname, int width, int height, unsigned char *data) 
+// Returns false if the file couldn't be opened or written.
+bool writeBMP(char *iname, int width, int height, unsigned char *data) 
 { 
 	int bytes, pad;
 	bytes = width * 3;
@@ -125,15 +126,19 @@ void writeBMP(char *iname, int width, int height, unsigned char *data)
 	bmih.biClrImportant = 0;
 
 	FILE *foo=fopen(iname, "wb"); 
+	if (!foo)
+		return false;
+
+	bool ok = true;
 
 	//	fwrite(&bmfh, sizeof(BMP_BITMAPFILEHEADER), 1, foo);
-	fwrite( &(bmfh.bfType), 2, 1, foo); 
-	fwrite( &(bmfh.bfSize), 4, 1, foo); 
-	fwrite( &(bmfh.bfReserved1), 2, 1, foo); 
-	fwrite( &(bmfh.bfReserved2), 2, 1, foo); 
-	fwrite( &(bmfh.bfOffBits), 4, 1, foo); 
+	ok = ok && fwrite( &(bmfh.bfType), 2, 1, foo) == 1; 
+	ok = ok && fwrite( &(bmfh.bfSize), 4, 1, foo) == 1; 
+	ok = ok && fwrite( &(bmfh.bfReserved1), 2, 1, foo) == 1; 
+	ok = ok && fwrite( &(bmfh.bfReserved2), 2, 1, foo) == 1; 
+	ok = ok && fwrite( &(bmfh.bfOffBits), 4, 1, foo) == 1; 
 
-	fwrite(&bmih, sizeof(BMP_BITMAPINFOHEADER), 1, foo); 
+	ok = ok && fwrite(&bmih, sizeof(BMP_BITMAPINFOHEADER), 1, foo) == 1; 
 
 	bytes /= height;
 	unsigned char* scanline = new unsigned char [bytes];
@@ -146,10 +151,12 @@ void writeBMP(char *iname, int width, int height, unsigned char *data)
 			scanline[i*3] = scanline[i*3+2];
 			scanline[i*3+2] = temp;
 		}
-		fwrite( scanline, bytes, 1, foo);
+		ok = ok && fwrite( scanline, bytes, 1, foo) == 1;
 	}
 
 	delete [] scanline;
 
-	fclose(foo);
+	// the data may only reach the disk when the file is closed
+	ok = fclose(foo) == 0 && ok;
+	return ok;
 } 
\ No newline at end of file
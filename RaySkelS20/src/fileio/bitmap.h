@@ -41,6 +41,6 @@ typedef struct {
 
 // global I/O routines
 extern unsigned char *readBMP(char *fname, int& width, int& height);
-extern void writeBMP(char *iname, int width, int height, unsigned char *data); 
+extern bool writeBMP(char *iname, int width, int height, unsigned char *data); 
 
 #endif
\ No newline at end of file
@@ -5,22 +5,147 @@
 #endif
 
 #include <cstring>
+#include <new>
+#include <sstream>
 
 #include "parse.h"
 
+// What the read functions share while parsing one top-level object: where
+// the nodes go, and scratch stacks that the elements of the tuples and dicts
+// still open pile up on until each one closes and is copied out.
+struct Parser
+{
+	Parser( istream& i, ObjArena& a, const char *t = NULL, const char *te = NULL )
+		: is( i ), arena( a ), text( t ), textEnd( te ) {}
+
+	istream& is;
+	ObjArena& arena;
+	const char *text, *textEnd;		// what is reads, when it lies in memory
+	vector<Obj*> items;
+	vector<dict::entry> fields;
+	vector<double> numbers;
+};
+
 static string readID( istream& is );
-static Obj *readString( istream& is );
-static Obj *readScalar( istream& is );
-static Obj *readTuple( istream& is );
-static Obj *readDict( istream& is );
-static Obj *readObject( istream& is );
-static Obj *readName( istream& is );
+static Obj *readString( Parser& p );
+static Obj *readScalar( Parser& p );
+static Obj *readTuple( Parser& p );
+static Obj *readDict( Parser& p, bool arrayFields = false );
+static Obj *readVecArray( Parser& p );
+static Obj *readFaceArray( Parser& p );
+static Obj *readScalarArray( Parser& p );
+static double readNumber( istream& is );
+static Obj *readObject( Parser& p );
+static Obj *readName( Parser& p );
 static void eatWS( istream& is );
 static void eatNL( istream& is );
 
-Obj *readFile( istream& is )
+Obj *readFile( istream& is, ObjArena& arena, const char *text, const char *textEnd )
+{
+	Parser p( is, arena, text, textEnd );
+	return readObject( p );
+}
+
+static const size_t ARENA_BLOCK = 64 * 1024;
+
+// About how much text each piece of a big array holds; smaller arrays are
+// read as they are parsed.
+static const size_t ARRAY_PIECE = 64 * 1024;
+
+ObjArena::ObjArena()
+	: next( NULL ), left( 0 ), used( 0 ), charge( MEM_PARSE_TREE )
+{}
+
+ObjArena::~ObjArena()
+{
+	clear();
+}
+
+void *ObjArena::alloc( size_t bytes )
+{
+	// keep everything aligned for doubles and pointers
+	bytes = ( bytes + 15 ) & ~size_t( 15 );
+
+	if( bytes > left ) {
+		size_t size = bytes > ARENA_BLOCK ? bytes : ARENA_BLOCK;
+		if( !MemoryStats::fits( size ) ) {
+			throw ParseError( "Scene is too big for the memory budget." );
+		}
+		blocks.push_back( new char[ size ] );
+		charge.add( size );
+		next = blocks.back();
+		left = size;
+	}
+
+	void *ret = next;
+	next += bytes;
+	left -= bytes;
+	used += bytes;
+	return ret;
+}
+
+const char *ObjArena::copyString( const string& s )
+{
+	char *ret = (char *)alloc( s.size() + 1 );
+	memcpy( ret, s.c_str(), s.size() + 1 );
+	return ret;
+}
+
+const char *ObjArena::intern( const string& s )
+{
+	map<string, const char*>::const_iterator i = interned.find( s );
+	if( i != interned.end() ) {
+		return i->second;
+	}
+	return interned[ s ] = copyString( s );
+}
+
+void ObjArena::unconverted( vector<ObjArrayBase*>& out ) const
+{
+	for( size_t a = 0; a < arrays.size(); ++a ) {
+		if( arrays[a]->pieces() ) {
+			out.push_back( arrays[a] );
+		}
+	}
+}
+
+void ObjArena::clear()
 {
-	return readObject( is );
+	for( size_t b = 0; b < blocks.size(); ++b ) {
+		delete [] blocks[b];
+	}
+	blocks.clear();
+	charge.set( 0 );
+	for( size_t a = 0; a < arrays.size(); ++a ) {
+		delete arrays[a];
+	}
+	arrays.clear();
+	interned.clear();
+	next = NULL;
+	left = 0;
+	used = 0;
+}
+
+dict::const_iterator dict::find( const string& key ) const
+{
+	for( size_t k = 0; k < count; ++k ) {
+		if( key == entries[k].first ) {
+			return entries + k;
+		}
+	}
+	return end();
+}
+
+template <class T, class A>
+static T *make( ObjArena& arena, const A& arg )
+{
+	return new( arena.alloc( sizeof( T ) ) ) T( arg );
+}
+
+template <class T, class A, class B>
+static T *make( ObjArena& arena, const A& a, const B& b )
+{
+	return new( arena.alloc( sizeof( T ) ) ) T( a, b );
 }
 
 static void eatWS( istream& is )
@@ -95,24 +220,30 @@ static bool eat( istream& is )
 	return false;
 }
 
-static Obj *readName( istream& is )
+static Obj *readName( Parser& p )
 {
+	istream& is = p.is;
 	string s = readID( is );
 
 	if( s == "true" ) {
-		return new BooleanObj( true );
+		return make<BooleanObj>( p.arena, true );
 	} else if( s == "false" ) {
-		return new BooleanObj( false );
+		return make<BooleanObj>( p.arena, false );
 	} else {
 		if( !eat( is ) ) {
-			return new IdObj( s );
+			return make<IdObj>( p.arena, p.arena.intern( s ) );
 		}
 
 		int ch = is.peek();
 		if( strchr( "}),;", ch ) != NULL ) {
-			return new IdObj( s );
+			return make<IdObj>( p.arena, p.arena.intern( s ) );
 		} else {
-			return new NamedObj( s, readObject( is ) );
+			// The bulky fields of a mesh or a sphere cloud are read
+			// straight into arrays.
+			const char *name = p.arena.intern( s );
+			bool bulky = ( s == "trimesh" || s == "polymesh" || s == "sphere_cloud" ) && ch == '{';
+			Obj *child = bulky ? readDict( p, true ) : readObject( p );
+			return make<NamedObj>( p.arena, name, child );
 		}
 	}
 }
@@ -137,8 +268,9 @@ static string readID( istream& is )
 	return ret;
 }
 
-static Obj *readString( istream& is ) 
+static Obj *readString( Parser& p ) 
 {
+	istream& is = p.is;
 	int ch;
 	string ret( "" );
 
@@ -148,7 +280,7 @@ static Obj *readString( istream& is )
 		ch = is.peek();
 		if( ch == '"' ) {
 			is.get();
-			return new StringObj( ret );
+			return make<StringObj>( p.arena, p.arena.copyString( ret ) );
 		} else {
 			ret += char( ch );
 		}
@@ -156,7 +288,7 @@ static Obj *readString( istream& is )
 	}
 }
 
-static Obj *readScalar( istream& is )
+static double readNumber( istream& is )
 {
 	int ch;
 	string ret( "" );
@@ -172,22 +304,281 @@ static Obj *readScalar( istream& is )
 		}
 	}
 
-	return new ScalarObj( atof( ret.c_str() ) );
+	if( ret.empty() ) {
+		throw ParseError( "Parse error: expected a number." );
+	}
+
+	return atof( ret.c_str() );
+}
+
+static Obj *readScalar( Parser& p )
+{
+	return make<ScalarObj>( p.arena, readNumber( p.is ) );
+}
+
+// Read a tuple of numbers, such as one point or face of a mesh, into
+// p.numbers.
+static void readNumbers( Parser& p )
+{
+	istream& is = p.is;
+
+	p.numbers.clear();
+	eat( is );
+	if( is.get() != '(' ) {
+		throw ParseError( "Parse error: expected a tuple." );
+	}
+
+	while( true ) {
+		eat( is );
+		p.numbers.push_back( readNumber( is ) );
+		eat( is );
+		int ch = is.get();
+		if( ch == ')' ) {
+			return;
+		} else if( ch != ',' ) {
+			throw ParseError( "Parse error: expected comma." );
+		}
+	}
+}
+
+// Call item() for each element of a tuple whose elements are themselves
+// tuples, as the points and faces of a mesh are.
+template <class F>
+static void readTupleOfTuples( Parser& p, F item )
+{
+	istream& is = p.is;
+
+	eat( is );
+	if( is.get() != '(' ) {
+		throw ParseError( "Parse error: expected a tuple." );
+	}
+	eat( is );
+	if( is.peek() == ')' ) {
+		is.get();
+		return;
+	}
+
+	while( true ) {
+		item();
+		eat( is );
+		int ch = is.get();
+		if( ch == ')' ) {
+			return;
+		} else if( ch != ',' ) {
+			throw ParseError( "Parse error: expected comma." );
+		}
+	}
+}
+
+static void readItem( Parser& p, ObjArray<vec3g>& out )
+{
+	readNumbers( p );
+	const vector<double>& v = p.numbers;
+	if( v.size() != 3 ) {
+		ostringstream oss;
+		oss << "Bad tuple size " << v.size() << ", expected 3";
+		throw ParseError( oss.str() );
+	}
+	out.push_back( vec3g( v[0], v[1], v[2] ) );
+}
+
+// Faces are cut into triangles as they are read, as a fan around the first
+// vertex, which is right as long as they are convex.
+static void readItem( Parser& p, ObjArray< vec3<int> >& out )
+{
+	readNumbers( p );
+	const vector<double>& v = p.numbers;
+	if( v.size() < 3 ) {
+		throw ParseError( "Faces must have at least 3 vertices." );
+	}
+	for( size_t i = 2; i < v.size(); ++i ) {
+		out.push_back( vec3<int>( (int)v[0], (int)v[i-1], (int)v[i] ) );
+	}
+}
+
+static void readItem( Parser& p, ObjArray<geomreal>& out )
+{
+	eat( p.is );
+	out.push_back( geomreal( readNumber( p.is ) ) );
+}
+
+// Where the next thing in the text after pos starts, stepping over a string
+// or a comment as a whole.
+static const char *stepOver( const char *pos, const char *end )
+{
+	char ch = *pos++;
+
+	if( ch == '"' ) {
+		while( pos < end && *pos != '"' )
+			++pos;
+		return pos < end ? pos + 1 : end;
+	} else if( ch == '/' && pos < end && *pos == '/' ) {
+		while( pos < end && *pos != '\n' )
+			++pos;
+	} else if( ch == '/' && pos < end && *pos == '*' ) {
+		for( ++pos; pos < end; ++pos ) {
+			if( *pos == '*' && pos + 1 < end && pos[1] == '/' ) {
+				return pos + 2;
+			}
+		}
+	}
+	return pos;
+}
+
+// If the text is in memory and the array at is spans more than one piece,
+// cut it into pieces at top-level commas, leave them in out to be
+// converted later, and step over the array.  Otherwise leave it to be read
+// there and then, and return false.
+template <class T>
+static bool delimitArray( Parser& p, ObjArray<T>& out )
+{
+	istream& is = p.is;
+
+	if( !p.text ) {
+		return false;
+	}
+	eat( is );
+	streamoff at = is.tellg();
+	if( at < 0 || is.peek() != '(' ) {
+		return false;
+	}
+
+	const char *begin = p.text + at, *pos = begin + 1;
+	vector<const char*> cuts( 1, begin );
+	int depth = 0;
+
+	while( true ) {
+		if( pos >= p.textEnd ) {
+			throw ParseError( "Parse error: unterminated tuple." );
+		}
+		char ch = *pos;
+		if( ch == '(' ) {
+			++depth;
+		} else if( ch == ')' ) {
+			if( depth-- == 0 ) {
+				break;
+			}
+		} else if( ch == ',' && depth == 0 && size_t( pos - cuts.back() ) >= ARRAY_PIECE ) {
+			cuts.push_back( pos );
+		}
+		pos = stepOver( pos, p.textEnd );
+	}
+
+	if( cuts.size() == 1 ) {
+		return false;
+	}
+	cuts.push_back( pos );
+	out.setPieces( cuts );
+	is.ignore( pos + 1 - begin );
+	return true;
+}
+
+static Obj *readVecArray( Parser& p )
+{
+	ObjArray<vec3g> *ret = p.arena.makeArray<vec3g>();
+
+	if( !delimitArray( p, *ret ) ) {
+		readTupleOfTuples( p, [&]() { readItem( p, *ret ); } );
+	}
+
+	return make<VecArrayObj>( p.arena, ret );
 }
 
-static Obj *readTuple( istream& is )
+static Obj *readFaceArray( Parser& p )
 {
-	vector<Obj*> ret;
+	ObjArray< vec3<int> > *ret = p.arena.makeArray< vec3<int> >();
+
+	if( !delimitArray( p, *ret ) ) {
+		readTupleOfTuples( p, [&]() { readItem( p, *ret ); } );
+	}
+
+	return make<FaceArrayObj>( p.arena, ret );
+}
+
+template <class T>
+static void readPieceOf( const char *begin, const char *end, ObjArray<T>& out )
+{
+	TextBuf text( begin, end );
+	istream is( &text );
+	ObjArena scratch;
+	Parser p( is, scratch );
+
+	while( true ) {
+		readItem( p, out );
+		eat( is );
+		int ch = is.get();
+		if( ch == EOF ) {
+			return;
+		} else if( ch != ',' ) {
+			throw ParseError( "Parse error: expected comma." );
+		}
+	}
+}
+
+void readPiece( const char *begin, const char *end, ObjArray<vec3g>& out )
+{
+	readPieceOf( begin, end, out );
+}
+
+void readPiece( const char *begin, const char *end, ObjArray< vec3<int> >& out )
+{
+	readPieceOf( begin, end, out );
+}
+
+void readPiece( const char *begin, const char *end, ObjArray<geomreal>& out )
+{
+	readPieceOf( begin, end, out );
+}
+
+static Obj *readScalarArray( Parser& p )
+{
+	istream& is = p.is;
+	ObjArray<geomreal> *ret = p.arena.makeArray<geomreal>();
+
+	if( delimitArray( p, *ret ) ) {
+		return make<ScalarArrayObj>( p.arena, ret );
+	}
+
+	eat( is );
+	if( is.get() != '(' ) {
+		throw ParseError( "Parse error: expected a tuple." );
+	}
+	eat( is );
+	if( is.peek() == ')' ) {
+		is.get();
+		return make<ScalarArrayObj>( p.arena, ret );
+	}
+
+	while( true ) {
+		readItem( p, *ret );
+		eat( is );
+		int ch = is.get();
+		if( ch == ')' ) {
+			return make<ScalarArrayObj>( p.arena, ret );
+		} else if( ch != ',' ) {
+			throw ParseError( "Parse error: expected comma." );
+		}
+	}
+}
+
+static Obj *readTuple( Parser& p )
+{
+	istream& is = p.is;
+	size_t first = p.items.size();
 
 	is.get();
 
 	while( true ) {
 		eat( is );
-		ret.push_back( readObject( is ) );	
+		Obj *item = readObject( p );
+		p.items.push_back( item );
 		eat( is );
 		int ch = is.get();
 		if( ch == ')' ) {
-			return new TupleObj( ret );
+			size_t n = p.items.size() - first;
+			Obj **items = p.arena.copy( &p.items[ first ], n );
+			p.items.resize( first );
+			return make<TupleObj>( p.arena, mytuple( items, n ) );
 		} else if( ch == ',' ) {
 			continue;
 		} else {
@@ -198,12 +589,14 @@ static Obj *readTuple( istream& is )
 	throw ParseError( "Parse error: internal error." );
 }
 
-static Obj *readDict( istream& is )
+// With arrayFields set, the points, normals and faces fields of a mesh,
+// and the centers and radii of a sphere cloud, are read straight into
+// arrays instead of trees of tuples.
+static Obj *readDict( Parser& p, bool arrayFields )
 {
-	string lhs;
-	Obj *rhs;
-
-	map<string,Obj*> ret;
+	istream& is = p.is;
+	dict::entry field;
+	size_t first = p.fields.size();
 
 	is.get();
 
@@ -211,15 +604,36 @@ static Obj *readDict( istream& is )
 		eat( is );
 		if( is.peek() == '}' ) {
 			is.get();
-			return new DictObj( ret );
+			size_t n = p.fields.size() - first;
+			dict::entry *fields = n ? p.arena.copy( &p.fields[ first ], n ) : NULL;
+			p.fields.resize( first );
+			return make<DictObj>( p.arena, dict( fields, n ) );
 		}
-		lhs = readID( is );
+		field.first = p.arena.intern( readID( is ) );
 		eat( is );
 		if( is.get() != '=' ) {
 			throw ParseError( "Parse error: expected equals." );
 		}
-		rhs = readObject( is );
-		ret[ lhs ] = rhs;
+		if( arrayFields && ( !strcmp( field.first, "points" ) || !strcmp( field.first, "normals" )
+				|| !strcmp( field.first, "centers" ) ) ) {
+			field.second = readVecArray( p );
+		} else if( arrayFields && !strcmp( field.first, "faces" ) ) {
+			field.second = readFaceArray( p );
+		} else if( arrayFields && !strcmp( field.first, "radii" ) ) {
+			field.second = readScalarArray( p );
+		} else {
+			field.second = readObject( p );
+		}
+
+		// keys are interned, so a repeated one is the same pointer; the
+		// last value given wins
+		size_t k = first;
+		while( k < p.fields.size() && p.fields[k].first != field.first )
+			++k;
+		if( k < p.fields.size() )
+			p.fields[k] = field;
+		else
+			p.fields.push_back( field );
 		eat( is );
 		int ch = is.peek();
 		if( ch == ';' ) {
@@ -230,8 +644,9 @@ static Obj *readDict( istream& is )
 	}
 }
 
-static Obj *readObject( istream& is )
+static Obj *readObject( Parser& p )
 {
+	istream& is = p.is;
 	if( !eat( is ) ) {
 		return NULL;
 	}
@@ -239,24 +654,49 @@ static Obj *readObject( istream& is )
 	int ch = is.peek();
 
 	if( (ch == '-') || (ch >= '0' && ch <= '9') ) {
-		return readScalar( is );
+		return readScalar( p );
 	} else if( ch == '"' ) {
-		return readString( is );
+		return readString( p );
 	} else if( ch == '(' ) {
-		return readTuple( is );
+		return readTuple( p );
 	} else if( ch == '{' ) {
-		return readDict( is );
+		return readDict( p );
 	} else {
-		return readName( is );
+		return readName( p );
+	}
+}
+
+vector<size_t> findObjectEnds( const string& text, size_t pos )
+{
+	vector<size_t> ends;
+	int depth = 0;
+	const char *begin = text.data(), *end = begin + text.size();
+	const char *at = begin + pos;
+
+	while( at < end ) {
+		char ch = *at;
+		at = stepOver( at, end );
+
+		if( ch == '(' || ch == '{' ) {
+			++depth;
+		} else if( ch == ')' || ch == '}' ) {
+			// Unbalanced input is left for readFile() to complain about.
+			if( --depth == 0 )
+				ends.push_back( at - begin );
+			else if( depth < 0 )
+				break;
+		}
 	}
+
+	return ends;
 }
 
 /*
 int main( void )
 {
-	Obj *o = readFile( cin );
+	ObjArena arena;
+	Obj *o = readFile( cin, arena );
 	o->printOn( cout );
-	delete o;
 	return 0;
 }
 */
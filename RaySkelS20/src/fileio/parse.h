@@ -9,6 +9,9 @@
 #include <map>
 #include <iostream>
 
+#include "../vecmath/vecmath.h"
+#include "../render/MemoryStats.h"
+
 using namespace std;
 
 class Exception
@@ -29,9 +32,164 @@ inline ostream& operator <<( ostream& os, const Exception& x )
 }
 
 class Obj;
+template <class T> class ObjArray;
+
+// Anything the arena has to delete when it is cleared.
+//
+// A big array of a trimesh or sphere cloud, read from text that lies in
+// memory, is only delimited by the parser, which cuts its text at top-level
+// commas into pieces of some tens of kilobytes.  The pieces can be converted
+// one by one on any threads, and are then joined in order, so that a single
+// huge mesh isn't left to one thread to read.
+class ObjArrayBase
+{
+public:
+	virtual ~ObjArrayBase() {}
+
+	// Pieces of text still to be converted, none once joined.
+	size_t pieces() const { return cuts.empty() ? 0 : cuts.size() - 1; }
+	size_t pieceBytes( size_t k ) const { return cuts[k+1] - cuts[k]; }
+
+	// Convert piece k; different pieces may be converted at once.
+	virtual void convertPiece( size_t k ) = 0;
+
+	// Put the converted pieces together, in order.
+	virtual void join() = 0;
+
+protected:
+	// The opening parenthesis, the commas the text was cut at, and the
+	// closing parenthesis: piece k lies between cuts[k] and cuts[k+1].
+	vector<const char*> cuts;
+};
+
+// Reads text where it lies, so that parsing it doesn't need a copy of it.
+class TextBuf
+	: public streambuf
+{
+public:
+	TextBuf( const char *begin, const char *end )
+	{
+		setg( const_cast<char*>( begin ), const_cast<char*>( begin ), const_cast<char*>( end ) );
+	}
+
+protected:
+	// Only telling where we are is needed.
+	virtual pos_type seekoff( off_type off, ios_base::seekdir dir, ios_base::openmode )
+	{
+		if( dir == ios_base::cur && off == 0 )
+			return pos_type( gptr() - eback() );
+		return pos_type( off_type( -1 ) );
+	}
+};
+
+// The parse tree lives in an ObjArena: every node, tuple and dict body and
+// string is carved out of a few big blocks, and the whole tree is freed at
+// once when the arena goes away.  Nodes are never deleted one by one, so
+// none of them own anything that needs a destructor.
+class ObjArena
+{
+public:
+	ObjArena();
+	~ObjArena();
+
+	// Throws a ParseError rather than take another block past the
+	// MemoryStats budget.
+	void *alloc( size_t bytes );
+
+	template <class T>
+	T *copy( const T *items, size_t n )
+	{
+		T *ret = (T *)alloc( n * sizeof( T ) );
+		for( size_t k = 0; k < n; ++k )
+			ret[k] = items[k];
+		return ret;
+	}
+
+	// A copy of s in the arena.  intern() hands out one copy per distinct
+	// string, for names and dict keys that repeat all through a file.
+	const char *copyString( const string& s );
+	const char *intern( const string& s );
 
-typedef vector<Obj*> 		mytuple;
-typedef map<string,Obj*> 	dict;
+	// A growable array that lives as long as the arena, for the big
+	// fields of a trimesh.
+	template <class T>
+	ObjArray<T> *makeArray()
+	{
+		ObjArray<T> *ret = new ObjArray<T>;
+		arrays.push_back( ret );
+		return ret;
+	}
+
+	// The arrays with pieces of text still to be converted, added to out.
+	void unconverted( vector<ObjArrayBase*>& out ) const;
+
+	// Free everything at once.
+	void clear();
+
+	size_t bytesUsed() const { return used; }
+
+private:
+	ObjArena( const ObjArena& );
+	ObjArena& operator =( const ObjArena& );
+
+	vector<char*> blocks;
+	char *next;
+	size_t left;
+	size_t used;
+	MemoryCharge charge;
+	vector<ObjArrayBase*> arrays;
+	map<string, const char*> interned;
+};
+
+// The elements of a tuple, as an array in the arena.
+class mytuple
+{
+public:
+	typedef Obj * const *const_iterator;
+
+	mytuple()
+		: items( NULL ), count( 0 ) {}
+	mytuple( Obj * const *i, size_t n )
+		: items( i ), count( n ) {}
+
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	Obj *operator[]( size_t i ) const { return items[i]; }
+
+	const_iterator begin() const { return items; }
+	const_iterator end() const { return items + count; }
+
+private:
+	Obj * const *items;
+	size_t count;
+};
+
+// The fields of a dict, as an array in the arena.  Dicts in scene files
+// have a handful of fields, so find() just looks at each in turn.
+class dict
+{
+public:
+	struct entry
+	{
+		const char *first;
+		Obj *second;
+	};
+	typedef const entry *const_iterator;
+
+	dict()
+		: entries( NULL ), count( 0 ) {}
+	dict( const entry *e, size_t n )
+		: entries( e ), count( n ) {}
+
+	size_t size() const { return count; }
+	const_iterator begin() const { return entries; }
+	const_iterator end() const { return entries + count; }
+	const_iterator find( const string& key ) const;
+
+private:
+	const entry *entries;
+	size_t count;
+};
 
 class ParseError
 	: public Exception
@@ -52,6 +210,92 @@ public:
 	{}
 };
 
+// Read one piece of an array's text, a comma separated run of tuples, or
+// of numbers for an array of scalars.
+void readPiece( const char *begin, const char *end, ObjArray<vec3g>& out );
+void readPiece( const char *begin, const char *end, ObjArray< vec3<int> >& out );
+void readPiece( const char *begin, const char *end, ObjArray<geomreal>& out );
+
+// The points, normals and faces of a trimesh are read straight into one of
+// these, already in the form the Trimesh keeps them, rather than into a
+// tree of tuples.  The mesh then takes the whole vector over.
+template <class T>
+class ObjArray
+	: public ObjArrayBase
+{
+public:
+	ObjArray()
+		: charge( MEM_PARSE_TREE ) {}
+	virtual ~ObjArray()
+	{
+		for( size_t k = 0; k < parts.size(); ++k )
+			delete parts[k];
+	}
+
+	// Leave the text between each cut and the next to be converted later.
+	void setPieces( vector<const char*>& c )
+	{
+		cuts.swap( c );
+		parts.resize( pieces(), NULL );
+	}
+
+	virtual void convertPiece( size_t k )
+	{
+		parts[k] = new ObjArray<T>;
+		readPiece( cuts[k] + 1, cuts[k+1], *parts[k] );
+	}
+
+	virtual void join()
+	{
+		size_t n = items.size();
+		for( size_t k = 0; k < parts.size(); ++k )
+			n += parts[k]->size();
+		if( !MemoryStats::fits( ( n - items.size() ) * sizeof( T ) ) ) {
+			throw ParseError( "Scene is too big for the memory budget." );
+		}
+		items.reserve( n );
+		charge.set( items.capacity() * sizeof( T ) );
+
+		for( size_t k = 0; k < parts.size(); ++k ) {
+			items.insert( items.end(), parts[k]->items.begin(), parts[k]->items.end() );
+			delete parts[k];
+			parts[k] = NULL;
+		}
+		parts.clear();
+		cuts.clear();
+	}
+
+	// Throws a ParseError rather than grow past the MemoryStats budget.
+	void push_back( const T& x )
+	{
+		if( items.size() == items.capacity() ) {
+			size_t more = items.empty() ? 64 : items.size();
+			if( !MemoryStats::fits( more * sizeof( T ) ) ) {
+				throw ParseError( "Scene is too big for the memory budget." );
+			}
+			items.reserve( items.size() + more );
+			charge.set( items.capacity() * sizeof( T ) );
+		}
+		items.push_back( x );
+	}
+
+	size_t size() const { return items.size(); }
+	const T& operator[]( size_t i ) const { return items[i]; }
+
+	// Hand the items over, leaving this empty.
+	void takeInto( vector<T>& out )
+	{
+		out.swap( items );
+		vector<T>().swap( items );
+		charge.set( 0 );
+	}
+
+private:
+	vector<T> items;
+	MemoryCharge charge;
+	vector<ObjArray<T>*> parts;
+};
+
 class Obj
 {
 public:
@@ -77,6 +321,13 @@ public:
 	{ throw ObjTypeMismatch( string( "named" ), getTypeName() ); }
 	virtual Obj 		 *getChild() const
 	{ throw ObjTypeMismatch( string( "named" ), getTypeName() ); }
+
+	virtual ObjArray<vec3g> *getVecArray() const
+	{ throw ObjTypeMismatch( string( "vector array" ), getTypeName() ); }
+	virtual ObjArray< vec3<int> > *getFaceArray() const
+	{ throw ObjTypeMismatch( string( "face array" ), getTypeName() ); }
+	virtual ObjArray<geomreal> *getScalarArray() const
+	{ throw ObjTypeMismatch( string( "scalar array" ), getTypeName() ); }
 protected:
 	Obj() {}
 
@@ -125,7 +376,7 @@ class IdObj
 	: public Obj
 {
 public:
-	IdObj( const string& s )
+	IdObj( const char *s )
 		: Obj()
 		, val( s )
 	{}
@@ -136,14 +387,14 @@ public:
 	virtual string getID() const { return val; }
 
 private:
-	string val;
+	const char *val;
 };
 
 class StringObj
 	: public Obj
 {
 public:
-	StringObj( const string& s )
+	StringObj( const char *s )
 		: Obj()
 		, val( s )
 	{}
@@ -154,7 +405,7 @@ public:
 	virtual string getString() const { return val; }
 
 private:
-	string val;
+	const char *val;
 };
 
 class TupleObj
@@ -165,19 +416,14 @@ public:
 		: Obj()
 		, val( vec )
 	{}
-	virtual ~TupleObj()
-	{
-		for( mytuple::iterator i = val.begin(); i != val.end(); ++i ) {
-			delete (*i);
-		}
-	}
+	virtual ~TupleObj() {}
 
 	virtual string getTypeName() const { return string( "tuple" ); }
 	virtual void printOn( ostream& os ) const 
 	{ 
 		bool first = true;
 		os << '(';
-		for( int idx = 0; idx < val.size(); ++idx ) {
+		for( size_t idx = 0; idx < val.size(); ++idx ) {
 			if( first ) {
 				first = false;
 			} else {
@@ -202,12 +448,7 @@ public:
 		: Obj()
 		, val( m )
 	{}
-	virtual ~DictObj()
-	{
-		for( dict::iterator i = val.begin(); i != val.end(); ++i ) {
-			delete ((*i).second);
-		}
-	}
+	virtual ~DictObj() {}
 
 	virtual string getTypeName() const { return string( "dict" ); }
 	virtual void printOn( ostream& os ) const 
@@ -232,19 +473,98 @@ private:
 	dict val;
 };
 
+// The points or normals of a trimesh.
+class VecArrayObj
+	: public Obj
+{
+public:
+	VecArrayObj( ObjArray<vec3g> *a )
+		: Obj()
+		, val( a )
+	{}
+	virtual ~VecArrayObj() {}
+
+	virtual string getTypeName() const { return string( "vector array" ); }
+	virtual void printOn( ostream& os ) const 
+	{ 
+		os << '(';
+		for( size_t idx = 0; idx < val->size(); ++idx ) {
+			const vec3g& v = (*val)[ idx ];
+			os << ( idx ? ", (" : "(" ) << v[0] << ", " << v[1] << ", " << v[2] << ')';
+		}
+		os << ')';
+	}
+
+	virtual ObjArray<vec3g> *getVecArray() const { return val; }
+
+private:
+	ObjArray<vec3g> *val;
+};
+
+// The faces of a trimesh, already cut into triangles.
+class FaceArrayObj
+	: public Obj
+{
+public:
+	FaceArrayObj( ObjArray< vec3<int> > *a )
+		: Obj()
+		, val( a )
+	{}
+	virtual ~FaceArrayObj() {}
+
+	virtual string getTypeName() const { return string( "face array" ); }
+	virtual void printOn( ostream& os ) const 
+	{ 
+		os << '(';
+		for( size_t idx = 0; idx < val->size(); ++idx ) {
+			const vec3<int>& f = (*val)[ idx ];
+			os << ( idx ? ", (" : "(" ) << f[0] << ", " << f[1] << ", " << f[2] << ')';
+		}
+		os << ')';
+	}
+
+	virtual ObjArray< vec3<int> > *getFaceArray() const { return val; }
+
+private:
+	ObjArray< vec3<int> > *val;
+};
+
+class ScalarArrayObj
+	: public Obj
+{
+public:
+	ScalarArrayObj( ObjArray<geomreal> *a )
+		: Obj()
+		, val( a )
+	{}
+	virtual ~ScalarArrayObj() {}
+
+	virtual string getTypeName() const { return string( "scalar array" ); }
+	virtual void printOn( ostream& os ) const 
+	{ 
+		os << '(';
+		for( size_t idx = 0; idx < val->size(); ++idx ) {
+			os << ( idx ? ", " : "" ) << (*val)[ idx ];
+		}
+		os << ')';
+	}
+
+	virtual ObjArray<geomreal> *getScalarArray() const { return val; }
+
+private:
+	ObjArray<geomreal> *val;
+};
+
 class NamedObj
 	: public Obj
 {
 public:
-	NamedObj( const string& n, Obj *ch )
+	NamedObj( const char *n, Obj *ch )
 		: Obj()
 		, name( n )
 		, child( ch )
 	{}
-	virtual ~NamedObj()
-	{
-		delete child;
-	}
+	virtual ~NamedObj() {}
 
 	virtual string getTypeName() const { return string( "named" ); }
 	virtual void printOn( ostream& os ) const 
@@ -257,10 +577,22 @@ public:
 	virtual Obj *getChild() const { return child; }
 
 private:
-	string name;
+	const char *name;
 	Obj *child;
 };
 
-Obj *readFile( istream& is );
+// Read the next top-level object, or return NULL at the end of the input.
+// The object lives in arena, and is freed along with it.  When is reads
+// the text [text, textEnd) in place, through a TextBuf, the big arrays of
+// meshes and sphere clouds are only delimited, and are left to be converted
+// through ObjArena::unconverted().
+Obj *readFile( istream& is, ObjArena& arena,
+	const char *text = NULL, const char *textEnd = NULL );
+
+// Offsets into text, from pos on, just past the end of each top-level
+// object that ends in a closing brace or parenthesis.  The text between
+// two such offsets holds whole objects only, so separate stretches can be
+// handed to readFile() independently.
+vector<size_t> findObjectEnds( const string& text, size_t pos );
 
 #endif // __PARSE_H__
@@ -5,12 +5,17 @@
 #include <cmath>
 #include <cstring>
 #include <fstream>
+#include <sstream>
 #include <strstream>
+#include <iterator>
+#include <functional>
 
 #include <vector>
 
 #include "read.h"
 #include "parse.h"
+#include "../render/WorkerPool.h"
+#include "../render/MemoryStats.h"
 
 #include "../scene/scene.h"
 #include "../SceneObjects/trimesh.h"
@@ -19,9 +24,10 @@
 #include "../SceneObjects/Cylinder.h"
 #include "../SceneObjects/Sphere.h"
 #include "../SceneObjects/Square.h"
+#include "../SceneObjects/SphereCloud.h"
 #include "../scene/light.h"
 
-typedef map<string,Material*> mmap;
+typedef map<string,MaterialTable::Index> mmap;
 
 static void processObject( Obj *obj, Scene *scene, mmap& materials );
 static Obj *getColorField( Obj *obj );
@@ -32,12 +38,16 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 	const mmap& materials, TransformNode *transform );
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform );
+static void processSphereCloud( Obj *child, Scene *scene,
+	const mmap& materials, TransformNode *transform );
 static void processCamera( Obj *child, Scene *scene );
-static Material *getMaterial( Obj *child, const mmap& bindings );
-static Material *processMaterial( Obj *child, mmap *bindings = NULL );
+static MaterialTable::Index getMaterial( Obj *child, Scene *scene, const mmap& bindings );
+static MaterialTable::Index processMaterial( Obj *child, Scene *scene, mmap *bindings = NULL );
 static void verifyTuple( const mytuple& tup, size_t size );
+static void parallelFor( WorkerPool *pool, size_t n, size_t grain,
+	const function<void (size_t, size_t)>& body );
 
-Scene *readScene( const string& filename )
+Scene *readScene( const string& filename, WorkerPool *pool, std::atomic<double> *progress )
 {
 	ifstream ifs( filename.c_str() );
 	if( !ifs ) {
@@ -46,17 +56,47 @@ Scene *readScene( const string& filename )
 	}
 
 	try {
-		return readScene( ifs );
+		return readScene( ifs, pool, progress );
 	} catch( ParseError& pe ) {
 		cout << "Parse error: " << pe << endl;
 		return NULL;
 	}
 }
 
-Scene *readScene( istream& is )
+Scene *readScene( istream& input, WorkerPool *pool, std::atomic<double> *progress )
 {
-	Scene *ret = new Scene;
-	
+	// The whole file is read in up front so that it can be cut into
+	// stretches of top-level objects and parsed in parallel.  It is charged
+	// to the parse tree for as long as the parse lasts, and checked against
+	// the budget before it is read if its size can be told beforehand.
+	MemoryCharge textCharge( MEM_PARSE_TREE );
+	streamoff size = -1;
+	istream::pos_type here = input.tellg();
+	if( here != istream::pos_type( -1 ) && input.seekg( 0, ios::end ) ) {
+		size = input.tellg() - here;
+		input.seekg( here );
+	}
+	input.clear();
+
+	if( size > 0 ) {
+		if( !MemoryStats::fits( size ) )
+			throw ParseError( "Scene is too big for the memory budget." );
+		textCharge.set( (size_t)size );
+	}
+
+	string text;
+	if( size > 0 )
+		text.reserve( (size_t)size );
+	text.assign( istreambuf_iterator<char>( input ), istreambuf_iterator<char>() );
+
+	if( textCharge.get() != text.size() ) {
+		if( text.size() > textCharge.get() && !MemoryStats::fits( text.size() - textCharge.get() ) )
+			throw ParseError( "Scene is too big for the memory budget." );
+		textCharge.set( text.size() );
+	}
+	TextBuf whole( text.data(), text.data() + text.size() );
+	istream is( &whole );
+
 	// Extract the file header
 	static const int MAXNAME = 80;
 	char buf[ MAXNAME ];
@@ -87,22 +127,133 @@ Scene *readScene( istream& is )
 		throw ParseError( string( oss.str() ) );
 	}
 
-	// vector<Obj*> result;
+	size_t start = is.eof() ? text.size() : (size_t)is.tellg();
+
+	// Cut the body into a few stretches per worker at object boundaries.
+	// A single huge object (a big polymesh, say) stays in one stretch.
+	vector<size_t> cuts( 1, start );
+	size_t stretches = pool ? 4 * pool->size() : 1;
+	size_t target = ( text.size() - start ) / stretches + 1;
+
+	vector<size_t> ends = findObjectEnds( text, start );
+	for( size_t e = 0; e < ends.size(); ++e )
+		if( ends[e] - cuts.back() >= target )
+			cuts.push_back( ends[e] );
+	if( cuts.back() < text.size() )
+		cuts.push_back( text.size() );
+
+	// Parsing text is the first half of the progress bar, building the
+	// scene from the parse trees the second.
+	// Each stretch gets its own arena, dropped as soon as its objects have
+	// been turned into scene objects.
+	vector< vector<Obj*> > parsed( cuts.size() - 1 );
+	vector<ObjArena> arenas( parsed.size() );
+	std::atomic<size_t> bytesParsed( 0 );
+
+	parallelFor( pool, parsed.size(), 1, [&]( size_t begin, size_t end ) {
+		for( size_t k = begin; k < end; ++k ) {
+			const char *from = text.data() + cuts[k], *to = text.data() + cuts[k+1];
+			TextBuf stretch( from, to );
+			istream part( &stretch );
+			while( Obj *cur = readFile( part, arenas[k], from, to ) )
+				parsed[k].push_back( cur );
+
+			// what the big arrays left to convert
+			vector<ObjArrayBase*> arrays;
+			arenas[k].unconverted( arrays );
+			size_t later = 0;
+			for( size_t a = 0; a < arrays.size(); ++a )
+				for( size_t c = 0; c < arrays[a]->pieces(); ++c )
+					later += arrays[a]->pieceBytes( c );
+
+			bytesParsed += cuts[k+1] - cuts[k] - later;
+			if( progress )
+				*progress = 0.5 * bytesParsed / ( text.size() - start + 1 );
+		}
+	} );
+
+	// A big mesh is most of its stretch, so the pieces of text its arrays
+	// were cut into are converted across the pool in turn, and joined.
+	vector<ObjArrayBase*> arrays;
+	vector< pair<ObjArrayBase*, size_t> > pieces;
+	for( size_t k = 0; k < arenas.size(); ++k )
+		arenas[k].unconverted( arrays );
+	for( size_t a = 0; a < arrays.size(); ++a )
+		for( size_t c = 0; c < arrays[a]->pieces(); ++c )
+			pieces.push_back( make_pair( arrays[a], c ) );
+
+	parallelFor( pool, pieces.size(), 1, [&]( size_t begin, size_t end ) {
+		for( size_t k = begin; k < end; ++k ) {
+			pieces[k].first->convertPiece( pieces[k].second );
+
+			bytesParsed += pieces[k].first->pieceBytes( pieces[k].second );
+			if( progress )
+				*progress = 0.5 * bytesParsed / ( text.size() - start + 1 );
+		}
+	} );
+	for( size_t a = 0; a < arrays.size(); ++a )
+		arrays[a]->join();
+
+	size_t nObjects = 0, done = 0;
+	for( size_t k = 0; k < parsed.size(); ++k )
+		nObjects += parsed[k].size();
+
+	// Objects have to be processed in file order, since materials are
+	// bound by name as they go.
+	Scene *ret = new Scene;
 	mmap materials;
 
-	while( true ) {
-		Obj *cur = readFile( is );
-		if( !cur ) {
-			break;
+	try {
+		for( size_t k = 0; k < parsed.size(); ++k ) {
+			for( size_t o = 0; o < parsed[k].size(); ++o ) {
+				processObject( parsed[k][o], ret, materials );
+				if( !MemoryStats::fits() )
+					throw ParseError( "Scene is too big for the memory budget." );
+
+				if( progress )
+					*progress = 0.5 + 0.5 * ++done / nObjects;
+			}
+			arenas[k].clear();
 		}
-
-		processObject( cur, ret, materials );
-		delete cur;
+	} catch( ParseError& ) {
+		delete ret;
+		throw;
 	}
 
 	return ret;
 }
 
+// Call body( begin, end ) on chunks of [0, n), spread across the pool when
+// there is one and at least two chunks of grain items to share out.  The
+// first ParseError from any chunk is rethrown on the calling thread.
+static void parallelFor( WorkerPool *pool, size_t n, size_t grain,
+	const function<void (size_t, size_t)>& body )
+{
+	size_t nChunks = pool ? min( (size_t)( 4 * pool->size() ), n / grain ) : 1;
+	if( pool && pool->size() == 1 )
+		nChunks = 1;
+	if( nChunks <= 1 ) {
+		body( 0, n );
+		return;
+	}
+
+	vector<string> errors( nChunks );
+	vector<char> failed( nChunks, false );
+
+	pool->run( (int)nChunks, [&]( int c, int ) {
+		try {
+			body( n * c / nChunks, n * ( c + 1 ) / nChunks );
+		} catch( ParseError& pe ) {
+			errors[c] = pe.getMsg();
+			failed[c] = true;
+		}
+	} );
+
+	for( size_t c = 0; c < nChunks; ++c )
+		if( failed[c] )
+			throw ParseError( errors[c] );
+}
+
 // Find a color field inside some object.  Now, I recognize that not
 // everyone speaks the Queen's English, so I allow both spellings of
 // color.  If you're composing scenes, you don't need to worry about
@@ -291,16 +442,40 @@ static void processGeometry( string name, Obj *child, Scene *scene,
                                                              l4[1]->getScalar(),
                                                              l4[2]->getScalar(),
                                                              l4[3]->getScalar() ) ) ) );
+	} else if( name == "motion_translate" ) {
+		// moves by (x, y, z) over the shutter interval
+		const mytuple& tup = child->getTuple();
+		verifyTuple( tup, 4 );
+		processGeometry( tup[3],
+                         scene,
+                         materials,
+                         transform->createMotionChild( vec3f( tup[0]->getScalar(),
+                                                              tup[1]->getScalar(),
+                                                              tup[2]->getScalar() ),
+                                                       vec3f(), 0.0 ) );
+	} else if( name == "motion_rotate" ) {
+		// turns by the angle about the axis over the shutter interval
+		const mytuple& tup = child->getTuple();
+		verifyTuple( tup, 5 );
+		vec3f axis( tup[0]->getScalar(), tup[1]->getScalar(), tup[2]->getScalar() );
+		if( axis.iszero() )
+			throw ParseError( "motion_rotate about a zero axis." );
+		processGeometry( tup[4],
+                         scene,
+                         materials,
+                         transform->createMotionChild( vec3f(), axis, tup[3]->getScalar() ) );
 	} else if( name == "trimesh" || name == "polymesh" ) { // 'polymesh' is for backwards compatibility
-        processTrimesh( name, child, scene, materials, transform);
+        processTrimesh( name, child, scene, materials, transform );
+	} else if( name == "sphere_cloud" ) {
+		processSphereCloud( child, scene, materials, transform );
     } else {
 		SceneObject *obj = NULL;
-       	Material *mat;
+       	MaterialTable::Index mat;
         
         //if( hasField( child, "material" ) )
-        mat = getMaterial(getField( child, "material" ), materials );
+        mat = getMaterial(getField( child, "material" ), scene, materials );
         //else
-        //    mat = new Material();
+        //    mat = scene->materials.add( Material() );
 
 		if( name == "sphere" ) {
 			obj = new Sphere( scene, mat );
@@ -332,39 +507,27 @@ static void processGeometry( string name, Obj *child, Scene *scene,
 static void processTrimesh( string name, Obj *child, Scene *scene,
                                      const mmap& materials, TransformNode *transform )
 {
-    Material *mat;
+    MaterialTable::Index mat;
     
     if( hasField( child, "material" ) )
-        mat = getMaterial( getField( child, "material" ), materials );
+        mat = getMaterial( getField( child, "material" ), scene, materials );
     else
-        mat = new Material();
+        mat = scene->materials.add( Material() );
     
     Trimesh *tmesh = new Trimesh( scene, mat, transform);
 
-    const mytuple &points = getField( child, "points" )->getTuple();
-    for( mytuple::const_iterator pi = points.begin(); pi != points.end(); ++pi )
-        tmesh->addVertex( tupleToVec( *pi ) );
-                
-    const mytuple &faces = getField( child, "faces" )->getTuple();
-    for( mytuple::const_iterator fi = faces.begin(); fi != faces.end(); ++fi )
+    // The points, faces and normals were read straight into arrays in the
+    // form the mesh keeps them, so they are just handed over.
+    vector<vec3g> points;
+    getField( child, "points" )->getVecArray()->takeInto( points );
+    tmesh->takeVertices( points );
+
+    vector<Trimesh::Face> faces;
+    getField( child, "faces" )->getFaceArray()->takeInto( faces );
+    if( !tmesh->takeFaces( faces ) )
     {
-        const mytuple &pointids = (*fi)->getTuple();
-
-        // triangulate here and now.  assume the poly is
-        // concave and we can triangulate using an arbitrary fan
-        if( pointids.size() < 3 )
-            throw ParseError( "Faces must have at least 3 vertices." );
-
-        mytuple::const_iterator i = pointids.begin();
-        int a = (int) (*i++)->getScalar();
-        int b = (int) (*i++)->getScalar();
-        while( i != pointids.end() )
-        {
-            int c = (int) (*i++)->getScalar();
-            if( !tmesh->addFace(a,b,c) )
-                throw ParseError( "Bad face in trimesh." );
-            b = c;
-        }
+        delete tmesh;
+        throw ParseError( "Bad face in trimesh." );
     }
 
     bool generateNormals = false;
@@ -376,23 +539,66 @@ static void processTrimesh( string name, Obj *child, Scene *scene,
     {
         const mytuple &mats = getField( child, "materials" )->getTuple();
         for( mytuple::const_iterator mi = mats.begin(); mi != mats.end(); ++mi )
-            tmesh->addMaterial( getMaterial( *mi, materials ) );
+            tmesh->addMaterial( getMaterial( *mi, scene, materials ) );
     }
     if( hasField( child, "normals" ) )
     {
-        const mytuple &norms = getField( child, "normals" )->getTuple();
-        for( mytuple::const_iterator ni = norms.begin(); ni != norms.end(); ++ni )
-            tmesh->addNormal( tupleToVec( *ni ) );
+        vector<vec3g> norms;
+        getField( child, "normals" )->getVecArray()->takeInto( norms );
+        tmesh->takeNormals( norms );
     }
 
     char *error;
     if( error = tmesh->doubleCheck() )
         throw ParseError( error );
 
+    if( !MemoryStats::fits( tmesh->memoryBytes() ) )
+    {
+        delete tmesh;
+        throw ParseError( "Scene is too big for the memory budget." );
+    }
+
     scene->add(tmesh);
 }
 
-static Material *getMaterial( Obj *child, const mmap& bindings )
+// A sphere_cloud has centers = ((x, y, z), ...) and either one radius
+// for all of them or radii = (r, ...), one for each.
+static void processSphereCloud( Obj *child, Scene *scene,
+	const mmap& materials, TransformNode *transform )
+{
+	MaterialTable::Index mat;
+
+	if( hasField( child, "material" ) )
+		mat = getMaterial( getField( child, "material" ), scene, materials );
+	else
+		mat = scene->materials.add( Material() );
+
+	vector<vec3g> centers;
+	getField( child, "centers" )->getVecArray()->takeInto( centers );
+
+	vector<geomreal> radii;
+	if( hasField( child, "radii" ) )
+		getField( child, "radii" )->getScalarArray()->takeInto( radii );
+
+	double radius = 1.0;
+	maybeExtractField( child, "radius", radius );
+
+	SphereCloud *cloud = new SphereCloud( scene, mat );
+	cloud->setTransform( transform );
+	if( !cloud->build( centers, radii, geomreal( radius ), transform->localToGlobal() ) ) {
+		delete cloud;
+		throw ParseError( "Sphere cloud needs one radius for each center." );
+	}
+
+	if( !MemoryStats::fits( cloud->memoryBytes() ) ) {
+		delete cloud;
+		throw ParseError( "Scene is too big for the memory budget." );
+	}
+
+	scene->add( cloud );
+}
+
+static MaterialTable::Index getMaterial( Obj *child, Scene *scene, const mmap& bindings )
 {
 	string tfield = child->getTypeName();
 	if( tfield == "id" ) {
@@ -407,46 +613,48 @@ static Material *getMaterial( Obj *child, const mmap& bindings )
 		} 
 	} 
 	// Don't allow binding.
-	return processMaterial( child );
+	return processMaterial( child, scene );
 }
 
-static Material *processMaterial( Obj *child, mmap *bindings )
-// Generate a material from a parse sub-tree
+static MaterialTable::Index processMaterial( Obj *child, Scene *scene, mmap *bindings )
+// Generate a material from a parse sub-tree and enter it in the scene's
+// material table, which shares it with any identical one already there
 //
 // child   - root of parse tree
+// scene   - scene whose table the material goes in
 // mmap    - bindings of names to materials (if non-null)
-// defmat  - material to start with (if non-null)
 {
-    Material *mat;
-    mat = new Material();
+    Material mat;
 	
     if( hasField( child, "emissive" ) ) {
-        mat->ke = tupleToVec( getField( child, "emissive" ) );
+        mat.ke = tupleToVec( getField( child, "emissive" ) );
     }
     if( hasField( child, "ambient" ) ) {
-        mat->ka = tupleToVec( getField( child, "ambient" ) );
+        mat.ka = tupleToVec( getField( child, "ambient" ) );
     }
     if( hasField( child, "specular" ) ) {
-        mat->ks = tupleToVec( getField( child, "specular" ) );
+        mat.ks = tupleToVec( getField( child, "specular" ) );
     }
     if( hasField( child, "diffuse" ) ) {
-        mat->kd = tupleToVec( getField( child, "diffuse" ) );
+        mat.kd = tupleToVec( getField( child, "diffuse" ) );
     }
     if( hasField( child, "reflective" ) ) {
-        mat->kr = tupleToVec( getField( child, "reflective" ) );
+        mat.kr = tupleToVec( getField( child, "reflective" ) );
     } else {
-        mat->kr = mat->ks; // defaults to ks if none given.
+        mat.kr = mat.ks; // defaults to ks if none given.
     }
     if( hasField( child, "transmissive" ) ) {
-        mat->kt = tupleToVec( getField( child, "transmissive" ) );
+        mat.kt = tupleToVec( getField( child, "transmissive" ) );
     }
     if( hasField( child, "index" ) ) { // index of refraction
-        mat->index = getField( child, "index" )->getScalar();
+        mat.index = getField( child, "index" )->getScalar();
     }
     if( hasField( child, "shininess" ) ) {
-        mat->shininess = getField( child, "shininess" )->getScalar();
+        mat.shininess = getField( child, "shininess" )->getScalar();
     }
 
+    MaterialTable::Index index = scene->materials.add( mat );
+
     if( bindings != NULL ) {
         // Want to bind, better have "name" field:
         if( hasField( child, "name" ) ) {
@@ -459,14 +667,14 @@ static Material *processMaterial( Obj *child, mmap *bindings )
                 name = field->getString();
             }
 
-            (*bindings)[ name ] = mat;
+            (*bindings)[ name ] = index;
         } else {
             throw ParseError( 
                 string( "Attempt to bind material with no name" ) );
         }
     }
 
-    return mat;
+    return index;
 }
 
 static void
@@ -494,6 +702,26 @@ processCamera( Obj *child, Scene *scene )
         scene->getCamera()->setLook( tupleToVec( getField( child, "viewdir" ) ).normalize(),
                                      tupleToVec( getField( child, "updir" ) ).normalize() );
     }
+
+    // where the camera ends up over the shutter interval, for motion blur
+    if( hasField( child, "end_position" ) )
+        scene->getCamera()->setEndEye( tupleToVec( getField( child, "end_position" ) ) );
+    if( hasField( child, "end_viewdir" ) && hasField( child, "end_updir" ) )
+    {
+        scene->getCamera()->setEndLook( tupleToVec( getField( child, "end_viewdir" ) ).normalize(),
+                                        tupleToVec( getField( child, "end_updir" ) ).normalize() );
+    }
+}
+
+// A light's optional soft shadow budget, overriding the render settings.
+static void processShadowBudget( Obj *child, Light *light )
+{
+	double samples = -1, probes = -1;
+	if( maybeExtractField( child, "shadow_samples", samples ) && samples < 0 )
+		throw ParseError( "Negative shadow_samples." );
+	if( maybeExtractField( child, "shadow_probes", probes ) && probes < 0 )
+		throw ParseError( "Negative shadow_probes." );
+	light->setShadowBudget( int( samples ), int( probes ) );
 }
 
 static void processObject( Obj *obj, Scene *scene, mmap& materials )
@@ -521,17 +749,21 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 			throw ParseError( "No info for directional_light" );
 		}
 
-		scene->add( new DirectionalLight( scene, 
+		Light *light = new DirectionalLight( scene, 
 			tupleToVec( getField( child, "direction" ) ).normalize(),
-			tupleToVec( getColorField( child ) ) ) );
+			tupleToVec( getColorField( child ) ) );
+		processShadowBudget( child, light );
+		scene->add( light );
 	} else if( name == "point_light" ) {
 		if( child == NULL ) {
 			throw ParseError( "No info for point_light" );
 		}
 
-		scene->add( new PointLight( scene, 
+		Light *light = new PointLight( scene, 
 			tupleToVec( getField( child, "position" ) ),
-			tupleToVec( getColorField( child ) ) ) );
+			tupleToVec( getColorField( child ) ) );
+		processShadowBudget( child, light );
+		scene->add( light );
 	} else if( 	name == "sphere" ||
 				name == "box" ||
 				name == "cylinder" ||
@@ -541,12 +773,15 @@ static void processObject( Obj *obj, Scene *scene, mmap& materials )
 				name == "rotate" ||
 				name == "scale" ||
 				name == "transform" ||
+				name == "motion_translate" ||
+				name == "motion_rotate" ||
                 name == "trimesh" ||
+                name == "sphere_cloud" ||
                 name == "polymesh") { // polymesh is for backwards compatibility.
-		processGeometry( name, child, scene, materials, &scene->transformRoot);
+		processGeometry( name, child, scene, materials, &scene->transformRoot );
 		//scene->add( geo );
 	} else if( name == "material" ) {
-		processMaterial( child, &materials );
+		processMaterial( child, scene, &materials );
 	} else if( name == "camera" ) {
 		processCamera( child, scene );
 	}
@@ -3,10 +3,19 @@
 
 #include <string>
 #include <iostream>
+#include <atomic>
 
 #include "../scene/scene.h"
 
-Scene *readScene( const string& filename );
-Scene *readScene( istream& is );
+class WorkerPool;
+
+// With a pool, separate stretches of top-level objects and the big tuples
+// of a trimesh are parsed in parallel; without one everything happens on
+// the calling thread.  progress, if given, is raised from 0 towards 1 as
+// the load goes on, for a UI on another thread to watch.
+Scene *readScene( const string& filename, WorkerPool *pool = NULL,
+	std::atomic<double> *progress = NULL );
+Scene *readScene( istream& is, WorkerPool *pool = NULL,
+	std::atomic<double> *progress = NULL );
 
 #endif // __READ_H__
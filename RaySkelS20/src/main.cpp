@@ -15,31 +15,33 @@
 //  |
 //  +- RayTracer::traceLines
 //        |
-//        +- RayTracer::tracePixel
-//              |
-//              +- RayTracer::trace
-//                    |
-//                    +- Camera::rayThrough
-//                    |
-//                    +- RayTracer::traceRay
-//                          |
-//                          +- Scene::intersect
-//                          |     |
-//                          |     +- <Geometry>::intersect
-//                          |           |
-//                          |           +- <Geometry>::intersectLocal
-//                          |
-//                          +- isect::getMaterial
-//                          |
-//                          +- Material::shade
+//        +- RayTracer::sampleRow
+//        |     |
+//        |     +- Camera::rayThrough
+//        |     |
+//        |     +- Scene::intersect
+//        |     |     |
+//        |     |     +- <Geometry>::intersect
+//        |     |           |
+//        |     |           +- <Geometry>::intersectLocal
+//        |     |
+//        |     +- ShadeBatch::shade
+//        |     |
+//        |     +- RayTracer::traceBounces
+//        |           |
+//        |           +- RayTracer::traceRay
+//        |                 |
+//        |                 +- Scene::intersect
+//        |                 |
+//        |                 +- Material::shade
+//        |
+//        +- AccumBuffer::resolve
 //
 // The loadScene and traceSetup methods load a file and set up all the internal
 // buffers necessary to render the scene.  The traceLines method begins the
-// process of actually rendering the image, one scanline at a time.  It does
-// this by calling tracePixel for each pixel in the image.  tracePixel is given
-// a coordinate pair which is converted into an (x,y) screen coordinate and
-// passed to trace.  The trace method calculates a ray from the camera position
-// through the (x,y) coordinate and then calls traceRay to see if this ray
+// process of actually rendering the image, one scanline at a time.  For each
+// pixel of the row, sampleRow calculates a ray from the camera position
+// through its (x,y) screen coordinate and sees whether the ray
 // actually intersects any objects in the scene.  The intersect method in
 // Scene calls intersect on each object in the scene (part of your assignment
 // is an acceleration or culling process that cuts this down significantly).
@@ -47,16 +49,20 @@
 // intersectLocal routine (you need to fill this method in for the Box class).
 // The intersect method actually converts the ray into the coordinate frame
 // of the object where intersectLocal can check for an intersection.
-// Finally, if an intersection was found, the material for that object is
-// obtained and used to shade the scene (you will need to provide the code to
-// figure out the correct color for the shading).
+// Finally, the hits of the whole row are shaded together, each goes on to
+// its reflected and refracted rays (traced by traceRay, which shades with
+// the hit object's material), and the colors are added into the
+// accumulation buffer, which resolve turns into the 8-bit image.
 //
 //=============================================================================
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#include <chrono>
+
 #include <FL/Fl.h>
 #include <FL/Fl_Window.H>
 #include <FL/Fl_Box.H>
@@ -67,6 +73,10 @@
 #include "RayTracer.h"
 
 #include "fileio/bitmap.h"
+#include "render/BatchRenderer.h"
+#include "render/BudgetRenderer.h"
+#include "render/MemoryStats.h"
+#include "vecmath/vecbench.h"
 #include <vector>
 
 // ***********************************************************
@@ -84,28 +94,50 @@ TraceUI* traceUI;
 //
 // options from program parameters
 //
-int recursion_depth = 0;
+RenderSettings g_settings;
 int g_height;
 int g_width = 150;
+int g_threads = 0;
+bool g_pin = false;
+bool g_replicate = false;
+double g_budget = 0.0;
 bool bReport = false;
+bool bBenchVecmath = false;
 char *progname, *rayName, *imgName;
+char *batchName = NULL;
 
 void usage()
 {
 #ifdef WIN32
-	fl_alert( "usage: %s [-r <#> -w <#> -t] [input.ray output.bmp]\n", progname );
+	fl_alert( "usage: %s [-r <#> -w <#> -j <#> -m <#> -T <#> -a -n -s name=value -t] [input.ray output.bmp | -b manifest | -v]\n", progname );
 #else
 	fprintf( stderr, "usage: %s [options] [input.ray output.bmp]\n", progname );
-	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", recursion_depth );
+	fprintf( stderr, "  -r <#>      set recurssion level (default %d)\n", g_settings.depth );
 	fprintf( stderr, "  -w <#>      set output image width (default %d)\n", g_width );
-	fprintf( stderr, "  -t			report time statistics\n" );
+	fprintf( stderr, "  -t			report time, samples per pixel and memory statistics\n" );
+	fprintf( stderr, "  -m <#>      fail any scene load that takes memory past # MB\n" );
+	fprintf( stderr, "  -s <n>=<v>  set a render setting, one of\n%s\n", RenderSettings::names() );
+	fprintf( stderr, "  -T <#>, --time-budget <#>\n" );
+	fprintf( stderr, "              render for # seconds, refining the noisiest pixels after a\n" );
+	fprintf( stderr, "              quick first pass, and report samples per pixel and error\n" );
+	fprintf( stderr, "  -b <file>   render every job in a batch manifest, one job per line:\n" );
+	fprintf( stderr, "              input.ray output.bmp [width] [name=value ...]\n" );
+	fprintf( stderr, "  -j <#>      worker threads for -b and -T (default: one per core)\n" );
+	fprintf( stderr, "  -a          pin batch workers to cores, spread over the NUMA nodes\n" );
+	fprintf( stderr, "  -n          load a copy of each batch scene on every NUMA node (implies -a)\n" );
+	fprintf( stderr, "  -v          time the vector math kernels against scalar code and exit\n" );
 #endif
 }
 
 bool processArgs(int argc, char **argv) {
 	int i;
 
-    while ( (i = getopt( argc, argv, "tr:w:h:" )) != EOF )
+	// getopt only knows single letters
+	for ( i = 1; i < argc; ++i )
+		if ( !strcmp( argv[i], "--time-budget" ) )
+			argv[i] = (char *)"-T";
+
+    while ( (i = getopt( argc, argv, "tanvr:w:h:b:j:m:s:T:" )) != EOF )
 	{
 		switch ( i )
 		{
@@ -114,7 +146,7 @@ bool processArgs(int argc, char **argv) {
 			break;
 	    
 			case 'r':
-			recursion_depth = atoi( optarg );
+			g_settings.depth = atoi( optarg );
 			break;
 	    
 			case 'w':
@@ -125,11 +157,59 @@ bool processArgs(int argc, char **argv) {
 			g_height = atoi( optarg );
 			break;
 
+			case 'b':
+			batchName = optarg;
+			break;
+
+			case 'j':
+			g_threads = atoi( optarg );
+			break;
+
+			case 'a':
+			g_pin = true;
+			break;
+
+			case 'm':
+			MemoryStats::setBudget( (long long)( atof( optarg ) * 1024 * 1024 ) );
+			break;
+
+			case 'n':
+			g_replicate = true;
+			break;
+
+			case 'v':
+			bBenchVecmath = true;
+			break;
+
+			case 'T':
+			g_budget = atof( optarg );
+			if ( g_budget <= 0.0 )
+			{
+				fprintf( stderr, "bad time budget \"%s\".\n", optarg );
+				return false;
+			}
+			break;
+
+			case 's':
+			{
+				char *eq = optarg ? strchr( optarg, '=' ) : NULL;
+				if ( !eq || !g_settings.set( string( optarg, eq ), eq + 1 ) )
+				{
+					fprintf( stderr, "bad setting \"%s\".\n", optarg ? optarg : "" );
+					return false;
+				}
+			}
+			break;
+
 			default:
 			return false;
 		}
     }
 
+	// a batch manifest names its own inputs and outputs
+	if ( batchName || bBenchVecmath )
+		return true;
+
     if ( optind >= argc-1 )
     {
 		fprintf( stderr, "no input and/or output name.\n" );
@@ -142,35 +222,6 @@ bool processArgs(int argc, char **argv) {
 	return true;
 }
 
-double frand() {
-	return (double)rand() / RAND_MAX;
-}
-
-std::vector<vec3f> distributedRays(vec3f ray, double radius, int count) {
-	vec3f up = vec3f(0, 1, 0);
-
-	if ((ray.normalize() - up).length() < RAY_EPSILON) {
-		up = vec3f(1, 0, 0);
-	}
-
-	vec3f right = ray.cross(up);
-	up = right.cross(ray);
-
-	std::vector<vec3f> rays;
-
-	for (int i = 0; i < count; i++) {
-		double x = frand() * radius * 2 - radius;
-		double y = frand() * radius * 2 - radius;
-
-		vec3f newRay = ray + right * x + up * y;
-
-		rays.push_back(newRay);
-	}
-
-	return rays;
-}
-
-
 // usage : ray [option] in.ray out.bmp
 // Simply keying in ray will invoke a graphics mode version.
 // Use "ray --help" to see the detailed usage.
@@ -188,6 +239,24 @@ int main(int argc, char **argv) {
 			usage();
 			exit(1);
 		}
+
+		if (bBenchVecmath) {
+			benchVecmath(cerr);
+			return 0;
+		}
+
+		if (batchName) {
+			BatchRenderer batch(g_threads, g_pin, g_replicate);
+			if (!batch.readManifest(batchName, g_width, g_settings))
+				exit(1);
+
+			batch.render();
+			batch.writeSummary(cerr);
+			if (bReport)
+				MemoryStats::report(cerr);
+
+			return batch.numFailed() ? 1 : 0;
+		}
 		
 		theRayTracer=new RayTracer();
 		theRayTracer->loadScene(rayName);
@@ -195,29 +264,48 @@ int main(int argc, char **argv) {
 		if (theRayTracer->sceneLoaded()) {
 			g_height = (int)(g_width / theRayTracer->aspectRatio() + 0.5);
 
-			theRayTracer->traceSetup(g_width, g_height);
+			double t;
+
+			if (g_budget > 0.0) {
+				// The budget is wall clock time, and the render runs on
+				// several threads, so it is timed that way, not by clock().
+				std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+				BudgetRenderer budget(theRayTracer, g_threads, g_pin);
+				budget.render(g_width, g_height, g_settings, g_budget);
+
+				t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				budget.writeReport(cerr);
+			} else {
+				theRayTracer->traceSetup(g_width, g_height, g_settings);
 		
-			clock_t start, end;
-			start=clock();
+				clock_t start, end;
+				start=clock();
 
-			theRayTracer->traceLines(0, g_height);
+				theRayTracer->traceLines(0, g_height);
 		
-			end=clock();
+				end=clock();
+				t=(double)(end-start)/CLOCKS_PER_SEC;
+			}
 
 			// save image
 			unsigned char* buf;
 
 			theRayTracer->getBuffer(buf, g_width, g_height);
-			if (buf)
-				writeBMP(imgName, g_width, g_height, buf); 
+			if (buf && !writeBMP(imgName, g_width, g_height, buf))
+				fprintf( stderr, "couldn't write \"%s\".\n", imgName );
 
 			if (bReport) {
-				double t=(double)(end-start)/CLOCKS_PER_SEC;
 #ifdef WIN32
 				fl_message( "total time = %.3f seconds\n", t); 
 #else
 				fprintf( stderr, "total time = %.3f seconds\n", t); 
 #endif
+				fprintf( stderr, "%.3f samples per pixel\n", theRayTracer->samplesPerPixel() );
+				RayCounts rays = theRayTracer->rayCounts();
+				fprintf( stderr, "%lld secondary rays traced, %lld culled by weight, %lld lost at roulette\n",
+					rays.traced, rays.culled, rays.rouletted );
+				MemoryStats::report(cerr);
 			}
 		}
 
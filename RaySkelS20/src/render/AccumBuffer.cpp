@@ -0,0 +1,94 @@
+#include <cstring>
+#include <vector>
+
+#include "AccumBuffer.h"
+#include "RenderSettings.h"
+#include "../vecmath/vecpack.h"
+
+AccumBuffer::~AccumBuffer()
+{
+	delete [] sums;
+	delete [] counts;
+}
+
+void AccumBuffer::resize( int w, int h )
+{
+	if( w == width && h == height )
+		return;
+
+	delete [] sums;
+	delete [] counts;
+	width = w;
+	height = h;
+	sums = new float[ 3 * w * h ];
+	counts = new int[ w * h ];
+	charge.set( (size_t)w * h * ( 3 * sizeof( float ) + sizeof( int ) ) );
+}
+
+void AccumBuffer::clearRows( int start, int stop )
+{
+	memset( sums + 3 * width * start, 0, sizeof( float ) * 3 * width * ( stop - start ) );
+	memset( counts + width * start, 0, sizeof( int ) * width * ( stop - start ) );
+}
+
+// Channels from to to of a row: sum times scale, tone mapped, raised to
+// the power invGamma if gamma is set, then quantized after adding the
+// dither threshold.
+template <class P>
+static void resolveRun( const float *sum, const double *scale, const double *dither,
+	unsigned char *out, int from, int to, bool reinhard, bool gamma, double invGamma )
+{
+	for( int k = from; k + P::WIDTH <= to; k += P::WIDTH )
+	{
+		P v = P::load( sum + k ) * P::load( scale + k );
+		if( reinhard ) {
+			v = vmax( v, P( 0.0 ) );
+			v = v / ( P( 1.0 ) + v );
+		} else {
+			v = vmax( vmin( v, P( 1.0 ) ), P( 0.0 ) );
+		}
+		if( gamma )
+			v = vpow( v, P( invGamma ) );
+		vmin( v * P( 255.0 ) + P::load( dither + k ), P( 255.0 ) ).storeBytes( out + k );
+	}
+}
+
+void AccumBuffer::resolve( int start, int stop, unsigned char *out,
+	const RenderSettings& settings ) const
+{
+	// An ordered dither: the thresholds of a 4x4 Bayer matrix, spread
+	// evenly over [0, 1).
+	static const double bayer[4][4] = {
+		{  0.5 / 16,  8.5 / 16,  2.5 / 16, 10.5 / 16 },
+		{ 12.5 / 16,  4.5 / 16, 14.5 / 16,  6.5 / 16 },
+		{  3.5 / 16, 11.5 / 16,  1.5 / 16,  9.5 / 16 },
+		{ 15.5 / 16,  7.5 / 16, 13.5 / 16,  5.5 / 16 },
+	};
+
+	bool reinhard = settings.toneMap == RenderSettings::TONE_REINHARD;
+	bool gamma = settings.gamma > 0.0 && settings.gamma != 1.0;
+	double invGamma = gamma ? 1.0 / settings.gamma : 1.0;
+
+	int n = 3 * width;
+	int wide = n - n % WidePack::WIDTH;
+	vector<double> scale( n ), dither( n );
+
+	for( int j = start; j < stop; ++j )
+	{
+		for( int i = 0; i < width; ++i )
+		{
+			int c = counts[ i + j * width ];
+			double s = c ? 1.0 / c : 0.0;
+			double d = settings.dither ? bayer[ j & 3 ][ i & 3 ] : 0.0;
+			for( int k = 0; k < 3; ++k ) {
+				scale[ 3 * i + k ] = s;
+				dither[ 3 * i + k ] = d;
+			}
+		}
+
+		const float *sum = sums + j * n;
+		unsigned char *row = out + j * n;
+		resolveRun<WidePack>( sum, &scale[0], &dither[0], row, 0, wide, reinhard, gamma, invGamma );
+		resolveRun<Pack1>( sum, &scale[0], &dither[0], row, wide, n, reinhard, gamma, invGamma );
+	}
+}
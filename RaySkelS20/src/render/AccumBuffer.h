@@ -0,0 +1,65 @@
+//
+// AccumBuffer.h
+//
+// The image as it is being rendered: for every pixel, the sum of the
+// colors of the samples traced through it so far, in single precision,
+// and how many there were.  Nothing is rounded until resolve() turns rows
+// of it into the 8-bit RGB that is displayed and written out -- averaging
+// the samples, tone mapping, gamma correcting, dithering and quantizing a
+// run of pixels at a time in vector registers.
+//
+
+#ifndef __ACCUMBUFFER_H__
+#define __ACCUMBUFFER_H__
+
+#include "MemoryStats.h"
+#include "../vecmath/vecmath.h"
+
+struct RenderSettings;
+
+class AccumBuffer
+{
+public:
+	AccumBuffer()
+		: width( 0 ), height( 0 ), sums( NULL ), counts( NULL ), charge( MEM_SAMPLES ) {}
+	~AccumBuffer();
+
+	// Make room for w x h pixels.  What they hold is undefined until
+	// clearRows() has been called on them.
+	void resize( int w, int h );
+	void clearRows( int start, int stop );
+
+	void add( int i, int j, const vec3f& c )
+	{
+		int p = i + j * width;
+		float *s = sums + 3 * p;
+		s[0] += float( c[0] );
+		s[1] += float( c[1] );
+		s[2] += float( c[2] );
+		++counts[p];
+	}
+
+	// The mean of pixel (i, j)'s samples, or black if it has none.
+	vec3f average( int i, int j ) const
+	{
+		int p = i + j * width;
+		const float *s = sums + 3 * p;
+		double scale = counts[p] ? 1.0 / counts[p] : 0.0;
+		return vec3f( s[0] * scale, s[1] * scale, s[2] * scale );
+	}
+
+	// Rows start to stop, resolved into out (3 bytes a pixel, rows
+	// packed) as settings says.  Pixels with no samples come out black.
+	void resolve( int start, int stop, unsigned char *out, const RenderSettings& settings ) const;
+
+private:
+	AccumBuffer( const AccumBuffer& );
+	AccumBuffer& operator =( const AccumBuffer& );
+
+	int width, height;
+	float *sums;			// red, green, blue per pixel
+	int *counts;
+	MemoryCharge charge;
+};
+
+#endif // __ACCUMBUFFER_H__
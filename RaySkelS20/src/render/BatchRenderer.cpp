@@ -0,0 +1,405 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "BatchRenderer.h"
+#include "CpuTopology.h"
+#include "../RayTracer.h"
+#include "../fileio/read.h"
+#include "../fileio/bitmap.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsBetween( Clock::time_point a, Clock::time_point b )
+{
+	return std::chrono::duration<double>( b - a ).count();
+}
+
+BatchRenderer::BatchRenderer( int nThreads, bool pin, bool replicate )
+	: pool( nThreads, pin || replicate ), totalSeconds( 0.0 ), loadSeconds( 0.0 )
+{
+	nReplicas = replicate && pool.pinned() ? CpuTopology::get().numNodes() : 1;
+}
+
+BatchRenderer::~BatchRenderer()
+{
+	for( map<string, CachedScene>::iterator i = scenes.begin(); i != scenes.end(); ++i )
+		for( size_t r = 0; r < i->second.replicas.size(); ++r )
+			delete i->second.replicas[r];
+}
+
+bool BatchRenderer::readManifest( const string& filename, int defaultWidth,
+	const RenderSettings& defaults )
+{
+	ifstream ifs( filename.c_str() );
+	if( !ifs ) {
+		cerr << "Error: couldn't read batch manifest " << filename << endl;
+		return false;
+	}
+
+	string line;
+	int lineno = 0;
+	while( getline( ifs, line ) ) {
+		++lineno;
+
+		istringstream iss( line );
+		string sceneFile, imageFile;
+		if( !(iss >> sceneFile) || sceneFile[0] == '#' )
+			continue;
+
+		int width = defaultWidth;
+		RenderSettings settings = defaults;
+		bool ok = !!(iss >> imageFile);
+
+		string field;
+		while( ok && iss >> field ) {
+			size_t eq = field.find( '=' );
+			if( eq == string::npos )
+				width = atoi( field.c_str() );
+			else if( !settings.set( field.substr( 0, eq ), field.substr( eq + 1 ) ) ) {
+				cerr << filename << ":" << lineno << ": unknown setting \"" << field.substr( 0, eq )
+					<< "\", expected one of\n" << RenderSettings::names() << endl;
+				return false;
+			}
+		}
+
+		if( !ok || width <= 0 ) {
+			cerr << filename << ":" << lineno
+				<< ": expected \"scene.ray output.bmp [width] [name=value ...]\"" << endl;
+			return false;
+		}
+
+		addJob( sceneFile, imageFile, width, settings );
+	}
+
+	return true;
+}
+
+void BatchRenderer::addJob( const string& sceneFile, const string& imageFile, int width,
+	const RenderSettings& settings )
+{
+	BatchJob job;
+	job.sceneFile = sceneFile;
+	job.imageFile = imageFile;
+	job.width = width;
+	job.settings = settings;
+	job.height = 0;
+	job.bands = 0;
+	job.ok = false;
+	job.seconds = 0.0;
+	job.busySeconds = 0.0;
+	job.samplesPerPixel = 0.0;
+	jobs.push_back( job );
+
+	CachedScene& cs = scenes[ sceneFile ];
+	if( cs.users++ == 0 ) {
+		cs.loadSeconds = 0.0;
+		cs.pending = 0;
+		cs.failed = false;
+	}
+}
+
+// Parse every distinct scene once per replica, in parallel.  readScene()
+// keeps no state between calls, so the loads are independent of each other.
+// When there are fewer loads than workers the spare ones help parse inside
+// each load.  A replica is parsed on threads pinned to its node, so that the
+// OS places all of its pages in that node's memory.
+void BatchRenderer::loadScenes()
+{
+	vector<CachedScene*> todo;
+	vector<string> names;
+	for( map<string, CachedScene>::iterator i = scenes.begin(); i != scenes.end(); ++i ) {
+		if( i->second.replicas.empty() ) {
+			names.push_back( i->first );
+			todo.push_back( &i->second );
+		}
+	}
+
+	vector<Scene*> loaded( todo.size() * nReplicas, (Scene*)NULL );
+	vector<double> seconds( loaded.size(), 0.0 );
+
+	int helpers = loaded.empty() ? 1 : std::max( 1, pool.size() / (int)loaded.size() );
+
+	Clock::time_point start = Clock::now();
+
+	pool.run( (int)loaded.size(), [&]( int i, int worker ) {
+		int scene = i / nReplicas;
+		int node = nReplicas > 1 ? i % nReplicas : pool.nodeOfWorker( worker );
+
+		auto load = [&]() {
+			Clock::time_point t0 = Clock::now();
+
+			WorkerPool inner( helpers );
+			Scene *s = readScene( names[scene], &inner );
+			if( s )
+				s->initScene();
+
+			loaded[i] = s;
+			seconds[i] = secondsBetween( t0, Clock::now() );
+		};
+
+		// A pinned worker is tied to one CPU, and threads it starts would
+		// inherit that, so the load runs on a thread allowed the whole node.
+		if( pool.pinned() ) {
+			std::thread t( [&]() {
+				CpuTopology::get().pinCurrentThreadToNode( node );
+				load();
+			} );
+			t.join();
+		} else {
+			load();
+		}
+	} );
+
+	for( size_t k = 0; k < todo.size(); ++k ) {
+		bool ok = true;
+		for( int r = 0; r < nReplicas; ++r ) {
+			ok = ok && loaded[ k * nReplicas + r ] != NULL;
+			todo[k]->loadSeconds = std::max( todo[k]->loadSeconds, seconds[ k * nReplicas + r ] );
+		}
+
+		for( int r = 0; r < nReplicas; ++r ) {
+			if( ok )
+				todo[k]->replicas.push_back( loaded[ k * nReplicas + r ] );
+			else
+				delete loaded[ k * nReplicas + r ];
+		}
+		todo[k]->failed = !ok;
+	}
+
+	loadSeconds = secondsBetween( start, Clock::now() );
+}
+
+void BatchRenderer::render()
+{
+	Clock::time_point start = Clock::now();
+
+	loadScenes();
+
+	// Frame-level parallelism is free of any sharing, so with at least as
+	// many jobs as workers every job is a single band.  With fewer jobs the
+	// frames are split into bands of scanlines, twice as many bands as there
+	// are idle workers so that uneven bands still even out.
+	int nJobs = 0;
+	for( size_t j = 0; j < jobs.size(); ++j )
+		if( !scenes[ jobs[j].sceneFile ].replicas.empty() )
+			++nJobs;
+
+	int bandsPerJob = 1;
+	if( nJobs > 0 && nJobs < pool.size() )
+		bandsPerJob = ( 2 * pool.size() + nJobs - 1 ) / nJobs;
+
+	struct Band
+	{
+		int job;
+		int start;
+		int stop;
+	};
+
+	// A job's tracer, and with it its frame buffers, is only made when its
+	// first band starts, and freed as soon as its image is written, so a
+	// long manifest holds only the frames being rendered at the time.
+	struct JobState
+	{
+		RayTracer *tracer;
+		CachedScene *scene;
+		std::atomic<int> remaining;
+		std::mutex lock;
+		bool started;
+		Clock::time_point firstStart;
+	};
+
+	vector<JobState> state( jobs.size() );
+	vector<int> order;
+
+	for( size_t j = 0; j < jobs.size(); ++j ) {
+		BatchJob& job = jobs[j];
+		JobState& js = state[j];
+
+		js.tracer = NULL;
+		js.started = false;
+
+		CachedScene& cs = scenes[ job.sceneFile ];
+		js.scene = &cs;
+		if( cs.replicas.empty() )
+			continue;
+
+		job.height = (int)( job.width / cs.replicas[0]->getCamera()->getAspectRatio() + 0.5 );
+		if( job.height < 1 )
+			job.height = 1;
+
+		job.bands = std::min( bandsPerJob, job.height );
+		js.remaining = job.bands;
+		++cs.pending;
+		order.push_back( (int)j );
+	}
+
+	// Biggest frames first, so the short ones fill in the gaps at the end.
+	std::stable_sort( order.begin(), order.end(), [&]( int a, int b ) {
+		return jobs[a].width * jobs[a].height > jobs[b].width * jobs[b].height;
+	} );
+
+	vector<Band> bands;
+	for( size_t k = 0; k < order.size(); ++k ) {
+		const BatchJob& job = jobs[ order[k] ];
+		for( int b = 0; b < job.bands; ++b ) {
+			Band band;
+			band.job = order[k];
+			band.start = job.height * b / job.bands;
+			band.stop = job.height * ( b + 1 ) / job.bands;
+			bands.push_back( band );
+		}
+	}
+
+	// writeBMP() works through file-scope headers, so only one at a time.
+	std::mutex writeLock;
+
+	// Guards the scenes' pending counts.
+	std::mutex sceneLock;
+
+	workerBusy.assign( pool.size(), 0.0 );
+	workerPixels.assign( pool.size(), 0 );
+
+	pool.run( (int)bands.size(), [&]( int i, int worker ) {
+		const Band& band = bands[i];
+		BatchJob& job = jobs[ band.job ];
+		JobState& js = state[ band.job ];
+
+		Clock::time_point t0 = Clock::now();
+		{
+			std::lock_guard<std::mutex> guard( js.lock );
+			if( !js.started ) {
+				js.started = true;
+				js.firstStart = t0;
+
+				// The buffer isn't cleared here: every pixel gets written by
+				// the band that traces it, and leaving it untouched until
+				// then lets each band's rows land in the memory of the node
+				// that renders them.
+				js.tracer = new RayTracer();
+				js.tracer->useScene( js.scene->replicas[0] );
+				js.tracer->traceSetup( job.width, job.height, job.settings, false );
+			}
+		}
+
+		int node = nReplicas > 1 ? pool.nodeOfWorker( worker ) : 0;
+		js.tracer->traceLines( band.start, band.stop, js.scene->replicas[ node ] );
+
+		Clock::time_point t1 = Clock::now();
+		workerBusy[ worker ] += secondsBetween( t0, t1 );
+		workerPixels[ worker ] += (long long)( band.stop - band.start ) * job.width;
+		{
+			std::lock_guard<std::mutex> guard( js.lock );
+			job.busySeconds += secondsBetween( t0, t1 );
+		}
+
+		if( --js.remaining == 0 ) {
+			unsigned char *buf;
+			int w, h;
+			js.tracer->getBuffer( buf, w, h );
+			{
+				std::lock_guard<std::mutex> guard( writeLock );
+				job.ok = writeBMP( (char *)job.imageFile.c_str(), w, h, buf );
+				if( !job.ok )
+					cerr << "Error: couldn't write " << job.imageFile << endl;
+			}
+			job.seconds = secondsBetween( js.firstStart, Clock::now() );
+			job.samplesPerPixel = js.tracer->samplesPerPixel();
+
+			delete js.tracer;
+			js.tracer = NULL;
+
+			// Once the last job on a scene is done, so is the scene.
+			std::lock_guard<std::mutex> guard( sceneLock );
+			if( --js.scene->pending == 0 ) {
+				for( size_t r = 0; r < js.scene->replicas.size(); ++r )
+					delete js.scene->replicas[r];
+				js.scene->replicas.clear();
+			}
+		}
+	} );
+
+	totalSeconds = secondsBetween( start, Clock::now() );
+}
+
+int BatchRenderer::numFailed() const
+{
+	int n = 0;
+	for( size_t j = 0; j < jobs.size(); ++j )
+		if( !jobs[j].ok )
+			++n;
+	return n;
+}
+
+void BatchRenderer::writeSummary( ostream& os ) const
+{
+	int nOk = 0;
+	double busy = 0.0;
+
+	os << setiosflags( ios::fixed ) << setprecision( 3 );
+	os << "job  status   size        bands  wall(s)  busy(s)  spp    scene -> image" << endl;
+
+	for( size_t j = 0; j < jobs.size(); ++j ) {
+		const BatchJob& job = jobs[j];
+		ostringstream size;
+		size << job.width << "x" << job.height;
+
+		os << setw( 3 ) << j << "  " << ( job.ok ? "ok    " : "FAILED" )
+			<< "   " << setw( 10 ) << left << size.str() << right
+			<< "  " << setw( 5 ) << job.bands
+			<< "  " << setw( 7 ) << job.seconds
+			<< "  " << setw( 7 ) << job.busySeconds
+			<< "  " << setw( 5 ) << setprecision( 2 ) << job.samplesPerPixel << setprecision( 3 )
+			<< "  " << job.sceneFile << " -> " << job.imageFile << endl;
+
+		if( job.ok )
+			++nOk;
+		busy += job.busySeconds;
+	}
+
+	os << nOk << "/" << jobs.size() << " jobs rendered, "
+		<< scenes.size() << " scene(s) parsed for " << jobs.size() << " job(s)";
+	if( nReplicas > 1 )
+		os << ", " << nReplicas << " copies each";
+	os << endl;
+	for( map<string, CachedScene>::const_iterator i = scenes.begin(); i != scenes.end(); ++i ) {
+		os << "  load " << setw( 7 ) << i->second.loadSeconds << "s  "
+			<< i->first << ( i->second.failed ? " (FAILED)" : "" )
+			<< ", used by " << i->second.users << " job(s)" << endl;
+	}
+	os << "scene loading " << loadSeconds << "s, total " << totalSeconds << "s on "
+		<< pool.size() << " worker(s), " << busy << "s busy ("
+		<< ( totalSeconds > 0.0 ? 100.0 * busy / ( totalSeconds * pool.size() ) : 0.0 )
+		<< "% utilisation)" << endl;
+
+	// Throughput per NUMA node; an unpinned pool counts as a single node.
+	int nNodes = pool.pinned() ? CpuTopology::get().numNodes() : 1;
+	for( int node = 0; node < nNodes; ++node ) {
+		int nWorkers = 0;
+		long long pixels = 0;
+		double nodeBusy = 0.0;
+		for( int w = 0; w < (int)workerBusy.size(); ++w ) {
+			if( pool.pinned() && pool.nodeOfWorker( w ) != node )
+				continue;
+			++nWorkers;
+			pixels += workerPixels[w];
+			nodeBusy += workerBusy[w];
+		}
+		if( nWorkers == 0 )
+			continue;
+
+		if( pool.pinned() )
+			os << "  node " << setw( 2 ) << node << ": ";
+		else
+			os << "  unpinned: ";
+		os << setw( 3 ) << nWorkers << " worker(s), " << pixels << " pixels, "
+			<< nodeBusy << "s busy, "
+			<< ( nodeBusy > 0.0 ? pixels / nodeBusy / 1000.0 : 0.0 ) << " kpixels/s per worker" << endl;
+	}
+}
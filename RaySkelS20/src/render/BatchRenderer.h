@@ -0,0 +1,97 @@
+//
+// BatchRenderer.h
+//
+// Renders a list of (scene, image, settings) jobs inside one process.  Each
+// distinct scene file is parsed once and shared by every job that names it,
+// and the jobs are cut into bands of scanlines that are spread across a
+// WorkerPool.
+//
+// On NUMA machines the workers can be pinned to cores, and each scene can
+// be parsed once per node so that a worker only ever reads geometry from
+// its own node's memory.
+//
+
+#ifndef __BATCHRENDERER_H__
+#define __BATCHRENDERER_H__
+
+#include <string>
+#include <vector>
+#include <map>
+#include <iostream>
+
+#include "WorkerPool.h"
+#include "RenderSettings.h"
+
+using namespace std;
+
+class Scene;
+
+struct BatchJob
+{
+	string sceneFile;
+	string imageFile;
+	int width;
+	RenderSettings settings;
+
+	// filled in by BatchRenderer::render()
+	int height;
+	int bands;
+	bool ok;
+	double seconds;			// wall clock, first band started to image written
+	double busySeconds;		// summed over all the workers that helped
+	double samplesPerPixel;
+};
+
+class BatchRenderer
+{
+public:
+	// replicate implies pin.
+	BatchRenderer( int nThreads = 0, bool pin = false, bool replicate = false );
+	~BatchRenderer();
+
+	// A manifest has one job per line:
+	//
+	//     scene.ray output.bmp [width] [name=value ...]
+	//
+	// where each name=value overrides one of the RenderSettings for that
+	// job only.  Blank lines and lines starting with '#' are skipped; jobs
+	// start from defaultWidth and defaults.  Returns false (after
+	// complaining on cerr) if the file can't be read or a line is bad.
+	bool readManifest( const string& filename, int defaultWidth,
+		const RenderSettings& defaults );
+	void addJob( const string& sceneFile, const string& imageFile, int width,
+		const RenderSettings& settings );
+
+	void render();
+
+	void writeSummary( ostream& os ) const;
+
+	int numJobs() const { return (int)jobs.size(); }
+	int numFailed() const;
+
+private:
+	void loadScenes();
+
+	WorkerPool pool;
+	vector<BatchJob> jobs;
+
+	struct CachedScene
+	{
+		vector<Scene*> replicas;	// one per NUMA node, or just one; empty if the load failed
+		double loadSeconds;
+		int users;
+		int pending;		// users yet to finish; at 0 the replicas are freed
+		bool failed;
+	};
+	map<string, CachedScene> scenes;
+	int nReplicas;
+
+	// per worker, for the per-node breakdown
+	vector<double> workerBusy;
+	vector<long long> workerPixels;
+
+	double totalSeconds;
+	double loadSeconds;
+};
+
+#endif // __BATCHRENDERER_H__
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+#include "BudgetRenderer.h"
+#include "Sampler.h"
+#include "../RayTracer.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double secondsBetween( Clock::time_point a, Clock::time_point b )
+{
+	return std::chrono::duration<double>( b - a ).count();
+}
+
+// Of the color as it will be displayed, so that what is clipped to white
+// counts for no more than white.
+static double luminance( const vec3f& c )
+{
+	vec3f d = c.clamp();
+	return 0.299 * d[0] + 0.587 * d[1] + 0.114 * d[2];
+}
+
+// Rows per task in the first pass, and pixels per task in a round.
+static const int kBandRows = 4;
+static const int kChunkPixels = 64;
+
+// How many jittered positions a pixel's extra samples go round.
+static const int kPositions = 256;
+
+BudgetRenderer::BudgetRenderer( RayTracer *t, int nThreads, bool pin )
+	: tracer( t ), pool( nThreads, pin ), width( 0 ), height( 0 ), budget( 0.0 ),
+	  firstSeconds( 0.0 ), refineSeconds( 0.0 ), resolveSeconds( 0.0 ), totalSeconds( 0.0 ),
+	  rounds( 0 ), converged( false )
+{
+}
+
+// A quarter of each distribution budget, so that the first pass is quick
+// and the rest are spent only where the pixels turn out to need them.
+RenderSettings BudgetRenderer::sampleSettings( const RenderSettings& settings )
+{
+	RenderSettings s = settings;
+	s.glossySamples = std::max( 1, settings.glossySamples / 4 );
+	s.pointShadowSamples = std::max( 1, settings.pointShadowSamples / 4 );
+	s.directionalShadowSamples = std::max( 1, settings.directionalShadowSamples / 4 );
+	s.motionBlurSamples = std::max( 1, settings.motionBlurSamples / 4 );
+	s.aaDepth = 0;
+	return s;
+}
+
+// Half the largest squared difference from a neighbour's first sample:
+// the variance two samples either side of that edge would have.
+double BudgetRenderer::prior( int i, int j ) const
+{
+	static const int di[] = { -1, 1, 0, 0 }, dj[] = { 0, 0, -1, 1 };
+
+	double L = sums[ i + j * width ];
+	double most = 0.0;
+	for( int k = 0; k < 4; ++k )
+	{
+		int ni = i + di[k], nj = j + dj[k];
+		if( ni < 0 || nj < 0 || ni >= width || nj >= height )
+			continue;
+		double d = L - sums[ ni + nj * width ];
+		most = std::max( most, d * d );
+	}
+	return most / 2;
+}
+
+// The standard error of pixel p's mean.  The prior counts as one sample's
+// worth of variance, so it fades as the pixel's own samples come in.
+double BudgetRenderer::error( int p ) const
+{
+	int n = counts[p];
+	double mean = sums[p] / n;
+	double spread = std::max( 0.0, squares[p] - n * mean * mean );
+	double variance = ( spread + priors[p] ) / n;
+	return sqrt( variance / n );
+}
+
+void BudgetRenderer::render( int w, int h, const RenderSettings& settings, double seconds )
+{
+	Clock::time_point start = Clock::now();
+
+	width = w;
+	height = h;
+	budget = seconds;
+	rounds = 0;
+	converged = false;
+	refineSeconds = 0.0;
+
+	tracer->traceSetup( w, h, sampleSettings( settings ) );
+
+	// The first pass: one sample through the corner of every pixel, as
+	// traceLines always takes them.
+	int nBands = ( h + kBandRows - 1 ) / kBandRows;
+	pool.run( nBands, [&]( int b, int ) {
+		tracer->traceLines( b * kBandRows, std::min( h, ( b + 1 ) * kBandRows ) );
+	} );
+
+	int nPixels = w * h;
+	counts.assign( nPixels, 1 );
+	sums.resize( nPixels );
+	squares.resize( nPixels );
+	priors.resize( nPixels );
+	for( int j = 0; j < h; ++j )
+		for( int i = 0; i < w; ++i )
+		{
+			double L = luminance( tracer->pixelAverage( i, j ) );
+			sums[ i + j * w ] = L;
+			squares[ i + j * w ] = L * L;
+		}
+	for( int j = 0; j < h; ++j )
+		for( int i = 0; i < w; ++i )
+			priors[ i + j * w ] = prior( i, j );
+
+	// Time a resolve of the whole image, to know how much to keep back for
+	// the last one.
+	Clock::time_point firstDone = Clock::now();
+	tracer->resolveLines( 0, h );
+	Clock::time_point resolved = Clock::now();
+	firstSeconds = secondsBetween( start, firstDone );
+	Clock::duration reserve = 2 * ( resolved - firstDone );
+	Clock::time_point deadline = start
+		+ std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>( seconds ) )
+		- reserve;
+
+	// No sample is started unless the slowest one so far would still be
+	// done before the deadline.
+	std::atomic<long long> longest( 0 );
+	vector<int> order;
+	vector<double> errors( nPixels );
+
+	while( Clock::now() < deadline )
+	{
+		order.clear();
+		for( int p = 0; p < nPixels; ++p )
+		{
+			errors[p] = error( p );
+			if( errors[p] > 0.0 )
+				order.push_back( p );
+		}
+		if( order.empty() )
+		{
+			converged = true;
+			break;
+		}
+
+		// The worst quarter, worst first, so that a round the deadline cuts
+		// short has still done the ones that needed it most.
+		auto worse = [&]( int a, int b ) { return errors[a] > errors[b]; };
+		size_t k = std::min( order.size(), (size_t)std::max( 1, nPixels / 4 ) );
+		std::nth_element( order.begin(), order.begin() + ( k - 1 ), order.end(), worse );
+		order.resize( k );
+		std::sort( order.begin(), order.end(), worse );
+
+		std::atomic<bool> late( false );
+		int nChunks = (int)( ( k + kChunkPixels - 1 ) / kChunkPixels );
+		pool.run( nChunks, [&]( int c, int ) {
+			size_t stop = std::min( k, (size_t)( c + 1 ) * kChunkPixels );
+			for( size_t q = (size_t)c * kChunkPixels; q < stop && !late; ++q )
+			{
+				Clock::time_point t0 = Clock::now();
+				if( t0 + Clock::duration( longest.load() ) > deadline )
+				{
+					late = true;
+					break;
+				}
+
+				int p = order[q];
+				int i = p % w, j = p / w;
+				Sampler jitter( settings.sampler, kPositions,
+					Sampler::seedFor( vec3f( i, j, 0 ), vec3f( 0, 0, 1 ), 7 ) );
+				double u, v;
+				jitter.get( ( counts[p] - 1 ) % kPositions, u, v );
+
+				double L = luminance( tracer->addSample( i, j, u, v ) );
+				++counts[p];
+				sums[p] += L;
+				squares[p] += L * L;
+
+				long long took = ( Clock::now() - t0 ).count();
+				long long was = longest.load();
+				while( took > was && !longest.compare_exchange_weak( was, took ) )
+					;
+			}
+		} );
+		++rounds;
+
+		if( late )
+			break;
+	}
+
+	Clock::time_point refined = Clock::now();
+	tracer->resolveLines( 0, h );
+	Clock::time_point done = Clock::now();
+
+	refineSeconds = secondsBetween( resolved, refined );
+	resolveSeconds = secondsBetween( refined, done );
+	totalSeconds = secondsBetween( start, done );
+}
+
+void BudgetRenderer::writeReport( ostream& os ) const
+{
+	int nPixels = width * height;
+	if( !nPixels )
+		return;
+
+	os << setiosflags( ios::fixed ) << setprecision( 3 );
+	os << "time budget " << budget << "s: first pass " << firstSeconds << "s, "
+		<< rounds << " refinement round(s) " << refineSeconds << "s, resolve "
+		<< resolveSeconds << "s, total " << totalSeconds << "s on "
+		<< pool.size() << " worker(s)" << endl;
+	if( firstSeconds > budget )
+		os << "  the first pass alone took longer than the budget" << endl;
+	if( converged )
+		os << "  stopped early: no pixel had any estimated error left" << endl;
+
+	// Samples per pixel, in buckets of powers of two.
+	long long total = 0;
+	int least = counts[0], most = counts[0];
+	vector<int> buckets;
+	for( int p = 0; p < nPixels; ++p )
+	{
+		total += counts[p];
+		least = std::min( least, counts[p] );
+		most = std::max( most, counts[p] );
+
+		size_t b = 0;
+		while( ( 2 << b ) <= counts[p] )
+			++b;
+		if( buckets.size() <= b )
+			buckets.resize( b + 1, 0 );
+		++buckets[b];
+	}
+
+	os << "samples per pixel: mean " << setprecision( 2 ) << double( total ) / nPixels
+		<< ", min " << least << ", max " << most << endl;
+	for( size_t b = 0; b < buckets.size(); ++b )
+	{
+		if( !buckets[b] )
+			continue;
+		int lo = 1 << b, hi = ( 2 << b ) - 1;
+		ostringstream range;
+		range << lo;
+		if( hi > lo )
+			range << "-" << hi;
+		os << "  " << setw( 9 ) << left << range.str() << right << setw( 8 ) << buckets[b]
+			<< " pixels  " << setw( 6 ) << 100.0 * buckets[b] / nPixels << "%" << endl;
+	}
+
+	// Estimated error, in steps of the 8-bit output.
+	vector<double> errors( nPixels );
+	double sum = 0.0;
+	for( int p = 0; p < nPixels; ++p )
+	{
+		errors[p] = 255.0 * error( p );
+		sum += errors[p];
+	}
+	size_t nth = std::min( (size_t)nPixels - 1, (size_t)( 0.99 * nPixels ) );
+	std::nth_element( errors.begin(), errors.begin() + nth, errors.end() );
+	double percentile = errors[ nth ];
+	double worst = *std::max_element( errors.begin() + nth, errors.end() );
+
+	os << "estimated error (of 255): mean " << sum / nPixels << ", 99th percentile "
+		<< percentile << ", max " << worst << endl;
+	os << setprecision( 3 );
+}
@@ -0,0 +1,69 @@
+//
+// BudgetRenderer.h
+//
+// Renders one image in a fixed amount of wall clock time.  A quick first
+// pass gives every pixel one sample, with the glossy, shadow and motion
+// blur budgets of each cut down; the rest of the time goes on more
+// jittered samples of whichever pixels' estimated error is highest, a
+// round at a time, spread across a WorkerPool.  Each extra sample brings
+// its own glossy and shadow rays, so a noisy highlight or penumbra gets
+// more of them along with the anti-aliasing.  Every sample is only
+// started if it should be done before the deadline, less the time kept
+// back for resolving the image, so the image is always complete on time.
+//
+// A pixel's error is the standard error of the mean of its samples'
+// luminance.  Its variance is estimated from its samples, together with
+// a prior from how much it differs from its neighbours, which is all
+// there is to go on after one sample.
+//
+
+#ifndef __BUDGETRENDERER_H__
+#define __BUDGETRENDERER_H__
+
+#include <iostream>
+#include <vector>
+
+#include "WorkerPool.h"
+#include "RenderSettings.h"
+
+using namespace std;
+
+class RayTracer;
+
+class BudgetRenderer
+{
+public:
+	BudgetRenderer( RayTracer *tracer, int nThreads = 0, bool pin = false );
+
+	// Render a w x h image into the tracer, taking seconds of wall clock
+	// time from the call, or as little more as the first pass needs.
+	void render( int w, int h, const RenderSettings& settings, double seconds );
+
+	// Samples per pixel and estimated error of the last render.
+	void writeReport( ostream& os ) const;
+
+	// The settings the samples are traced with: settings with its
+	// per-sample budgets cut down, and no adaptive anti-aliasing, which
+	// the refinement does instead.
+	static RenderSettings sampleSettings( const RenderSettings& settings );
+
+private:
+	double error( int p ) const;
+	double prior( int i, int j ) const;
+
+	RayTracer *tracer;
+	WorkerPool pool;
+	int width, height;
+
+	// per pixel: samples, and the sums of their luminance and its square
+	vector<int> counts;
+	vector<double> sums, squares;
+	vector<double> priors;
+
+	double budget;
+	double firstSeconds, refineSeconds, resolveSeconds, totalSeconds;
+	int rounds;
+	bool converged;			// stopped early, with no error left anywhere
+};
+
+#endif // __BUDGETRENDERER_H__
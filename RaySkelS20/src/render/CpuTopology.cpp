@@ -0,0 +1,176 @@
+#ifdef WIN32
+#include <windows.h>
+#else
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include <fstream>
+#include <sstream>
+#include <string>
+#endif
+
+#include <thread>
+
+#include "CpuTopology.h"
+
+#ifdef WIN32
+// logical CPUs per processor group, at most
+static const int kGroupBits = 8 * sizeof( KAFFINITY );
+#endif
+
+#if !defined( WIN32 ) && defined( __linux__ )
+// Parse a sysfs cpu list such as "0-3,8-11".
+static vector<int> parseCpuList( const string& list )
+{
+	vector<int> cpus;
+	istringstream iss( list );
+	string range;
+
+	while( getline( iss, range, ',' ) ) {
+		int lo, hi;
+		char dash;
+		istringstream rs( range );
+		if( !(rs >> lo) )
+			continue;
+		if( rs >> dash >> hi ) {
+			for( int c = lo; c <= hi; ++c )
+				cpus.push_back( c );
+		} else {
+			cpus.push_back( lo );
+		}
+	}
+
+	return cpus;
+}
+#endif
+
+const CpuTopology& CpuTopology::get()
+{
+	static CpuTopology topology;
+	return topology;
+}
+
+CpuTopology::CpuTopology()
+	: m_nCpus( 0 )
+{
+#ifdef WIN32
+	// Machines with more logical CPUs than a KAFFINITY has bits split them
+	// into processor groups, and a node lies within one group.  CPU numbers
+	// here run on from one group to the next: bit b of group g is CPU
+	// g * kGroupBits + b.
+	ULONG highest = 0;
+	if( GetNumaHighestNodeNumber( &highest ) ) {
+		for( ULONG node = 0; node <= highest; ++node ) {
+			GROUP_AFFINITY affinity;
+			if( !GetNumaNodeProcessorMaskEx( (USHORT)node, &affinity ) || !affinity.Mask )
+				continue;
+
+			vector<int> cpus;
+			for( int b = 0; b < kGroupBits; ++b )
+				if( affinity.Mask & ( (KAFFINITY)1 << b ) )
+					cpus.push_back( affinity.Group * kGroupBits + b );
+			if( !cpus.empty() )
+				nodes.push_back( cpus );
+		}
+	}
+#elif defined( __linux__ )
+	for( int node = 0; ; ++node ) {
+		ostringstream path;
+		path << "/sys/devices/system/node/node" << node << "/cpulist";
+		ifstream ifs( path.str().c_str() );
+		if( !ifs )
+			break;
+
+		string list;
+		getline( ifs, list );
+		vector<int> cpus = parseCpuList( list );
+		if( !cpus.empty() )
+			nodes.push_back( cpus );
+	}
+#endif
+
+	if( nodes.empty() ) {
+		int n = (int)std::thread::hardware_concurrency();
+		nodes.push_back( vector<int>() );
+		for( int c = 0; c < ( n > 0 ? n : 1 ); ++c )
+			nodes[0].push_back( c );
+	}
+
+	for( int node = 0; node < (int)nodes.size(); ++node ) {
+		for( size_t k = 0; k < nodes[node].size(); ++k ) {
+			int cpu = nodes[node][k];
+			if( cpu >= (int)cpuNode.size() )
+				cpuNode.resize( cpu + 1, -1 );
+			cpuNode[cpu] = node;
+			++m_nCpus;
+		}
+	}
+}
+
+int CpuTopology::nodeOfCpu( int cpu ) const
+{
+	if( cpu < 0 || cpu >= (int)cpuNode.size() || cpuNode[cpu] < 0 )
+		return 0;
+	return cpuNode[cpu];
+}
+
+vector<int> CpuTopology::interleavedCpus() const
+{
+	vector<int> order;
+
+	for( size_t k = 0; ; ++k ) {
+		bool any = false;
+		for( size_t node = 0; node < nodes.size(); ++node ) {
+			if( k < nodes[node].size() ) {
+				order.push_back( nodes[node][k] );
+				any = true;
+			}
+		}
+		if( !any )
+			break;
+	}
+
+	return order;
+}
+
+bool CpuTopology::pinCurrentThread( int cpu ) const
+{
+	return pinToCpus( vector<int>( 1, cpu ) );
+}
+
+bool CpuTopology::pinCurrentThreadToNode( int node ) const
+{
+	if( node < 0 || node >= numNodes() )
+		return false;
+	return pinToCpus( nodes[node] );
+}
+
+bool CpuTopology::pinToCpus( const vector<int>& cpus ) const
+{
+#ifdef WIN32
+	// A thread can only run within one processor group, which is the
+	// first CPU's; a node never spans two.
+	if( cpus.empty() )
+		return false;
+
+	GROUP_AFFINITY affinity;
+	ZeroMemory( &affinity, sizeof( affinity ) );
+	affinity.Group = (WORD)( cpus[0] / kGroupBits );
+	for( size_t k = 0; k < cpus.size(); ++k )
+		if( cpus[k] / kGroupBits == affinity.Group )
+			affinity.Mask |= (KAFFINITY)1 << ( cpus[k] % kGroupBits );
+
+	return SetThreadGroupAffinity( GetCurrentThread(), &affinity, NULL ) != 0;
+#elif defined( __linux__ )
+	cpu_set_t set;
+	CPU_ZERO( &set );
+	for( size_t k = 0; k < cpus.size(); ++k )
+		if( cpus[k] < CPU_SETSIZE )
+			CPU_SET( cpus[k], &set );
+
+	return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+#else
+	return false;
+#endif
+}
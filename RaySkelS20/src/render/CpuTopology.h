@@ -0,0 +1,49 @@
+//
+// CpuTopology.h
+//
+// Which logical CPUs belong to which NUMA node, and how to pin the calling
+// thread to one of them.  On machines (or platforms) where the layout can't
+// be discovered everything is reported as a single node holding all CPUs,
+// and pinning quietly does nothing.
+//
+
+#ifndef __CPUTOPOLOGY_H__
+#define __CPUTOPOLOGY_H__
+
+#include <vector>
+
+using namespace std;
+
+class CpuTopology
+{
+public:
+	// discovered once, on first use
+	static const CpuTopology& get();
+
+	int numNodes() const { return (int)nodes.size(); }
+	int numCpus() const { return m_nCpus; }
+
+	const vector<int>& cpusOfNode( int node ) const { return nodes[node]; }
+	int nodeOfCpu( int cpu ) const;
+
+	// All CPUs, ordered so that consecutive entries alternate between the
+	// nodes.  Handing these out in order spreads a partly used pool evenly
+	// over every socket's memory controller.
+	vector<int> interleavedCpus() const;
+
+	// Restrict the calling thread to one CPU or to the CPUs of one node.
+	// Returns false if that isn't possible here.
+	bool pinCurrentThread( int cpu ) const;
+	bool pinCurrentThreadToNode( int node ) const;
+
+private:
+	CpuTopology();
+
+	bool pinToCpus( const vector<int>& cpus ) const;
+
+	vector< vector<int> > nodes;	// node -> logical CPUs
+	vector<int> cpuNode;			// logical CPU -> node, -1 if offline
+	int m_nCpus;
+};
+
+#endif // __CPUTOPOLOGY_H__
@@ -0,0 +1,83 @@
+//
+// MediumStack.h
+//
+// The transparent objects a ray is currently inside, innermost last, with
+// their indices of refraction.  The capacity is fixed, so a stack lives in
+// trace()'s frame and is passed down the recursion by reference: a ray that
+// refracts into an object pushes it and pops it again when its subtree is
+// done.  Media are identified by SceneObject::getMedium(), so the faces of
+// one closed mesh count as a single medium, and overlapping objects can be
+// left in any order.
+//
+
+#ifndef __MEDIUMSTACK_H__
+#define __MEDIUMSTACK_H__
+
+class MediumStack
+{
+public:
+	enum { CAPACITY = 16 };
+
+	struct Medium
+	{
+		const void *id;
+		double index;
+	};
+
+	// outsideIndex is the index of refraction of empty space.
+	MediumStack( double outsideIndex = 1.0 )
+		: count( 0 ), outside( outsideIndex ) {}
+
+	int size() const { return count; }
+
+	// index of refraction of the innermost medium
+	double index() const { return count ? media[ count - 1 ].index : outside; }
+
+	// Position of the medium in the stack, or -1 if the ray isn't inside it.
+	int find( const void *id ) const
+	{
+		for( int k = count - 1; k >= 0; --k )
+			if( media[k].id == id )
+				return k;
+		return -1;
+	}
+
+	// Returns false, and forgets the medium, if the stack is already full.
+	bool push( const void *id, double index )
+	{
+		if( count == CAPACITY )
+			return false;
+		media[ count ].id = id;
+		media[ count ].index = index;
+		++count;
+		return true;
+	}
+
+	void pop() { --count; }
+
+	// Take out the medium at pos, which need not be the innermost.
+	Medium removeAt( int pos )
+	{
+		Medium m = media[ pos ];
+		for( int k = pos; k < count - 1; ++k )
+			media[k] = media[ k + 1 ];
+		--count;
+		return m;
+	}
+
+	// Undo removeAt( pos ).
+	void insertAt( int pos, const Medium& m )
+	{
+		for( int k = count; k > pos; --k )
+			media[k] = media[ k - 1 ];
+		media[ pos ] = m;
+		++count;
+	}
+
+private:
+	Medium media[ CAPACITY ];
+	int count;
+	double outside;
+};
+
+#endif // __MEDIUMSTACK_H__
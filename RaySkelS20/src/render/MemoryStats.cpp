@@ -0,0 +1,91 @@
+#include <atomic>
+#include <iomanip>
+
+#include "MemoryStats.h"
+
+static std::atomic<long long> s_current[ MEM_CATEGORIES ];
+static std::atomic<long long> s_peak[ MEM_CATEGORIES ];
+static std::atomic<long long> s_total( 0 );
+static std::atomic<long long> s_totalPeak( 0 );
+static std::atomic<long long> s_budget( 0 );
+
+// Raise peak to value if it is below it.
+static void raise( std::atomic<long long>& peak, long long value )
+{
+	long long seen = peak.load();
+	while( seen < value && !peak.compare_exchange_weak( seen, value ) )
+		;
+}
+
+void MemoryStats::add( MemoryCategory c, long long bytes )
+{
+	raise( s_peak[c], s_current[c] += bytes );
+	raise( s_totalPeak, s_total += bytes );
+}
+
+long long MemoryStats::current( MemoryCategory c )
+{
+	return s_current[c];
+}
+
+long long MemoryStats::peak( MemoryCategory c )
+{
+	return s_peak[c];
+}
+
+long long MemoryStats::totalCurrent()
+{
+	return s_total;
+}
+
+long long MemoryStats::totalPeak()
+{
+	return s_totalPeak;
+}
+
+const char *MemoryStats::name( MemoryCategory c )
+{
+	static const char *names[ MEM_CATEGORIES ] = {
+		"parse tree",
+		"scene objects",
+		"materials",
+		"transforms",
+		"acceleration",
+		"framebuffer",
+		"sample buffers"
+	};
+	return names[c];
+}
+
+void MemoryStats::setBudget( long long bytes )
+{
+	s_budget = bytes;
+}
+
+long long MemoryStats::budget()
+{
+	return s_budget;
+}
+
+bool MemoryStats::fits( long long more )
+{
+	return s_budget <= 0 || s_total + more <= s_budget;
+}
+
+void MemoryStats::report( ostream& os )
+{
+	const long long KB = 1024;
+
+	os << "memory            current(KB)  peak(KB)" << endl;
+	for( int c = 0; c < MEM_CATEGORIES; ++c ) {
+		os << "  " << setw( 14 ) << left << name( MemoryCategory( c ) ) << right
+			<< "  " << setw( 10 ) << s_current[c] / KB
+			<< "  " << setw( 8 ) << s_peak[c] / KB << endl;
+	}
+	os << "  " << setw( 14 ) << left << "total" << right
+		<< "  " << setw( 10 ) << s_total / KB
+		<< "  " << setw( 8 ) << s_totalPeak / KB;
+	if( s_budget > 0 )
+		os << "  (budget " << s_budget / KB << ")";
+	os << endl;
+}
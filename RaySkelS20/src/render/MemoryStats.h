@@ -0,0 +1,84 @@
+//
+// MemoryStats.h
+//
+// Running totals of the memory held by each part of the renderer, so that
+// the cost of a scene can be reported and loads can be held to a budget.
+// The counts are of the big allocations each part makes (parse tree
+// blocks, mesh arrays, the image buffer, ...), not of every byte on the
+// heap, and they are process-wide: several scenes loaded at once add up.
+//
+
+#ifndef __MEMORYSTATS_H__
+#define __MEMORYSTATS_H__
+
+#include <cstddef>
+#include <iostream>
+
+using namespace std;
+
+enum MemoryCategory
+{
+	MEM_PARSE_TREE,
+	MEM_SCENE_OBJECTS,
+	MEM_MATERIALS,
+	MEM_TRANSFORMS,
+	MEM_ACCELERATION,
+	MEM_FRAMEBUFFER,
+	MEM_SAMPLES,
+
+	MEM_CATEGORIES
+};
+
+class MemoryStats
+{
+public:
+	// Charge bytes to c, or release them if bytes is negative.
+	static void add( MemoryCategory c, long long bytes );
+
+	static long long current( MemoryCategory c );
+	static long long peak( MemoryCategory c );
+	static long long totalCurrent();
+	static long long totalPeak();
+
+	static const char *name( MemoryCategory c );
+
+	// A budget of 0 means no limit.  Nothing is refused when the budget is
+	// passed; loaders check fits() and give up cleanly instead.
+	static void setBudget( long long bytes );
+	static long long budget();
+
+	// Whether another more bytes can be charged without passing the budget.
+	static bool fits( long long more = 0 );
+
+	// A table of current and peak bytes for every category.
+	static void report( ostream& os );
+};
+
+// Bytes charged to one category for as long as the owner lives.  set()
+// moves the charge to a new size, so an owner can keep it in step with
+// the containers it is accounting for.
+class MemoryCharge
+{
+public:
+	MemoryCharge( MemoryCategory c )
+		: category( c ), bytes( 0 ) {}
+	~MemoryCharge() { set( 0 ); }
+
+	void set( size_t n )
+	{
+		MemoryStats::add( category, (long long)n - (long long)bytes );
+		bytes = n;
+	}
+	void add( size_t n ) { set( bytes + n ); }
+
+	size_t get() const { return bytes; }
+
+private:
+	MemoryCharge( const MemoryCharge& );
+	MemoryCharge& operator =( const MemoryCharge& );
+
+	MemoryCategory category;
+	size_t bytes;
+};
+
+#endif // __MEMORYSTATS_H__
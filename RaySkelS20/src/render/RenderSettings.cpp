@@ -0,0 +1,146 @@
+#include <cerrno>
+#include <cfloat>
+#include <cstdlib>
+
+#include "RenderSettings.h"
+
+// The defaults match the initial positions of the TraceUI sliders.
+RenderSettings::RenderSettings()
+	: depth( 0 )
+	, threshold( 0.05 )
+	, rouletteDepth( 0 )
+	, distA( 0.25 )
+	, distB( 0.05 )
+	, distC( 0.025 )
+	, softShadow( false )
+	, glossyReflection( false )
+	, motionBlur( false )
+	, glossySamples( 16 )
+	, pointShadowSamples( 16 )
+	, directionalShadowSamples( 16 )
+	, motionBlurSamples( 15 )
+	, blurThreshold( 0.02 )
+	, shadowProbes( 4 )
+	, sampler( SAMPLER_SOBOL )
+	, aaDepth( 0 )
+	, aaThreshold( 0.1 )
+	, toneMap( TONE_CLAMP )
+	, gamma( 1.0 )
+	, dither( false )
+{
+}
+
+// The most a depth or a sample count may be set to; far past anything
+// worth rendering, but short of overflowing the counts made from them.
+static const int kMaxDepth = 64;
+static const int kMaxSamples = 1 << 16;
+
+// v as a whole number in [lo, hi], into out; false, leaving out alone,
+// if it is anything else, trailing junk included.
+static bool parseInt( const char *v, int lo, int hi, int& out )
+{
+	char *end;
+	errno = 0;
+	long n = strtol( v, &end, 10 );
+	if( end == v || *end || errno == ERANGE || n < lo || n > hi )
+		return false;
+	out = (int)n;
+	return true;
+}
+
+static bool parseDouble( const char *v, double lo, double hi, double& out )
+{
+	char *end;
+	errno = 0;
+	double d = strtod( v, &end );
+	if( end == v || *end || errno == ERANGE || !( d >= lo && d <= hi ) )
+		return false;
+	out = d;
+	return true;
+}
+
+static bool parseBool( const char *v, bool& out )
+{
+	int n;
+	if( !parseInt( v, 0, 1, n ) )
+		return false;
+	out = n != 0;
+	return true;
+}
+
+bool RenderSettings::set( const string& name, const string& value )
+{
+	const char *v = value.c_str();
+
+	if( name == "depth" ) {
+		return parseInt( v, 0, kMaxDepth, depth );
+	} else if( name == "thresh" ) {
+		return parseDouble( v, 0.0, 1.0, threshold );
+	} else if( name == "roulette_depth" ) {
+		return parseInt( v, 0, kMaxDepth, rouletteDepth );
+	} else if( name == "atten_a" ) {
+		return parseDouble( v, 0.0, DBL_MAX, distA );
+	} else if( name == "atten_b" ) {
+		return parseDouble( v, 0.0, DBL_MAX, distB );
+	} else if( name == "atten_c" ) {
+		return parseDouble( v, 0.0, DBL_MAX, distC );
+	} else if( name == "soft_shadow" ) {
+		return parseBool( v, softShadow );
+	} else if( name == "glossy" ) {
+		return parseBool( v, glossyReflection );
+	} else if( name == "motion_blur" ) {
+		return parseBool( v, motionBlur );
+	} else if( name == "glossy_samples" ) {
+		return parseInt( v, 0, kMaxSamples, glossySamples );
+	} else if( name == "point_shadow_samples" ) {
+		return parseInt( v, 0, kMaxSamples, pointShadowSamples );
+	} else if( name == "dir_shadow_samples" ) {
+		return parseInt( v, 0, kMaxSamples, directionalShadowSamples );
+	} else if( name == "blur_samples" ) {
+		return parseInt( v, 0, kMaxSamples, motionBlurSamples );
+	} else if( name == "blur_threshold" ) {
+		return parseDouble( v, 0.0, DBL_MAX, blurThreshold );
+	} else if( name == "shadow_probes" ) {
+		return parseInt( v, 0, kMaxSamples, shadowProbes );
+	} else if( name == "sampler" ) {
+		if( value == "random" )
+			sampler = SAMPLER_RANDOM;
+		else if( value == "stratified" )
+			sampler = SAMPLER_STRATIFIED;
+		else if( value == "halton" )
+			sampler = SAMPLER_HALTON;
+		else if( value == "sobol" )
+			sampler = SAMPLER_SOBOL;
+		else
+			return false;
+	} else if( name == "aa_depth" ) {
+		// every level can split a pixel in four again
+		return parseInt( v, 0, 8, aaDepth );
+	} else if( name == "aa_threshold" ) {
+		return parseDouble( v, 0.0, DBL_MAX, aaThreshold );
+	} else if( name == "tonemap" ) {
+		if( value == "clamp" )
+			toneMap = TONE_CLAMP;
+		else if( value == "reinhard" )
+			toneMap = TONE_REINHARD;
+		else
+			return false;
+	} else if( name == "gamma" ) {
+		// 0 leaves the values as they are, like 1
+		return parseDouble( v, 0.0, DBL_MAX, gamma );
+	} else if( name == "dither" ) {
+		return parseBool( v, dither );
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+const char *RenderSettings::names()
+{
+	return "depth thresh roulette_depth atten_a atten_b atten_c soft_shadow glossy motion_blur\n"
+		"glossy_samples point_shadow_samples dir_shadow_samples blur_samples\n"
+		"blur_threshold shadow_probes sampler (random, stratified, halton or sobol)\n"
+		"aa_depth aa_threshold tonemap (clamp or reinhard) gamma dither";
+}
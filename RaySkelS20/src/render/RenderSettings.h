@@ -0,0 +1,89 @@
+//
+// RenderSettings.h
+//
+// Everything about a render that isn't part of the scene: recursion depth,
+// cutoffs, attenuation and which distribution effects are turned on.  The
+// tracer takes a copy at traceSetup() time and only ever reads it, so
+// several renders with different settings can share one Scene.
+//
+
+#ifndef __RENDERSETTINGS_H__
+#define __RENDERSETTINGS_H__
+
+#include <string>
+
+using namespace std;
+
+struct RenderSettings
+{
+	RenderSettings();
+
+	int depth;					// maximum recursion depth
+	double threshold;			// don't trace rays weighted less than this
+	int rouletteDepth;			// from this depth on, play Russian roulette instead; 0 never
+
+	// distance attenuation 1 / (A + B d + C d^2) for point lights
+	double distA;
+	double distB;
+	double distC;
+
+	bool softShadow;
+	bool glossyReflection;
+	bool motionBlur;
+
+	// extra rays per effect, on top of the one sharp ray
+	//
+	// The defaults are powers of two, which suit the Sobol sampler best;
+	// 16 of its rays come out less noisy than the 39 or 49 random ones
+	// these effects used to take.
+	//
+	// Glossy reflection splits a path only once: the first glossy bounce
+	// on it sends the sharp ray and glossySamples jittered ones, and every
+	// bounce below those sends one jittered ray.  So turning it on costs
+	// at most glossySamples + 1 times as many rays as leaving it off,
+	// however deep the recursion, rather than that to the power depth.
+	int glossySamples;
+	int pointShadowSamples;
+	int directionalShadowSamples;
+	int motionBlurSamples;
+
+	// Motion blur stops adding time samples to a pixel once the standard
+	// error of their average is under this in every channel.
+	double blurThreshold;
+
+	// Soft shadows cast this many of their rays first, and the rest only
+	// if those don't all agree with the sharp ray; 0 always casts them all.
+	// A light can override both its budget and this.
+	int shadowProbes;
+
+	// where in its spread each of those extra rays goes
+	enum SamplerType { SAMPLER_RANDOM, SAMPLER_STRATIFIED, SAMPLER_HALTON, SAMPLER_SOBOL };
+	SamplerType sampler;
+
+	// Adaptive anti-aliasing: with aaDepth above 0 every pixel's corners
+	// are sampled, and a pixel whose corners differ by more than
+	// aaThreshold in some channel is split in four, and so on down to
+	// aaDepth levels.
+	int aaDepth;
+	double aaThreshold;
+
+	// How the averaged samples become 8-bit pixels: clamped to [0, 1] or
+	// rolled off with x / (1 + x), raised to 1 / gamma, and dithered before
+	// they are rounded down.
+	enum ToneMap { TONE_CLAMP, TONE_REINHARD };
+	ToneMap toneMap;
+	double gamma;
+	bool dither;
+
+	// Set one field from a "name=value" style pair, as used on the command
+	// line and in batch manifests.  Returns false, leaving the field as it
+	// was, for an unknown name, or a value that doesn't parse or is out of
+	// the setting's range: switches take 0 or 1, and depths, counts and
+	// thresholds can't be negative.
+	bool set( const string& name, const string& value );
+
+	// Names accepted by set(), for usage messages.
+	static const char *names();
+};
+
+#endif // __RENDERSETTINGS_H__
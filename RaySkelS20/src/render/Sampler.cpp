@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "Sampler.h"
+#include "../scene/ray.h"
+
+// A well-mixing hash of 32 bits to 32 bits.
+static uint32_t mix( uint32_t h )
+{
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h;
+}
+
+static uint32_t combine( uint32_t seed, uint32_t v )
+{
+	return mix( seed ^ ( v + 0x9e3779b9u + ( seed << 6 ) + ( seed >> 2 ) ) );
+}
+
+static double toUnit( uint32_t x )
+{
+	return x * ( 1.0 / 4294967296.0 );
+}
+
+static uint32_t reverseBits( uint32_t x )
+{
+	x = ( x << 16 ) | ( x >> 16 );
+	x = ( ( x & 0x00ff00ffu ) << 8 ) | ( ( x & 0xff00ff00u ) >> 8 );
+	x = ( ( x & 0x0f0f0f0fu ) << 4 ) | ( ( x & 0xf0f0f0f0u ) >> 4 );
+	x = ( ( x & 0x33333333u ) << 2 ) | ( ( x & 0xccccccccu ) >> 2 );
+	x = ( ( x & 0x55555555u ) << 1 ) | ( ( x & 0xaaaaaaaau ) >> 1 );
+	return x;
+}
+
+// Owen scrambling, done with a hash in the manner of Laine and Karras:
+// on the bit-reversed value, each bit is flipped depending only on the
+// bits below it, which is a random permutation of every dyadic interval.
+static uint32_t owenScramble( uint32_t x, uint32_t seed )
+{
+	x = reverseBits( x );
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return reverseBits( x );
+}
+
+// The first two dimensions of the Sobol sequence: the van der Corput
+// sequence, and the one from the primitive polynomial x + 1.
+static uint32_t sobol0( uint32_t k )
+{
+	return reverseBits( k );
+}
+
+static uint32_t sobol1( uint32_t k )
+{
+	uint32_t r = 0;
+	for( uint32_t v = 1u << 31; k; k >>= 1, v ^= v >> 1 )
+		if( k & 1 )
+			r ^= v;
+	return r;
+}
+
+static double radicalInverse( uint32_t k, uint32_t base )
+{
+	double inv = 1.0 / base, f = inv, r = 0.0;
+	for( ; k; k /= base, f *= inv )
+		r += ( k % base ) * f;
+	return r;
+}
+
+Sampler::Sampler( RenderSettings::SamplerType t, int n, uint32_t s )
+	: type( t ), count( n ), seed( s )
+{
+	// As square a grid as n fills completely: any fewer than columns
+	// points left over go anywhere in the square, and as every cell has
+	// exactly one point, the set as a whole still covers it evenly.
+	n = std::max( n, 1 );
+	for( columns = 1; ( columns + 1 ) * ( columns + 1 ) <= n; ++columns )
+		;
+	rows = n / columns;
+	offsetU = toUnit( combine( s, 0x68616c74u ) );
+	offsetV = toUnit( combine( s, 0x6f6e2121u ) );
+}
+
+void Sampler::get( int k, double& u, double& v ) const
+{
+	switch( type )
+	{
+	case RenderSettings::SAMPLER_RANDOM:
+		u = toUnit( combine( seed, 2 * k ) );
+		v = toUnit( combine( seed, 2 * k + 1 ) );
+		break;
+
+	case RenderSettings::SAMPLER_STRATIFIED:
+		u = toUnit( combine( seed, 2 * k ) );
+		v = toUnit( combine( seed, 2 * k + 1 ) );
+		if( k < rows * columns ) {
+			u = ( k % columns + u ) / columns;
+			v = ( k / columns + v ) / rows;
+		}
+		break;
+
+	case RenderSettings::SAMPLER_HALTON:
+		u = radicalInverse( k, 2 ) + offsetU;
+		v = radicalInverse( k, 3 ) + offsetV;
+		u -= floor( u );
+		v -= floor( v );
+		break;
+
+	case RenderSettings::SAMPLER_SOBOL:
+	default:
+		u = toUnit( owenScramble( sobol0( k ), seed ) );
+		v = toUnit( owenScramble( sobol1( k ), mix( seed + 1 ) ) );
+		break;
+	}
+}
+
+uint32_t Sampler::seedFor( const vec3f& P, const vec3f& d, uint32_t salt )
+{
+	uint32_t h = mix( salt );
+	for( int k = 0; k < 3; ++k )
+	{
+		uint64_t bits[2];
+		memcpy( &bits[0], &P.n[k], sizeof( double ) );
+		memcpy( &bits[1], &d.n[k], sizeof( double ) );
+		for( int b = 0; b < 2; ++b )
+			h = combine( combine( h, (uint32_t)bits[b] ), (uint32_t)( bits[b] >> 32 ) );
+	}
+	return h;
+}
+
+double Sampler::uniform( uint32_t seed )
+{
+	return toUnit( mix( seed ) );
+}
+
+DirectionJitter::DirectionJitter( const vec3f& d, double r )
+	: dir( d ), radius( r )
+{
+	up = vec3f( 0, 1, 0 );
+
+	if( ( dir.normalize() - up ).length() < RAY_EPSILON )
+		up = vec3f( 1, 0, 0 );
+
+	right = dir.cross( up );
+	up = right.cross( dir );
+}
@@ -0,0 +1,67 @@
+//
+// Sampler.h
+//
+// Points in the unit square for the distribution effects -- glossy
+// reflection, soft shadows, motion blur -- which turn each point into one
+// of a set of rays.  A Sampler makes one set: the count points of a
+// random, jittered-grid, Halton or Owen-scrambled Sobol sequence, each
+// worked out on demand from its index, so nothing is allocated.
+//
+// Sets are decorrelated by their seed.  seedFor() hashes the point and
+// direction the rays fan out from, which differ from pixel to pixel and
+// bounce to bounce, so neighbouring pixels don't share one pattern of
+// error; and it needs no state, so any thread can make a Sampler.
+//
+
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#include <cstdint>
+
+#include "RenderSettings.h"
+#include "../vecmath/vecmath.h"
+
+class Sampler
+{
+public:
+	Sampler( RenderSettings::SamplerType type, int count, uint32_t seed );
+
+	// Point k of the set, for k from 0 to count-1.
+	void get( int k, double& u, double& v ) const;
+
+	// A seed for the set of rays fanning out from P around d.  salt tells
+	// apart the sets of different effects at the same point.
+	static uint32_t seedFor( const vec3f& P, const vec3f& d, uint32_t salt );
+
+	// A single number in [0, 1) for a decision made with probability, so
+	// that it too is the same however the image is split among threads.
+	static double uniform( uint32_t seed );
+
+private:
+	RenderSettings::SamplerType type;
+	int count;
+	int columns, rows;		// of the jittered grid; the rest are uniform
+	uint32_t seed;
+	double offsetU, offsetV;	// Cranley-Patterson rotation of the Halton points
+};
+
+// Directions spread over a square across the end of dir, as a reflected
+// or shadow ray is perturbed for distribution ray tracing: (u, v) in the
+// unit square goes to dir plus up to radius along each of two directions
+// perpendicular to it.
+class DirectionJitter
+{
+public:
+	DirectionJitter( const vec3f& dir, double radius );
+
+	vec3f at( double u, double v ) const
+	{
+		return dir + right * ( u * radius * 2 - radius ) + up * ( v * radius * 2 - radius );
+	}
+
+private:
+	vec3f dir, right, up;
+	double radius;
+};
+
+#endif // __SAMPLER_H__
@@ -0,0 +1,109 @@
+#include "ShadeBatch.h"
+#include "RenderSettings.h"
+#include "../scene/light.h"
+#include "../scene/material.h"
+#include "../vecmath/vecpack.h"
+
+void ShadeBatch::clear()
+{
+	rays.clear();
+	hits.clear();
+	tags.clear();
+	count = 0;
+}
+
+void ShadeBatch::add( const ray& r, const isect& i, int tag )
+{
+	rays.push_back( r );
+	hits.push_back( i );
+	tags.push_back( tag );
+	++count;
+}
+
+// The diffuse and specular terms of hits from to to for the current light,
+// times its color, into lit.  The same sums as Material::shade(), term by
+// term; even the reflected vector is, as there, left unnormalized.
+template <class P>
+void ShadeBatch::phong( int from, int to )
+{
+	for( int k = from; k + P::WIDTH <= to; k += P::WIDTH )
+	{
+		P nx = P::load( N[0] + k ), ny = P::load( N[1] + k ), nz = P::load( N[2] + k );
+		P lx = P::load( L[0] + k ), ly = P::load( L[1] + k ), lz = P::load( L[2] + k );
+		P vx = P::load( V[0] + k ), vy = P::load( V[1] + k ), vz = P::load( V[2] + k );
+
+		P nl = nx * lx + ny * ly + nz * lz;
+		P d = vmax( nl, P( 0.0 ) );
+
+		P twoNL = P( 2.0 ) * nl;
+		P rx = lx - twoNL * nx, ry = ly - twoNL * ny, rz = lz - twoNL * nz;
+		P rv = rx * vx + ry * vy + rz * vz;
+		P s = vpow( vmax( rv, P( 0.0 ) ), P::load( &exponent[k] ) );
+
+		for( int c = 0; c < 3; ++c )
+		{
+			P diffuse = d * P::load( kd[c] + k ) * P::load( transmit[c] + k );
+			P specular = s * P::load( ks[c] + k );
+			( ( diffuse + specular ) * P::load( lightColor[c] + k ) ).store( lit[c] + k );
+		}
+	}
+}
+
+void ShadeBatch::shade( Scene *scene, const RenderSettings& settings )
+{
+	if( !count )
+		return;
+
+	points.resize( count );
+	exponent.resize( count );
+	Lanes *lanes[] = { &N, &V, &kd, &ks, &transmit, &I, &L, &lightColor, &lit };
+	for( size_t k = 0; k < sizeof( lanes ) / sizeof( lanes[0] ); ++k )
+		lanes[k]->resize( count );
+
+	for( int k = 0; k < count; ++k )
+	{
+		const isect& i = hits[k];
+		const Material& m = i.getMaterial();
+
+		points[k] = rays[k].at( i.t );
+		N.set( k, i.N );
+		V.set( k, rays[k].getDirection() );
+		kd.set( k, m.kd );
+		ks.set( k, m.ks );
+		transmit.set( k, m.kt.length() > 0 ? vec3f( 1, 1, 1 ) - m.kt : vec3f( 1, 1, 1 ) );
+		exponent[k] = m.shininess * 128;
+		I.set( k, m.ke + prod( m.ka, scene->ambientLight ) );
+	}
+
+	int wide = count - count % WidePack::WIDTH;
+	for( Scene::cliter it = scene->beginLights(); it != scene->endLights(); ++it )
+	{
+		Light *light = *it;
+
+		for( int k = 0; k < count; ++k )
+		{
+			L.set( k, light->getDirection( points[k] ) );
+			lightColor.set( k, light->getColor( points[k] ) );
+		}
+
+		phong<WidePack>( 0, wide );
+		phong<Pack1>( wide, count );
+
+		// Only hits the light actually brightens need to know whether it
+		// is blocked.
+		shadowRays.clear();
+		for( int k = 0; k < count; ++k )
+			if( lit[0][k] != 0 || lit[1][k] != 0 || lit[2][k] != 0 )
+				shadowRays.push_back( k );
+
+		for( size_t s = 0; s < shadowRays.size(); ++s )
+		{
+			int k = shadowRays[s];
+			vec3f shadow = light->shadowAttenuation( points[k], rays[k].getTime(), settings );
+			double distance = light->distanceAttenuation( points[k], settings );
+			vec3f c = prod( vec3f( lit[0][k], lit[1][k], lit[2][k] ) * distance, shadow );
+			for( int j = 0; j < 3; ++j )
+				I[j][k] = I[j][k] + c[j];
+		}
+	}
+}
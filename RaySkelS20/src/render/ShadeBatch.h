@@ -0,0 +1,75 @@
+//
+// ShadeBatch.h
+//
+// Phong shading of many hits at once.  The hits a tile of camera rays
+// found are queued up, and then shaded light by light: the terms every
+// hit needs from the light are gathered, the Phong model is evaluated
+// for all of them in vector registers, and the shadow rays the hits still
+// need are traced together at the end.  The colors come out as
+// Material::shade() would give them, one hit at a time.
+//
+
+#ifndef __SHADEBATCH_H__
+#define __SHADEBATCH_H__
+
+#include <vector>
+
+#include "../scene/ray.h"
+
+using namespace std;
+
+class Scene;
+struct RenderSettings;
+
+class ShadeBatch
+{
+public:
+	ShadeBatch() : count( 0 ) {}
+
+	void clear();
+
+	// Queue the hit i of ray r.  tag is whatever the caller knows the hit
+	// by, such as the pixel it is for.
+	void add( const ray& r, const isect& i, int tag );
+
+	// Shade every queued hit, with the lights and ambient light of scene.
+	void shade( Scene *scene, const RenderSettings& settings );
+
+	int size() const { return count; }
+	const ray& rayAt( int k ) const { return rays[k]; }
+	const isect& hitAt( int k ) const { return hits[k]; }
+	int tagAt( int k ) const { return tags[k]; }
+	vec3f color( int k ) const { return vec3f( I[0][k], I[1][k], I[2][k] ); }
+
+private:
+	// x, y and z (or red, green and blue) in separate arrays
+	struct Lanes
+	{
+		vector<double> c[3];
+
+		void resize( int n ) { for( int k = 0; k < 3; ++k ) c[k].resize( n ); }
+		void set( int i, const vec3f& v ) { for( int k = 0; k < 3; ++k ) c[k][i] = v[k]; }
+		double *operator[]( int k ) { return &c[k][0]; }
+		const double *operator[]( int k ) const { return &c[k][0]; }
+	};
+
+	template <class P> void phong( int from, int to );
+
+	vector<ray> rays;
+	vector<isect> hits;
+	vector<int> tags;
+	int count;
+
+	// per hit
+	vector<vec3f> points;
+	Lanes N, V, kd, ks;
+	Lanes transmit;				// 1 - kt for transmissive materials, else 1
+	vector<double> exponent;	// of the specular highlight
+	Lanes I;
+
+	// per hit, for the light being done
+	Lanes L, lightColor, lit;
+	vector<int> shadowRays;		// hits the light might reach
+};
+
+#endif // __SHADEBATCH_H__
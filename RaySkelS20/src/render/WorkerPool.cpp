@@ -0,0 +1,69 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "WorkerPool.h"
+#include "CpuTopology.h"
+
+WorkerPool::WorkerPool( int nThreads, bool pin )
+{
+	m_nThreads = nThreads > 0 ? nThreads : hardwareThreads();
+	m_bPinned = false;
+
+	if( pin ) {
+		std::vector<int> cpus = CpuTopology::get().interleavedCpus();
+		if( !cpus.empty() ) {
+			for( int w = 0; w < m_nThreads; ++w )
+				m_cpus.push_back( cpus[ w % cpus.size() ] );
+			m_bPinned = true;
+		}
+	}
+}
+
+int WorkerPool::nodeOfWorker( int w ) const
+{
+	if( !m_bPinned || w < 0 || w >= m_nThreads )
+		return -1;
+	return CpuTopology::get().nodeOfCpu( m_cpus[w] );
+}
+
+int WorkerPool::hardwareThreads()
+{
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void WorkerPool::run( int count, const std::function<void (int, int)>& task )
+{
+	if( count <= 0 )
+		return;
+
+	std::atomic<int> next( 0 );
+
+	auto worker = [&]( int workerIndex ) {
+		for( int i = next++; i < count; i = next++ )
+			task( i, workerIndex );
+	};
+
+	int nWorkers = count < m_nThreads ? count : m_nThreads;
+
+	std::vector<std::thread> threads;
+
+	if( m_bPinned ) {
+		for( int w = 0; w < nWorkers; ++w ) {
+			threads.push_back( std::thread( [&, w]() {
+				CpuTopology::get().pinCurrentThread( m_cpus[w] );
+				worker( w );
+			} ) );
+		}
+	} else {
+		// the calling thread does its share instead of sitting in join()
+		for( int w = 1; w < nWorkers; ++w )
+			threads.push_back( std::thread( worker, w ) );
+
+		worker( 0 );
+	}
+
+	for( size_t w = 0; w < threads.size(); ++w )
+		threads[w].join();
+}
@@ -0,0 +1,43 @@
+//
+// WorkerPool.h
+//
+// A tiny fork/join pool used to spread independent pieces of rendering
+// work (whole frames, bands of scanlines, scene loads) across the cores.
+//
+
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <functional>
+#include <vector>
+
+class WorkerPool
+{
+public:
+	// nThreads <= 0 means one worker per hardware thread.  With pin set,
+	// worker w stays on one CPU for the whole of every run(), and the
+	// workers are dealt out round-robin over the NUMA nodes.
+	WorkerPool( int nThreads = 0, bool pin = false );
+
+	int size() const { return m_nThreads; }
+	bool pinned() const { return m_bPinned; }
+
+	// The node worker w runs on, or -1 if the pool isn't pinned.
+	int nodeOfWorker( int w ) const;
+
+	// Call task( taskIndex, workerIndex ) for every taskIndex in [0, count).
+	// Tasks are handed out in increasing order as workers become free, so
+	// callers should put the most expensive work first.  Blocks until every
+	// task has finished.  A pinned pool leaves the calling thread's
+	// affinity alone and does all the work on its own threads.
+	void run( int count, const std::function<void (int, int)>& task );
+
+	static int hardwareThreads();
+
+private:
+	int m_nThreads;
+	bool m_bPinned;
+	std::vector<int> m_cpus;		// worker -> CPU when pinned
+};
+
+#endif // __WORKERPOOL_H__
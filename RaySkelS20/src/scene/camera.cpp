@@ -13,6 +13,8 @@ Camera::Camera()
     u = vec3f( 1,0,0 );
     v = vec3f( 0,1,0 );
     look = vec3f( 0,0,-1 );
+
+    endEyeSet = endLookSet = false;
 }
 
 void
@@ -26,6 +28,33 @@ Camera::rayThrough( double x, double y, ray &r )
     r = ray( eye, dir.normalize() );
 }
 
+// The same ray at time in the shutter interval.  The view is blended
+// linearly from start to end, which is close enough for the small turns
+// of a panning or shaking camera.
+void
+Camera::rayThrough( double x, double y, double time, ray &r )
+{
+    if( !isMoving() )
+    {
+        rayThrough( x, y, r );
+        r = ray( r.getPosition(), r.getDirection(), time );
+        return;
+    }
+
+    x -= 0.5;
+    y -= 0.5;
+    vec3f e = endEyeSet ? eye + ( endEye - eye ) * time : eye;
+    vec3f l = look, du = u, dv = v;
+    if( endLookSet )
+    {
+        l += ( endLook - look ) * time;
+        du += ( endU - u ) * time;
+        dv += ( endV - v ) * time;
+    }
+    vec3f dir = l + x * du + y * dv;
+    r = ray( e, dir.normalize(), time );
+}
+
 void
 Camera::setEye( const vec3f &eye )
 {
@@ -67,6 +96,25 @@ Camera::setLook( const vec3f &viewDir, const vec3f &upDir )
     update();
 }
 
+void
+Camera::setEndEye( const vec3f &eye )
+{
+    endEye = eye;
+    endEyeSet = true;
+}
+
+void
+Camera::setEndLook( const vec3f &viewDir, const vec3f &upDir )
+{
+    vec3f z = -viewDir;
+    vec3f x = upDir.cross(z);
+
+    endM = mat3f( x,upDir,z ).transpose();
+    endLookSet = true;
+
+    update();
+}
+
 void
 Camera::setFOV( double fov )
 // fov - field of view (height) in degrees    
@@ -100,6 +148,10 @@ Camera::update()
     u = m * vec3f( 1,0,0 ) * normalizedHeight*aspectRatio;
     v = m * vec3f( 0,1,0 ) * normalizedHeight;
     look = m * vec3f( 0,0,-1 );
+
+    endU = endM * vec3f( 1,0,0 ) * normalizedHeight*aspectRatio;
+    endV = endM * vec3f( 0,1,0 ) * normalizedHeight;
+    endLook = endM * vec3f( 0,0,-1 );
 }
 
 
@@ -8,9 +8,16 @@ class Camera
 public:
     Camera();
     void rayThrough( double x, double y, ray &r );
+    void rayThrough( double x, double y, double time, ray &r );
     void setEye( const vec3f &eye );
     void setLook( double, double, double, double );
     void setLook( const vec3f &viewDir, const vec3f &upDir );
+
+    // Where the camera is and looks at the end of the shutter interval;
+    // in between, it goes in a straight line from the start.
+    void setEndEye( const vec3f &eye );
+    void setEndLook( const vec3f &viewDir, const vec3f &upDir );
+    bool isMoving() const { return endEyeSet || endLookSet; }
     void setFOV( double );
     void setAspectRatio( double );
 	void setAperture(double);
@@ -27,6 +34,11 @@ private:
     vec3f eye;
     vec3f look;                  // direction to look
     vec3f u,v;                   // u and v in the 
+
+    // the same at the end of the shutter interval, where set
+    mat3f endM;
+    vec3f endEye, endLook, endU, endV;
+    bool endEyeSet, endLookSet;
     double aperture;
 	double focusDistance;
 };
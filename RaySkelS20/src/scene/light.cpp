@@ -1,27 +1,80 @@
 #include <cmath>
+#include <limits>
 
 #include "light.h"
-#include "../ui/TraceUI.h"
+#include "../render/RenderSettings.h"
+#include "../render/Sampler.h"
 
-extern TraceUI* traceUI;
-extern std::vector<vec3f> distributedRays(vec3f ray, double radius, int count);
+// What reaches P from along d at time: the light's color, through
+// whatever transmissive object is in the way before reach.
+vec3f Light::attenuationAlong( const vec3f& P, double time, const vec3f& d, double reach ) const
+{
+	ray shadowRay( P + selfIntersectEpsilon( P ) * d, d, time );
+	isect i;
+	if( scene->intersect( shadowRay, i ) && ( shadowRay.at( i.t ) - P ).length() < reach )
+		return prod( color, i.getMaterial().kt );
+	return color;
+}
 
-double DirectionalLight::distanceAttenuation( const vec3f& P ) const
+// The sharp ray's attenuation averaged with that of samples more rays,
+// spread by radius around d.  A few probes, a set of their own so they
+// are stratified over the whole spread, are cast first; if every one is
+// attenuated exactly as the sharp ray was, P is taken to be fully lit or
+// fully shadowed and the rest of the budget isn't spent.  In a penumbra
+// the probes count towards the samples.
+vec3f Light::softAttenuation( const vec3f& P, double time, const vec3f& d, double reach, double radius,
+	int samples, uint32_t salt, const vec3f& sharp, const RenderSettings& settings ) const
+{
+	if( samples <= 0 )
+		return sharp;
+
+	int probes = shadowProbes >= 0 ? shadowProbes : settings.shadowProbes;
+	if( probes >= samples )
+		probes = 0;
+
+	DirectionJitter jitter( d, radius );
+	vec3f sum = sharp;
+	double u, v;
+
+	if( probes > 0 ) {
+		Sampler probe( settings.sampler, probes, Sampler::seedFor( P, d, salt + 16 ) );
+		bool agree = true;
+		for( int k = 0; k < probes; ++k ) {
+			probe.get( k, u, v );
+			vec3f a = attenuationAlong( P, time, jitter.at( u, v ), reach );
+			agree = agree && a == sharp;
+			sum += a;
+		}
+		if( agree )
+			return sharp;
+	}
+
+	int rest = samples - probes;
+	Sampler sampler( settings.sampler, rest, Sampler::seedFor( P, d, salt ) );
+	for( int k = 0; k < rest; ++k ) {
+		sampler.get( k, u, v );
+		sum += attenuationAlong( P, time, jitter.at( u, v ), reach );
+	}
+
+	return sum / ( samples + 1 );
+}
+
+double DirectionalLight::distanceAttenuation( const vec3f& P, const RenderSettings& /*settings*/ ) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
 	return 1.0;
 }
 
 
-vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
+vec3f DirectionalLight::shadowAttenuation( const vec3f& P, double time, const RenderSettings& settings ) const
 {
     // YOUR CODE HERE:
     // You should implement shadow-handling code here.
 
-	bool softShadow = traceUI->getSoftShadow();
+	bool softShadow = settings.softShadow;
 
 	vec3f d = -orientation;
-	ray shadowRay(P, d);
+	ray shadowRay(P + selfIntersectEpsilon(P) * d, d, time);
 
 	vec3f c = color;
 	isect i;
@@ -30,19 +83,8 @@ vec3f DirectionalLight::shadowAttenuation( const vec3f& P ) const
 	}
 
 	if (softShadow) {
-		std::vector<vec3f> samples;
-		samples = distributedRays(d, 0.01, 49);
-		for ( const vec3f& sample : samples ) {
-
-			ray shadowRay(P, sample);
-			isect i;
-			if (scene->intersect(shadowRay, i)) {
-				c += prod(color, i.getMaterial().kt);
-			} 
-			else c += color;
-
-		} 
-		c = c / (samples.size() + 1);
+		int n = shadowSamples >= 0 ? shadowSamples : settings.directionalShadowSamples;
+		c = softAttenuation(P, time, d, numeric_limits<double>::infinity(), 0.01, n, 2, c, settings);
 	}
 
     return c;
@@ -59,7 +101,7 @@ vec3f DirectionalLight::getDirection( const vec3f& P ) const
 	return -orientation;
 }
 
-double PointLight::distanceAttenuation( const vec3f& P ) const
+double PointLight::distanceAttenuation( const vec3f& P, const RenderSettings& settings ) const
 {
 	// YOUR CODE HERE
 
@@ -67,9 +109,9 @@ double PointLight::distanceAttenuation( const vec3f& P ) const
 	// of the light based on the distance between the source and the 
 	// point P.  For now, I assume no attenuation and just return 1.0
 	
-	double constantTerm = traceUI->getDistA();
-	double linearTerm = traceUI->getDistB();
-	double quadraticTerm = traceUI->getDistC();
+	double constantTerm = settings.distA;
+	double linearTerm = settings.distB;
+	double quadraticTerm = settings.distC;
 
 	double distance = (position - P).length();
 	double attenuation = 1.0 / (constantTerm + linearTerm * distance + quadraticTerm * distance * distance);
@@ -97,37 +139,19 @@ vec3f PointLight::getDirection( const vec3f& P ) const
 }
 
 
-vec3f PointLight::shadowAttenuation(const vec3f& P) const
+vec3f PointLight::shadowAttenuation(const vec3f& P, double time, const RenderSettings& settings) const
 {
     // YOUR CODE HERE:
     // You should implement shadow-handling code here.
-	bool softShadow = traceUI->getSoftShadow();
+	bool softShadow = settings.softShadow;
 
+	double reach = (position - P).length();
 	vec3f d = (position - P).normalize();
-	ray shadowRay(P, d);
-
-	vec3f c = color;
-	isect i;
-	if (scene->intersect(shadowRay, i)) {
-		if ((shadowRay.at(i.t) - P).length() < (position - P).length()) {
-			c = prod(c, i.getMaterial().kt);
-		}
-	}
+	vec3f c = attenuationAlong(P, time, d, reach);
 
 	if (softShadow) {
-		std::vector<vec3f> samples;
-		samples = distributedRays(d, 0.025, 39);
-		for (const vec3f& sample : samples) {
-
-			ray shadowRay(P, sample);
-			isect i;
-			if (scene->intersect(shadowRay, i)) {
-				c += prod(color, i.getMaterial().kt);
-			}
-			else c += color;
-
-		}
-		c = c / (samples.size() + 1);
+		int n = shadowSamples >= 0 ? shadowSamples : settings.pointShadowSamples;
+		c = softAttenuation(P, time, d, reach, 0.025, n, 3, c, settings);
 	}
 
     return c;
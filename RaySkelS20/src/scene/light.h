@@ -1,22 +1,39 @@
 #ifndef __LIGHT_H__
 #define __LIGHT_H__
 
+#include <cstdint>
+
 #include "scene.h"
 
+struct RenderSettings;
+
 class Light
 	: public SceneElement
 {
 public:
-	virtual vec3f shadowAttenuation(const vec3f& P) const = 0;
-	virtual double distanceAttenuation( const vec3f& P ) const = 0;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time, const RenderSettings& settings) const = 0;
+	virtual double distanceAttenuation( const vec3f& P, const RenderSettings& settings ) const = 0;
 	virtual vec3f getColor( const vec3f& P ) const = 0;
 	virtual vec3f getDirection( const vec3f& P ) const = 0;
 
+	// This light's own soft shadow budget: extra shadow rays per point, and
+	// how many of them to cast first.  Negative values leave the settings'.
+	void setShadowBudget( int samples, int probes )
+		{ shadowSamples = samples; shadowProbes = probes; }
+
 protected:
 	Light( Scene *scene, const vec3f& col )
-		: SceneElement( scene ), color( col ) {}
+		: SceneElement( scene ), color( col ), shadowSamples( -1 ), shadowProbes( -1 ) {}
+
+	// Only what lies less than reach from P, the distance to the light,
+	// is in the way; a directional light's reach is infinite.
+	vec3f softAttenuation( const vec3f& P, double time, const vec3f& d, double reach, double radius,
+		int samples, uint32_t salt, const vec3f& sharp, const RenderSettings& settings ) const;
+	vec3f attenuationAlong( const vec3f& P, double time, const vec3f& d, double reach ) const;
 
 	vec3f 		color;
+	int			shadowSamples;
+	int			shadowProbes;
 };
 
 class DirectionalLight
@@ -25,8 +42,8 @@ class DirectionalLight
 public:
 	DirectionalLight( Scene *scene, const vec3f& orien, const vec3f& color )
 		: Light( scene, color ), orientation( orien ) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
-	virtual double distanceAttenuation( const vec3f& P ) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time, const RenderSettings& settings) const;
+	virtual double distanceAttenuation( const vec3f& P, const RenderSettings& settings ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
 
@@ -40,8 +57,8 @@ class PointLight
 public:
 	PointLight( Scene *scene, const vec3f& pos, const vec3f& color )
 		: Light( scene, color ), position( pos ) {}
-	virtual vec3f shadowAttenuation(const vec3f& P) const;
-	virtual double distanceAttenuation( const vec3f& P ) const;
+	virtual vec3f shadowAttenuation(const vec3f& P, double time, const RenderSettings& settings) const;
+	virtual double distanceAttenuation( const vec3f& P, const RenderSettings& settings ) const;
 	virtual vec3f getColor( const vec3f& P ) const;
 	virtual vec3f getDirection( const vec3f& P ) const;
 
@@ -4,7 +4,7 @@
 
 // Apply the phong model to this point on the surface of the object, returning
 // the color of that point.
-vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
+vec3f Material::shade( Scene *scene, const ray& r, const isect& i, const RenderSettings& settings ) const
 {
 	// YOUR CODE HERE
 
@@ -42,11 +42,46 @@ vec3f Material::shade( Scene *scene, const ray& r, const isect& i ) const
 		R.normalize();
 		vec3f specular = std::pow(std::max(0.0, R * V), shininess*128) * ks;
 
-		vec3f shadow = light->shadowAttenuation(P);
-		double distance = light->distanceAttenuation(P);
+		vec3f shadow = light->shadowAttenuation(P, r.getTime(), settings);
+		double distance = light->distanceAttenuation(P, settings);
 
 		I = I + prod(prod(diffuse + specular, lightColor) * distance, shadow);
 	}
 
 	return I;
 }
+
+MaterialTable::Index MaterialTable::add( const Material& m )
+{
+    std::map<Material, Index, Less>::const_iterator i = lookup.find( m );
+    if( i != lookup.end() ) {
+        ++shared;
+        return i->second;
+    }
+
+    Index index = (Index)table.size();
+    table.push_back( m );
+    lookup.insert( std::make_pair( m, index ) );
+
+    // the table, and a map node (four pointers or so) per entry
+    charge.set( table.capacity() * sizeof( Material )
+        + lookup.size() * ( sizeof( Material ) + sizeof( Index ) + 4 * sizeof( void* ) ) );
+    return index;
+}
+
+// Any strict order on every field will do; it only has to make equal
+// materials compare equal.
+bool MaterialTable::Less::operator()( const Material& a, const Material& b ) const
+{
+    const vec3f *va[] = { &a.ke, &a.ka, &a.ks, &a.kd, &a.kr, &a.kt };
+    const vec3f *vb[] = { &b.ke, &b.ka, &b.ks, &b.kd, &b.kr, &b.kt };
+
+    for( int k = 0; k < 6; ++k )
+        for( int c = 0; c < 3; ++c )
+            if( (*va[k])[c] != (*vb[k])[c] )
+                return (*va[k])[c] < (*vb[k])[c];
+
+    if( a.shininess != b.shininess )
+        return a.shininess < b.shininess;
+    return a.index < b.index;
+}
@@ -7,11 +7,16 @@
 #ifndef __MATERIAL_H__
 #define __MATERIAL_H__
 
+#include <vector>
+#include <map>
+
 #include "../vecmath/vecmath.h"
+#include "../render/MemoryStats.h"
 
 class Scene;
 class ray;
 class isect;
+struct RenderSettings;
 
 class Material
 {
@@ -30,7 +35,7 @@ public:
               const vec3f& d, const vec3f& r, const vec3f& t, double sh, double in)
         : ke( e ), ka( a ), ks( s ), kd( d ), kr( r ), kt( t ), shininess( sh ), index( in ) {}
 
-	virtual vec3f shade( Scene *scene, const ray& r, const isect& i ) const;
+	virtual vec3f shade( Scene *scene, const ray& r, const isect& i, const RenderSettings& settings ) const;
 
     static Material worldMaterial() {
         return Material(vec3f(0,0,0), 
@@ -91,4 +96,37 @@ operator*( double d, Material m )
 }
 // extern Material THE_DEFAULT_MATERIAL;
 
+// All the distinct materials of a scene, stored contiguously.  Objects
+// refer to their material by index into the table, and identical
+// materials, however many times they are written out in the scene file,
+// share one entry.
+class MaterialTable
+{
+public:
+    typedef unsigned int Index;
+
+    MaterialTable()
+        : charge( MEM_MATERIALS ) {}
+
+    // Index of a material equal to m, adding it if there isn't one yet.
+    Index add( const Material& m );
+
+    const Material& operator[]( Index i ) const { return table[i]; }
+    int size() const { return (int)table.size(); }
+
+    // how many add() calls found an existing entry
+    int numShared() const { return shared; }
+
+private:
+    struct Less
+    {
+        bool operator()( const Material& a, const Material& b ) const;
+    };
+
+    std::vector<Material> table;
+    std::map<Material, Index, Less> lookup;
+    int shared = 0;
+    MemoryCharge charge;
+};
+
 #endif // __MATERIAL_H__
@@ -5,5 +5,13 @@
 const Material &
 isect::getMaterial() const
 {
-    return material ? *material : obj->getMaterial();
+    if( !obj->hasInterpolatedMaterial() )
+        return obj->getMaterial();
+
+    if( !materialReady )
+    {
+        obj->interpolateMaterial( *this, material );
+        materialReady = true;
+    }
+    return material;
 }
@@ -13,68 +13,87 @@
 class SceneObject;
 
 // A ray has a position where the ray starts, and a direction (which should
-// always be normalized!)
+// always be normalized!)  It also has the time, from 0 to 1 over the
+// shutter interval, at which it sees the scene; rays spawned from a hit
+// keep the time of the ray that made it.
 
 class ray {
 public:
-	ray( const vec3f& pp, const vec3f& dd )
-		: p( pp ), d( dd ) {}
+	ray( const vec3f& pp, const vec3f& dd, double tt = 0.0 )
+		: p( pp ), d( dd ), time( tt ) {}
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ) {}
+		: p( other.p ), d( other.d ), time( other.time ) {}
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{ p = other.p; d = other.d; time = other.time; return *this; }
 
 	vec3f at( double t ) const
 	{ return p + (t*d); }
 
 	vec3f getPosition() const { return p; }
 	vec3f getDirection() const { return d; }
+	double getTime() const { return time; }
 
 protected:
 	vec3f p;
 	vec3f d;
+	double time;
 };
 
-// The description of an intersection point.
+// A ray made ready for slab tests against boxes: the reciprocal of each
+// direction component, and through which side of each slab the ray
+// enters, are worked out once instead of for every box.  A zero component
+// gives an infinite reciprocal; the slab tests are written to cope with
+// that and with the NaN it makes when the ray lies in a slab's plane.
+class BoxRay
+{
+public:
+	BoxRay( const ray& r )
+	{
+		vec3f pp = r.getPosition();
+		vec3f dd = r.getDirection();
+		for( int a = 0; a < 3; ++a ) {
+			org[a] = pp[a];
+			inv[a] = 1.0 / dd[a];
+			sign[a] = inv[a] < 0;		// a -0 component gives -inf here
+		}
+	}
+
+	double org[3];
+	double inv[3];
+	int sign[3];		// 1 where the ray runs toward -axis, entering by max
+};
+
+// The description of an intersection point.  It holds no heap storage, so
+// the trace loop can make and copy as many as it likes.
 
 class isect
 {
 public:
     isect()
-        : obj( NULL ), t( 0.0 ), N(), material(0) {}
+        : obj( NULL ), t( 0.0 ), N(), bary(), prim( 0 ), materialReady( false ) {}
+
+    isect( const isect& other )
+        : obj( other.obj ), t( other.t ), N( other.N ), bary( other.bary ),
+          prim( other.prim ), materialReady( false ) {}
 
-    ~isect()
-    {
-        delete material;
-    }
-    
     void setObject( SceneObject *o ) { obj = o; }
     void setT( double tt ) { t = tt; }
     void setN( const vec3f& n ) { N = n; }
-    void setMaterial( Material *m ) { delete material; material = m; }
-        
+    void setBary( const vec3f& b ) { bary = b; }
+    void setPrim( int p ) { prim = p; }
+
+    // Copies the hit, but not any interpolated material, which is rebuilt
+    // from obj and bary if it is asked for.
     isect& operator =( const isect& other )
     {
-        if( this != &other )
-        {
-            obj = other.obj;
-            t = other.t;
-            N = other.N;
-//            material = other.material ? new Material( *(other.material) ) : 0;
-			if( other.material )
-            {
-                if( material )
-                    *material = *other.material;
-                else
-                    material = new Material(*other.material );
-            }
-            else
-            {
-                material = 0;
-            }
-        }
+        obj = other.obj;
+        t = other.t;
+        N = other.N;
+        bary = other.bary;
+        prim = other.prim;
+        materialReady = false;
         return *this;
     }
 
@@ -82,15 +101,40 @@ public:
     const SceneObject 	*obj;
     double t;
     vec3f N;
-    Material *material;         // if this intersection has its own material
-                                // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+    vec3f bary;                 // barycentric coordinates, for objects that
+                                // interpolate over a triangle
+    int prim;                   // which triangle of a mesh was hit
 
+    // The object's material, or for objects whose material varies over the
+    // surface, the one at this point.  That is interpolated on first use,
+    // so only hits that actually get shaded pay for it.
     const Material &getMaterial() const;
     // Other info here.
+
+private:
+    mutable Material material;
+    mutable bool materialReady;
 };
 
 const double RAY_EPSILON = 0.00001;
 const double NORMAL_EPSILON = 0.00001;
 
+// How far a ray spawned at P has to start from the surface to be sure of
+// missing it.  The error in a hit point grows with its distance from the
+// origin, the more so for geometry stored in single precision, so a fixed
+// RAY_EPSILON is too much near the origin and too little far out.
+inline double selfIntersectEpsilon( const vec3f& P )
+{
+	double m = maximum( maximum( fabs( P[0] ), fabs( P[1] ) ), fabs( P[2] ) );
+	return RAY_EPSILON * maximum( 1.0, m );
+}
+
+// Where to start a ray leaving the surface at P (with normal N) in
+// direction d: nudged off the surface, to whichever side d is heading.
+inline vec3f offsetRayOrigin( const vec3f& P, const vec3f& N, const vec3f& d )
+{
+	double e = selfIntersectEpsilon( P );
+	return P + ( N * d > 0 ? e : -e ) * N;
+}
+
 #endif // __RAY_H__
@@ -2,14 +2,6 @@
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
-extern TraceUI* traceUI;
-
-void BoundingBox::operator=(const BoundingBox& target)
-{
-	min = target.min;
-	max = target.max;
-}
 
 // Does this bounding box intersect the target?
 bool BoundingBox::intersects(const BoundingBox &target) const
@@ -32,50 +24,178 @@ bool BoundingBox::intersects(const vec3f& point) const
 // Using Kay/Kajiya algorithm.
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
-	vec3f R0 = r.getPosition();
-	vec3f Rd = r.getDirection();
+	return intersect( BoxRay( r ), tMin, tMax );
+}
+
+// The same slab test, with the ray's reciprocal direction and signs
+// worked out beforehand.  The near and far planes are picked by sign, so
+// no per-axis swap is needed.  A slab that the ray runs parallel to gives
+// t = -inf/+inf if the ray is inside it, and +inf/-inf (a miss) if not;
+// a ray lying in one of its planes gives NaN, which the comparisons are
+// ordered to ignore, so the slab is taken as passed.
+bool BoundingBox::intersect(const BoxRay& r, double& tMin, double& tMax) const
+{
+	const vec3f *planes[2] = { &min, &max };
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
-	
+
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 )
-			continue;
-
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
+		int s = r.sign[currentaxis];
+		double t1 = ((*planes[s])[currentaxis] - r.org[currentaxis]) * r.inv[currentaxis];
+		double t2 = ((*planes[1-s])[currentaxis] - r.org[currentaxis]) * r.inv[currentaxis];
+
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
+	}
+
+	// box is missed, or is behind the ray
+	return tMin <= tMax && tMax >= 0.0;
+}
+
+void BoundingBox::addMargin()
+{
+	double e = RAY_EPSILON * maximum( 1.0, maximum(
+		maximum( maximum( fabs( min[0] ), fabs( min[1] ) ), fabs( min[2] ) ),
+		maximum( maximum( fabs( max[0] ), fabs( max[1] ) ), fabs( max[2] ) ) ) );
+	min -= vec3f( e, e, e );
+	max += vec3f( e, e, e );
+}
+
+BoxPacket::BoxPacket()
+{
+	for( int a = 0; a < 3; ++a ) {
+		for( int k = 0; k < SIZE; ++k ) {
+			bounds[0][a][k] = 1.0e308;
+			bounds[1][a][k] = -1.0e308;
 		}
+	}
+}
 
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
+void BoxPacket::set( int k, const BoundingBox& b )
+{
+	for( int a = 0; a < 3; ++a ) {
+		bounds[0][a][k] = b.min[a];
+		bounds[1][a][k] = b.max[a];
+	}
+}
 
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < 0.0) // box is behind ray
-			return false;
+// tMin and tMax are taken as max( t, tMin ) and min( t, tMax ) in that
+// operand order, which the SSE/AVX max and min instructions resolve to
+// the second operand when t is NaN, just as the scalar comparisons do.
+int BoxPacket::intersect( const BoxRay& r, double tMax, double *tNear ) const
+{
+#if defined(RAY_SIMD_AVX2)
+	__m256d lo = _mm256_setzero_pd();
+	__m256d hi = _mm256_set1_pd( tMax );
+	for( int a = 0; a < 3; ++a ) {
+		__m256d o = _mm256_set1_pd( r.org[a] );
+		__m256d inv = _mm256_set1_pd( r.inv[a] );
+		__m256d t1 = _mm256_mul_pd( _mm256_sub_pd( _mm256_loadu_pd( bounds[r.sign[a]][a] ), o ), inv );
+		__m256d t2 = _mm256_mul_pd( _mm256_sub_pd( _mm256_loadu_pd( bounds[1-r.sign[a]][a] ), o ), inv );
+		lo = _mm256_max_pd( t1, lo );
+		hi = _mm256_min_pd( t2, hi );
+	}
+	if( tNear )
+		_mm256_storeu_pd( tNear, lo );
+	return _mm256_movemask_pd( _mm256_cmp_pd( lo, hi, _CMP_LE_OQ ) );
+#elif defined(RAY_SIMD_SSE2)
+	int hits = 0;
+	for( int h = 0; h < SIZE; h += 2 ) {
+		__m128d lo = _mm_setzero_pd();
+		__m128d hi = _mm_set1_pd( tMax );
+		for( int a = 0; a < 3; ++a ) {
+			__m128d o = _mm_set1_pd( r.org[a] );
+			__m128d inv = _mm_set1_pd( r.inv[a] );
+			__m128d t1 = _mm_mul_pd( _mm_sub_pd( _mm_loadu_pd( bounds[r.sign[a]][a] + h ), o ), inv );
+			__m128d t2 = _mm_mul_pd( _mm_sub_pd( _mm_loadu_pd( bounds[1-r.sign[a]][a] + h ), o ), inv );
+			lo = _mm_max_pd( t1, lo );
+			hi = _mm_min_pd( t2, hi );
+		}
+		if( tNear )
+			_mm_storeu_pd( tNear + h, lo );
+		hits |= _mm_movemask_pd( _mm_cmple_pd( lo, hi ) ) << h;
 	}
-	return true; // it made it past all 3 axes.
+	return hits;
+#else
+	int hits = 0;
+	for( int k = 0; k < SIZE; ++k ) {
+		double lo = 0.0, hi = tMax;
+		for( int a = 0; a < 3; ++a ) {
+			double t1 = ( bounds[r.sign[a]][a][k] - r.org[a] ) * r.inv[a];
+			double t2 = ( bounds[1-r.sign[a]][a][k] - r.org[a] ) * r.inv[a];
+			lo = t1 > lo ? t1 : lo;
+			hi = t2 < hi ? t2 : hi;
+		}
+		if( tNear )
+			tNear[k] = lo;
+		hits |= ( lo <= hi ) << k;
+	}
+	return hits;
+#endif
 }
 
+// The box around b put through m: around its eight corners, that is.
+static BoundingBox transformBox( const BoundingBox& b, const mat4f& m )
+{
+	BoundingBox box;
+	for( int k = 0; k < 8; ++k ) {
+		vec3f c( ( k & 1 ? b.max : b.min )[0],
+		         ( k & 2 ? b.max : b.min )[1],
+		         ( k & 4 ? b.max : b.min )[2] );
+		vec3f p = m * c;
+		box.min = k ? minimum( box.min, p ) : p;
+		box.max = k ? maximum( box.max, p ) : p;
+	}
+	return box;
+}
+
+// For a moving node, the corners are followed from time 0 to 1 in steps
+// of at most a quarter turn.  Over one step a corner strays from the
+// straight line between where it starts and ends by less than half that
+// line's length, so growing the box by half the longest step covers the
+// paths in between.
+BoundingBox TransformNode::sweep( const BoundingBox& b, const mat4f& pre ) const
+{
+	if( !moving )
+		return transformBox( b, xform * pre );
+
+	int steps = std::max( 16, int( ceil( totalSpin / ( 3.14159265358979 / 2 ) ) ) );
+	vec3f prev[8];
+	BoundingBox box;
+	double stride = 0.0;
+
+	for( int s = 0; s <= steps; ++s ) {
+		mat4f m = localToGlobalAt( double( s ) / steps ) * pre;
+		for( int k = 0; k < 8; ++k ) {
+			vec3f c( ( k & 1 ? b.max : b.min )[0],
+			         ( k & 2 ? b.max : b.min )[1],
+			         ( k & 4 ? b.max : b.min )[2] );
+			vec3f p = m * c;
+			if( s == 0 && k == 0 ) {
+				box.min = box.max = p;
+			} else {
+				box.min = minimum( box.min, p );
+				box.max = maximum( box.max, p );
+			}
+			if( s > 0 )
+				stride = maximum( stride, ( p - prev[k] ).length() );
+			prev[k] = p;
+		}
+	}
+
+	double e = stride / 2;
+	box.min -= vec3f( e, e, e );
+	box.max += vec3f( e, e, e );
+	return box;
+}
 
 bool Geometry::intersect(const ray&r, isect&i) const
 {
+    if (transform->isMoving())
+        return intersectMoving(r, i);
+
     // Transform the ray into the object's local coordinate space
     vec3f pos = transform->globalToLocalCoords(r.getPosition());
     vec3f dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
@@ -96,6 +216,32 @@ bool Geometry::intersect(const ray&r, isect&i) const
     
 }
 
+// The same, for an object whose transform changes over the shutter
+// interval, with the transform at the ray's time instead of the cached
+// one.  Objects that keep their geometry already transformed pass pre to
+// undo that.
+bool Geometry::intersectMoving(const ray& r, isect& i, const mat4f& pre) const
+{
+    mat4f xform = transform->localToGlobalAt(r.getTime()) * pre;
+    mat4f inverse = xform.inverse();
+
+    vec3f pos = inverse * r.getPosition();
+    vec3f dir = inverse * (r.getPosition() + r.getDirection()) - pos;
+    double length = dir.length();
+    dir /= length;
+
+    ray localRay( pos, dir, r.getTime() );
+
+    if (intersectLocal(localRay, i)) {
+        i.N = (xform.upper33().inverse().transpose() * i.N).normalize();
+        i.t /= length;
+
+        return true;
+    } else {
+        return false;
+    }
+}
+
 bool Geometry::intersectLocal( const ray& r, isect& i ) const
 {
 	return false;
@@ -122,18 +268,12 @@ Scene::~Scene()
     giter g;
     liter l;
     
+	// boundedobjects and nonboundedobjects only split up the entries of
+	// objects, so deleting objects frees everything exactly once.
 	for( g = objects.begin(); g != objects.end(); ++g ) {
 		delete (*g);
 	}
 
-	for( g = boundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
-	for( g = nonboundedobjects.begin(); g != boundedobjects.end(); ++g ) {
-		delete (*g);
-	}
-
 	for( l = lights.begin(); l != lights.end(); ++l ) {
 		delete (*l);
 	}
@@ -159,12 +299,19 @@ bool Scene::intersect( const ray& r, isect& i ) const
 		}
 	}
 
-	// try the bounded objects
-	for( j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
-		if( (*j)->intersect( r, cur ) ) {
-			if( !have_one || (cur.t < i.t) ) {
-				i = cur;
-				have_one = true;
+	// try the bounded objects whose boxes the ray passes through before
+	// the nearest hit so far
+	BoxRay br( r );
+	for( size_t p = 0; p < boxPackets.size(); ++p ) {
+		int hits = boxPackets[p].intersect( br, have_one ? i.t : 1.0e308 );
+		for( int k = 0; hits; ++k, hits >>= 1 ) {
+			if( !( hits & 1 ) )
+				continue;
+			if( packedObjects[p * BoxPacket::SIZE + k]->intersect( r, cur ) ) {
+				if( !have_one || (cur.t < i.t) ) {
+					i = cur;
+					have_one = true;
+				}
 			}
 		}
 	}
@@ -179,8 +326,11 @@ void Scene::initScene()
 	BoundingBox b;
 	
 	typedef list<Geometry*>::const_iterator iter;
+	motion = camera.isMoving();
 	// split the objects into two categories: bounded and non-bounded
 	for( iter j = objects.begin(); j != objects.end(); ++j ) {
+		if( (*j)->isMoving() )
+			motion = true;
 		if( (*j)->hasBoundingBoxCapability() )
 		{
 			boundedobjects.push_back(*j);
@@ -200,4 +350,20 @@ void Scene::initScene()
 		else
 			nonboundedobjects.push_back(*j);
 	}
+
+	boxPackets.clear();
+	packedObjects.clear();
+	for( iter j = boundedobjects.begin(); j != boundedobjects.end(); ++j ) {
+		if( packedObjects.size() % BoxPacket::SIZE == 0 )
+			boxPackets.push_back( BoxPacket() );
+
+		b = (*j)->getBoundingBox();
+		b.addMargin();
+		boxPackets.back().set( packedObjects.size() % BoxPacket::SIZE, b );
+		packedObjects.push_back( *j );
+	}
+
+	boundsMemory.set( ( boundedobjects.size() + nonboundedobjects.size() ) * LIST_NODE_BYTES
+		+ boxPackets.capacity() * sizeof( BoxPacket )
+		+ packedObjects.capacity() * sizeof( Geometry* ) );
 }
@@ -8,6 +8,7 @@
 #define __SCENE_H__
 
 #include <list>
+#include <vector>
 #include <algorithm>
 
 using namespace std;
@@ -16,6 +17,7 @@ using namespace std;
 #include "material.h"
 #include "camera.h"
 #include "../vecmath/vecmath.h"
+#include "../render/MemoryStats.h"
 
 class Light;
 class Scene;
@@ -40,8 +42,6 @@ public:
 	vec3f min;
 	vec3f max;
 
-	void operator=(const BoundingBox& target);
-
 	// Does this bounding box intersect the target?
 	bool intersects(const BoundingBox &target) const;
 	
@@ -52,6 +52,35 @@ public:
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
+	bool intersect(const BoxRay& r, double& tMin, double& tMax) const;
+
+	// Grows the box a little, relative to how far it is from the origin,
+	// so that hits computed with some rounding error, or against geometry
+	// stored in single precision, aren't culled when they graze its edge.
+	void addMargin();
+};
+
+// Four bounding boxes stored a coordinate at a time, so that one slab
+// test checks all of them at once (see vecsimd.h for the backends).
+class BoxPacket
+{
+public:
+	enum { SIZE = 4 };
+
+	// All four boxes start out empty, and no ray hits an empty box.
+	BoxPacket();
+
+	void set( int k, const BoundingBox& b );
+
+	// Bit k of the result is set if r passes through box k somewhere
+	// between t = 0 and tMax.  If tNear is given, it gets where r enters
+	// each box, for visiting the nearer ones first.
+	int intersect( const BoxRay& r, double tMax, double *tNear = NULL ) const;
+
+private:
+	// Packets live in a vector, whose storage is only as aligned as the
+	// heap, so the backends load these unaligned.
+	double bounds[2][3][SIZE];	// [min, max][axis][box]
 };
 
 class TransformNode
@@ -63,6 +92,17 @@ protected:
 	mat4f    inverse;
 	mat3f    normi;
 
+    // This node's own part of xform, and the motion it adds to that over
+    // the shutter interval: at time t, a turn of t * spinAngle about
+    // spinAxis and then a move of t * shift.  xform, inverse and normi are
+    // for time 0, when there is no motion yet.
+    mat4f    local;
+    vec3f    shift;
+    vec3f    spinAxis;
+    double   spinAngle;
+    double   totalSpin;     // |spinAngle| summed over this node and those above
+    bool     moving;        // this node or one above it has motion
+
     // information about parent & children
     TransformNode *parent;
     list<TransformNode*> children;
@@ -75,6 +115,7 @@ public:
     {
         for(child_iter c = children.begin(); c != children.end(); ++c )
             delete (*c);
+        MemoryStats::add( MEM_TRANSFORMS, -(long long)sizeof( TransformNode ) );
     }
 
     TransformNode *createChild(const mat4f& xform)
@@ -83,6 +124,37 @@ public:
         children.push_back(child);
         return child;
     }
+
+    // A child that starts where this node puts it and, over the shutter
+    // interval, turns by angle (in radians) about axis and moves by offset.
+    TransformNode *createMotionChild(const vec3f& offset, const vec3f& axis, double angle)
+    {
+        TransformNode *child = createChild(mat4f());
+        child->shift = offset;
+        child->spinAxis = axis;
+        child->spinAngle = angle;
+        child->totalSpin += fabs(angle);
+        child->moving = true;
+        return child;
+    }
+
+    bool isMoving() const { return moving; }
+
+    // The whole transform at time t.
+    mat4f localToGlobalAt(double t) const
+    {
+        if (!moving)
+            return xform;
+
+        mat4f m = local * mat4f::translate(shift * t);
+        if (spinAngle != 0.0)
+            m = m * mat4f::rotate(spinAxis, spinAngle * t);
+        return parent ? parent->localToGlobalAt(t) * m : m;
+    }
+
+    // A box in global coordinates around all that the local box b passes
+    // through over the shutter interval, b first put through pre.
+    BoundingBox sweep(const BoundingBox& b, const mat4f& pre = mat4f()) const;
     
     // Coordinate-Space transformation
     vec3f globalToLocalCoords(const vec3f &v)
@@ -105,12 +177,25 @@ public:
         return (normi * v).normalize();
     }
 
+    // The whole transform, for objects that bake it into their geometry.
+    const mat4f& localToGlobal() const
+    {
+        return xform;
+    }
+
+    const mat4f& globalToLocal() const
+    {
+        return inverse;
+    }
+
 protected:
     // protected so that users can't directly construct one of these...
     // force them to use the createChild() method.  Note that they CAN
     // directly create a TransformRoot object.
     TransformNode(TransformNode *parent, const mat4f& xform )
-        : children()
+        : local( xform ), shift(), spinAxis(), spinAngle( 0.0 ),
+          totalSpin( parent ? parent->totalSpin : 0.0 ),
+          moving( parent && parent->moving ), children()
     {
         this->parent = parent;
         if (parent == NULL)
@@ -120,6 +205,8 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+
+        MemoryStats::add( MEM_TRANSFORMS, sizeof( TransformNode ) );
     }
 };
 
@@ -150,54 +237,29 @@ public:
 	virtual void ComputeBoundingBox()
     {
         // take the object's local bounding box, transform all 8 points on it,
-        // and use those to find a new bounding box.
-
-        BoundingBox localBounds = ComputeLocalBoundingBox();
-        
-        vec3f min = localBounds.min;
-		vec3f max = localBounds.max;
-
-		vec4f v, newMax, newMin;
-
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], min[2], 1) );
-		newMax = v;
-		newMin = v;
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(min[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( vec4f(max[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		
-		bounds.max = vec3f(newMax);
-		bounds.min = vec3f(newMin);
+        // and use those to find a new bounding box -- over the whole shutter
+        // interval, if the object moves.
+        bounds = transform->sweep( ComputeLocalBoundingBox() );
     }
 
     // default method for ComputeLocalBoundingBox returns a bogus bounding box;
     // this should be overridden if hasBoundingBoxCapability() is true.
-    virtual BoundingBox ComputeLocalBoundingBox() { return BoundingBox(); }
+    virtual BoundingBox ComputeLocalBoundingBox() const { return BoundingBox(); }
 
     void setTransform(TransformNode *transform) { this->transform = transform; };
+    bool isMoving() const { return transform && transform->isMoving(); }
+
+    // Roughly how much memory the object holds, for MemoryStats.  The
+    // fixed-size primitives are all about the size of a Geometry; objects
+    // with arrays of their own add those in.
+    virtual size_t memoryBytes() const { return sizeof( Geometry ); }
     
 	Geometry( Scene *scene ) 
-		: SceneElement( scene ) {}
+		: SceneElement( scene ), transform( NULL ) {}
 
 protected:
+    bool intersectMoving(const ray& r, isect& i, const mat4f& pre = mat4f()) const;
+
 	BoundingBox bounds;
     TransformNode *transform;
 };
@@ -211,31 +273,37 @@ class SceneObject
 {
 public:
 	virtual const Material& getMaterial() const = 0;
-	virtual void setMaterial( Material *m ) = 0;
+	virtual void setMaterial( MaterialTable::Index m ) = 0;
+
+	// Objects whose material varies over the surface override these.
+	// interpolateMaterial() fills in m for the point hit by i, and is only
+	// called for hits whose material is actually needed.
+	virtual bool hasInterpolatedMaterial() const { return false; }
+	virtual void interpolateMaterial( const isect& /*i*/, Material& /*m*/ ) const {}
+
+	// Identifies the solid this is the surface of, for telling when a ray
+	// enters or leaves it.  Pieces of one closed surface return the same id.
+	virtual const void *getMedium() const { return this; }
 
 protected:
 	SceneObject( Scene *scene )
 		: Geometry( scene ) {}
 };
 
-// A simple extension of SceneObject that adds an instance of Material
-// for simple material bindings.
+// A simple extension of SceneObject that adds a reference to one of the
+// scene's materials for simple material bindings.
 class MaterialSceneObject
 	: public SceneObject
 {
 public:
-	virtual ~MaterialSceneObject() { if( material ) delete material; }
-
-	virtual const Material& getMaterial() const { return *material; }
-	virtual void setMaterial( Material *m )	{ material = m; }
+	virtual const Material& getMaterial() const;
+	virtual void setMaterial( MaterialTable::Index m )	{ material = m; }
 
 protected:
-	MaterialSceneObject( Scene *scene, Material *mat ) 
+	MaterialSceneObject( Scene *scene, MaterialTable::Index mat ) 
 		: SceneObject( scene ), material( mat ) {}
-    //	MaterialSceneObject( Scene *scene ) 
-	//	: SceneObject( scene ), material( new Material ) {}
 
-	Material *material;
+	MaterialTable::Index material;
 };
 
 class Scene
@@ -252,15 +320,19 @@ public:
 	double distA = 0, distB = 0, distC = 0;
 	vec3f ambientLight = vec3f(0.1, 0.1, 0.1);
 
+	MaterialTable materials;
+
 public:
 	Scene() 
-		: transformRoot(), objects(), lights() {}
+		: transformRoot(), objects(), lights(), motion( false ),
+		  objectMemory( MEM_SCENE_OBJECTS ), boundsMemory( MEM_ACCELERATION ) {}
 	virtual ~Scene();
 
 	void add( Geometry* obj )
 	{
 		obj->ComputeBoundingBox();
 		objects.push_back( obj );
+		objectMemory.add( obj->memoryBytes() + LIST_NODE_BYTES );
 	}
 	void add( Light* light )
 	{ lights.push_back( light ); }
@@ -268,6 +340,10 @@ public:
 	bool intersect( const ray& r, isect& i ) const;
 	void initScene();
 
+	// Whether anything -- an object or the camera -- moves over the
+	// shutter interval, as worked out by initScene().
+	bool hasMotion() const { return motion; }
+
 	list<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	list<Light*>::const_iterator endLights() const { return lights.end(); }
         
@@ -286,6 +362,25 @@ private:
 	// must fall within this bounding box.  Objects that don't have hasBoundingBoxCapability()
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
+
+	bool motion;
+
+	// The boxes of boundedobjects, in packets, and the objects they go
+	// with, so that Scene::intersect only tries objects the ray can hit.
+	vector<BoxPacket> boxPackets;
+	vector<Geometry*> packedObjects;
+
+	// a list<Geometry*> node: the pointer and the links
+	static const size_t LIST_NODE_BYTES = 3 * sizeof( void* );
+
+	MemoryCharge objectMemory;
+	MemoryCharge boundsMemory;	// the bounded/nonbounded split and the
+								// box packets
 };
 
+inline const Material& MaterialSceneObject::getMaterial() const
+{
+	return scene->materials[ material ];
+}
+
 #endif // __SCENE_H__
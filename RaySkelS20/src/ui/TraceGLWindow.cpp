@@ -7,6 +7,8 @@
 
 #include "../fileio/bitmap.h"
 
+#include <FL/fl_ask.h>
+
 TraceGLWindow::TraceGLWindow(int x, int y, int w, int h, const char *l)
 			: Fl_Gl_Window(x,y,w,h,l)
 {
@@ -69,8 +71,8 @@ void TraceGLWindow::saveImage(char *iname)
 	unsigned char* buf;
 
 	raytracer->getBuffer(buf, m_nDrawWidth, m_nDrawHeight);
-	if (buf)
-		writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf); 
+	if (buf && !writeBMP(iname, m_nDrawWidth, m_nDrawHeight, buf))
+		fl_alert( "Couldn't write %s", iname );
 }
 
 void TraceGLWindow::setRayTracer(RayTracer *tracer)
@@ -28,17 +28,49 @@ void TraceUI::cb_load_scene(Fl_Menu_* o, void* v)
 	char* newfile = fl_file_chooser("Open Scene?", "*.ray", NULL );
 
 	if (newfile != NULL) {
+		if (!pUI->m_loader.start(newfile)) {
+			fl_alert("Still loading %s", pUI->m_loader.filename().c_str());
+			return;
+		}
+
+		// the file is read on the loader's thread; cb_load_progress
+		// watches it from here on
 		char buf[256];
+		sprintf(buf, "Ray <Loading %s>", newfile);
+		pUI->m_mainWindow->copy_label(buf);
+		Fl::add_timeout(0.1, cb_load_progress, pUI);
+	}
+}
 
-		if (pUI->raytracer->loadScene(newfile)) {
-			sprintf(buf, "Ray <%s>", newfile);
-			done=true;	// terminate the previous rendering
-		} else{
-			sprintf(buf, "Ray <Not Loaded>");
-		}
+void TraceUI::cb_load_progress(void* v)
+{
+	TraceUI* pUI=(TraceUI*)v;
+	char buf[256];
+
+	if (!pUI->m_loader.finished()) {
+		sprintf(buf, "Ray <Loading %s: %d%%>", pUI->m_loader.filename().c_str(),
+			(int)(pUI->m_loader.progress() * 100.0));
+		pUI->m_mainWindow->copy_label(buf);
+		Fl::repeat_timeout(0.1, cb_load_progress, v);
+		return;
+	}
 
-		pUI->m_mainWindow->label(buf);
+	// A render in progress is still using the old scene; stop it, and
+	// swap the new scene in once its loop has unwound.
+	if (!done) {
+		done=true;
+		Fl::repeat_timeout(0.1, cb_load_progress, v);
+		return;
+	}
+
+	Scene *scene = pUI->m_loader.takeScene();
+	if (scene && pUI->raytracer->adoptScene(scene)) {
+		sprintf(buf, "Ray <%s>", pUI->m_loader.filename().c_str());
+	} else {
+		sprintf(buf, "Ray <Not Loaded>");
 	}
+
+	pUI->m_mainWindow->copy_label(buf);
 }
 
 void TraceUI::cb_save_image(Fl_Menu_* o, void* v) 
@@ -140,7 +172,7 @@ void TraceUI::cb_render(Fl_Widget* o, void* v)
 
 		pUI->m_traceGlWindow->show();
 
-		pUI->raytracer->traceSetup(width, height);
+		pUI->raytracer->traceSetup(width, height, pUI->getSettings());
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -265,6 +297,22 @@ bool TraceUI::getMotionBlur()
 	return m_nMotionBlur;
 }
 
+RenderSettings TraceUI::getSettings()
+{
+	RenderSettings s;
+
+	s.depth = m_nDepth;
+	s.threshold = m_nThresh;
+	s.distA = m_nDistA;
+	s.distB = m_nDistB;
+	s.distC = m_nDistC;
+	s.softShadow = m_nSoftShadow != 0;
+	s.glossyReflection = m_nGlossyRefl != 0;
+	s.motionBlur = m_nMotionBlur != 0;
+
+	return s;
+}
+
 // menu definition
 Fl_Menu_Item TraceUI::menuitems[] = {
 	{ "&File",		0, 0, 0, FL_SUBMENU },
@@ -17,6 +17,8 @@
 #include <FL/fl_file_chooser.H>		// FLTK file chooser
 
 #include "TraceGLWindow.h"
+#include "../render/RenderSettings.h"
+#include "../fileio/SceneLoader.h"
 
 class TraceUI {
 public:
@@ -58,8 +60,12 @@ public:
 	bool		getGlossyRefl();
 	bool		getMotionBlur();
 
+	// snapshot of the sliders, handed to the tracer when a render starts
+	RenderSettings	getSettings();
+
 private:
 	RayTracer*	raytracer;
+	SceneLoader	m_loader;
 
 	int			m_nSize;
 	int			m_nDepth;
@@ -78,6 +84,7 @@ private:
 	static TraceUI* whoami(Fl_Menu_* o);
 
 	static void cb_load_scene(Fl_Menu_* o, void* v);
+	static void cb_load_progress(void* v);
 	static void cb_save_image(Fl_Menu_* o, void* v);
 	static void cb_exit(Fl_Menu_* o, void* v);
 	static void cb_about(Fl_Menu_* o, void* v);
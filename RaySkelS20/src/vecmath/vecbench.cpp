@@ -0,0 +1,147 @@
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <vector>
+
+#include "vecbench.h"
+#include "vecmath.h"
+
+// Enough vectors to stay in the L1 and L2 caches, so that the kernels
+// and not the memory are being timed.
+static const int COUNT = 1024;
+static const int MATRICES = 16;
+
+struct BenchData
+{
+	vector<vec3f> a, b, r;
+	vector<mat4f> m, mr;
+	double sink;
+};
+
+// Each operation over the whole of the data, with kernels K.
+template <class K>
+struct BenchOps
+{
+	static void add( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::add3( d.r[i].n, d.a[i].n, d.b[i].n );
+	}
+
+	static void scale( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::mul3( d.r[i].n, d.a[i].n, 1.5 );
+	}
+
+	static void dot( BenchData& d )
+	{
+		double s = 0;
+		for( int i = 0; i < COUNT; ++i )
+			s += K::dot3( d.a[i].n, d.b[i].n );
+		d.sink += s;
+	}
+
+	static void cross( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::cross3( d.r[i].n, d.a[i].n, d.b[i].n );
+	}
+
+	static void normalize( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::normalize3( d.r[i].n, d.a[i].n );
+	}
+
+	static void transform( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::mulPoint( d.r[i].n, d.m[i % MATRICES].v[0].n, d.a[i].n );
+	}
+
+	static void matmul( BenchData& d )
+	{
+		for( int i = 0; i < COUNT; ++i )
+			K::mulMat4( d.mr[i % MATRICES].v[0].n, d.m[i % MATRICES].v[0].n,
+				d.m[( i + 1 ) % MATRICES].v[0].n );
+	}
+};
+
+typedef void (*BenchOp)( BenchData& );
+
+// Nanoseconds per call of op's kernel, from the best of several runs.
+static double nsPerOp( BenchOp op, BenchData& d )
+{
+	typedef std::chrono::steady_clock clock;
+
+	double best = 1e30;
+	for( int run = 0; run < 5; ++run ) {
+		int reps = 0;
+		clock::time_point start = clock::now();
+		double elapsed;
+		do {
+			op( d );
+			++reps;
+			elapsed = std::chrono::duration<double, std::nano>( clock::now() - start ).count();
+		} while( elapsed < 2e7 );
+		best = minimum( best, elapsed / ( double( reps ) * COUNT ) );
+	}
+	return best;
+}
+
+static double frandom()
+{
+	return 2.0 * rand() / RAND_MAX - 1.0;
+}
+
+void benchVecmath( ostream& os )
+{
+	BenchData d;
+	d.sink = 0;
+	for( int i = 0; i < COUNT; ++i ) {
+		d.a.push_back( vec3f( frandom(), frandom(), frandom() ) );
+		d.b.push_back( vec3f( frandom(), frandom(), frandom() ) );
+	}
+	d.r.resize( COUNT );
+	for( int i = 0; i < MATRICES; ++i ) {
+		d.m.push_back( mat4f::translate( d.a[i] ) * mat4f::rotate( d.b[i], frandom() ) );
+	}
+	d.mr.resize( MATRICES );
+
+	typedef BenchOps< scalar_kernels<double> > Scalar;
+	typedef BenchOps< vec_kernels<double> > Backend;
+
+	static const struct {
+		const char *name;
+		BenchOp scalar;
+		BenchOp backend;
+	} ops[] = {
+		{ "add",		Scalar::add,		Backend::add },
+		{ "scale",		Scalar::scale,		Backend::scale },
+		{ "dot",		Scalar::dot,		Backend::dot },
+		{ "cross",		Scalar::cross,		Backend::cross },
+		{ "normalize",	Scalar::normalize,	Backend::normalize },
+		{ "mat4 * vec3",	Scalar::transform,	Backend::transform },
+		{ "mat4 * mat4",	Scalar::matmul,		Backend::matmul },
+	};
+
+	os << "vecmath kernels, " << vecBackend() << " against scalar (ns per op)" << endl;
+	os << "  " << setw( 12 ) << left << "op" << right
+		<< "  " << setw( 8 ) << "scalar"
+		<< "  " << setw( 8 ) << vecBackend()
+		<< "  " << setw( 7 ) << "speedup" << endl;
+	os << fixed << setprecision( 2 );
+	for( size_t k = 0; k < sizeof( ops ) / sizeof( ops[0] ); ++k ) {
+		double s = nsPerOp( ops[k].scalar, d );
+		double v = nsPerOp( ops[k].backend, d );
+		os << "  " << setw( 12 ) << left << ops[k].name << right
+			<< "  " << setw( 8 ) << s
+			<< "  " << setw( 8 ) << v
+			<< "  " << setw( 6 ) << s / v << "x" << endl;
+	}
+
+	// keeps the dot products from being optimized away
+	if( d.sink == 12345.678 )
+		os << d.sink << endl;
+}
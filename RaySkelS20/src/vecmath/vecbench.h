@@ -0,0 +1,18 @@
+//
+// vecbench.h
+//
+// A microbenchmark of the vecmath kernels: each operation is timed with
+// the kernels vec3f was built with and with the scalar ones, on the same
+// data, so the gain of the SIMD backend can be read off per operation.
+//
+
+#ifndef __VECBENCH_H__
+#define __VECBENCH_H__
+
+#include <iostream>
+
+using namespace std;
+
+void benchVecmath( ostream& os );
+
+#endif // __VECBENCH_H__
@@ -9,10 +9,11 @@
 
 #include "vecmath.h"
 
-mat3f mat3f::inverse() const	    // Gauss-Jordan elimination with partial pivoting
+template <class T>
+mat3<T> mat3<T>::inverse() const	    // Gauss-Jordan elimination with partial pivoting
 {
-	mat3f a(*this);				// As a evolves from original mat into identity
-	mat3f b; 					// b evolves from identity into inverse(a)
+	mat3<T> a(*this);				// As a evolves from original mat into identity
+	mat3<T> b; 					// b evolves from identity into inverse(a)
 	int	 i, j, i1;
 
 	// Loop over cols of a from left to right, eliminating above and below diag
@@ -43,10 +44,11 @@ mat3f mat3f::inverse() const	    // Gauss-Jordan elimination with partial pivoti
 	return b;
 }
 
-mat4f mat4f::inverse() const	    // Gauss-Jordan elimination with partial pivoting
+template <class T>
+mat4<T> mat4<T>::inverse() const	    // Gauss-Jordan elimination with partial pivoting
 {
-	mat4f a(*this);				// As a evolves from original mat into identity
-	mat4f b;   					// b evolves from identity into inverse(a)
+	mat4<T> a(*this);				// As a evolves from original mat into identity
+	mat4<T> b;   					// b evolves from identity into inverse(a)
 	int i, j, i1;
 
 	// Loop over cols of a from left to right, eliminating above and below diag
@@ -76,3 +78,9 @@ mat4f mat4f::inverse() const	    // Gauss-Jordan elimination with partial pivoti
 	}
 	return b;
 }
+
+// the precisions the renderer uses
+template class mat3<double>;
+template class mat4<double>;
+template class mat3<float>;
+template class mat4<float>;
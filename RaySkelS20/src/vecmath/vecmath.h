@@ -10,10 +10,32 @@
 
 using namespace std;
 
-class vec3f;
-class vec4f;
-class mat3f;
-class mat4f;
+#include "vecsimd.h"
+
+// The vectors and matrices are templated on their scalar type.  The
+// renderer does its shading and transforms in double (vec3f and friends),
+// while stored geometry that is read over and over in the intersection
+// loops can be kept in single precision (vec3g) to halve its footprint.
+// The arithmetic itself is done by the kernels in vecsimd.h.
+
+template <class T> class vec3;
+template <class T> class vec4;
+template <class T> class mat3;
+template <class T> class mat4;
+
+typedef vec3<double> vec3f;
+typedef vec4<double> vec4f;
+typedef mat3<double> mat3f;
+typedef mat4<double> mat4f;
+
+// Scalar of stored geometry.  Define RAY_DOUBLE_GEOMETRY to build with it
+// in double, e.g. to compare against the single-precision build.
+#ifdef RAY_DOUBLE_GEOMETRY
+typedef double geomreal;
+#else
+typedef float geomreal;
+#endif
+typedef vec3<geomreal> vec3g;
 
 // used as an exception during matrix inversion.
 class SingularMatrixException
@@ -29,279 +51,306 @@ inline double maximum( double a, double b )
 	return a > b ? a : b;
 }
 
-class vec3f
+inline float minimum( float a, float b )
+{
+	return a < b ? a : b;
+}
+
+inline float maximum( float a, float b )
+{
+	return a > b ? a : b;
+}
+
+template <class T>
+class vec3
 {
 public:
+	typedef T value_type;
+
 	// Constructors
 
-	vec3f() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; }
-	vec3f( const double x, const double y, const double z )
-		{ n[0] = x; n[1] = y; n[2] = z; }
-//	vec3f( const double d )
+	vec3() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; clearPad(); }
+	vec3( const T x, const T y, const T z )
+		{ n[0] = x; n[1] = y; n[2] = z; clearPad(); }
+//	vec3( const T d )
 //		{ n[0] = d; n[1] = d; n[2] = d; }
-	vec3f( const vec3f& v )
-		{ n[0] = v.n[0]; n[1] = v.n[1]; n[2] = v.n[2]; }
-	vec3f( const vec4f& v4 );
-
-	vec3f& operator	=( const vec3f& v )
-		{ n[0] = v.n[0]; n[1] = v.n[1]; n[2] = v.n[2]; return *this; }
-	vec3f& operator +=( const vec3f& v )
-		{ n[0] += v.n[0]; n[1] += v.n[1]; n[2] += v.n[2]; return *this; }
-	vec3f& operator -= ( const vec3f& v )
-		{ n[0] -= v.n[0]; n[1] -= v.n[1]; n[2] -= v.n[2]; return *this; }
-	vec3f& operator *= ( const double d )
-		{ n[0] *= d; n[1] *= d; n[2] *= d; return *this; }
-	vec3f& operator /= ( const double d )
-		{ n[0] /= d; n[1] /= d; n[2] /= d; return *this; }
-
-	double& operator []( int i )
+	vec3( const vec4<T>& v4 );
+	// Between precisions, e.g. vec3g( v ) to store a vec3f.
+	template <class U>
+	explicit vec3( const vec3<U>& v )
+		{ n[0] = T( v.n[0] ); n[1] = T( v.n[1] ); n[2] = T( v.n[2] ); clearPad(); }
+
+	// Copying and assigning copy the padding along with the rest.
+
+	vec3& operator +=( const vec3& v )
+		{ vec_kernels<T>::add3( n, n, v.n ); return *this; }
+	vec3& operator -= ( const vec3& v )
+		{ vec_kernels<T>::sub3( n, n, v.n ); return *this; }
+	vec3& operator *= ( const T d )
+		{ vec_kernels<T>::mul3( n, n, d ); return *this; }
+	vec3& operator /= ( const T d )
+		{ vec_kernels<T>::div3( n, n, d ); return *this; }
+
+	T& operator []( int i )
 		{ return n[i]; }
-	double operator []( int i ) const 
+	T operator []( int i ) const 
 		{ return n[i]; }
 
 	// Cross product between this and 'b'
-	vec3f cross(const vec3f& b) const
+	vec3 cross(const vec3& b) const
 	{
-		return vec3f(
-			n[1]*b.n[2] - n[2]*b.n[1],
-			n[2]*b.n[0] - n[0]*b.n[2],
-			n[0]*b.n[1] - n[1]*b.n[0] );
+		vec3 ret;
+		vec_kernels<T>::cross3( ret.n, n, b.n );
+		return ret;
 	}
 
 	// Clamps each component to the range 0.0 <= n <= 1.0
-	vec3f clamp() const
+	vec3 clamp() const
 	{
-		vec3f a;
+		vec3 a;
 	
-		a[0] = maximum(0.0, minimum(n[0], 1.0));
-		a[1] = maximum(0.0, minimum(n[1], 1.0));
-		a[2] = maximum(0.0, minimum(n[2], 1.0));
+		a[0] = maximum(T(0), minimum(n[0], T(1)));
+		a[1] = maximum(T(0), minimum(n[1], T(1)));
+		a[2] = maximum(T(0), minimum(n[2], T(1)));
 
 		return a;
 	}
 
 	// Dot product of this and 'b'
-	double dot(const vec3f& b) const
+	T dot(const vec3& b) const
 	{
-		return n[0]*b[0] + n[1]*b[1] + n[2]*b[2];
+		return vec_kernels<T>::dot3( n, b.n );
 	}
 
-	double length_squared() const
-		{ return n[0]*n[0] + n[1]*n[1] + n[2]*n[2]; }
-	double length() const
+	T length_squared() const
+		{ return vec_kernels<T>::dot3( n, n ); }
+	T length() const
 		{ return sqrt( length_squared() ); }
-	vec3f normalize() const
+	vec3 normalize() const
 	{ 
-		vec3f ret( *this );
-		ret /= length();
+		vec3 ret;
+		vec_kernels<T>::normalize3( ret.n, n );
 		return ret;
 	}
 
 	bool iszero() const { return ( (n[0]==0 && n[1]==0 && n[2]==0) ? true : false); };
 
+private:
+	void clearPad()
+		{ for( int i = 3; i < vec_layout<T>::vec3Lanes; ++i ) n[i] = 0; }
+
 public:
-	double n[3];
+	T n[ vec_layout<T>::vec3Lanes ];
 };
 
-class vec4f
+template <class T>
+class vec4
 {
 public:
+	typedef T value_type;
+
 	// Constructors
 
-	vec4f() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; n[3] = 0.0; }
-	vec4f( const double x, const double y, const double z, const double w )
+	vec4() { n[0] = 0.0; n[1] = 0.0; n[2] = 0.0; n[3] = 0.0; }
+	vec4( const T x, const T y, const T z, const T w )
 		{ n[0] = x; n[1] = y; n[2] = z; n[3] = w; }
-//	vec4f( const double d )
+//	vec4( const T d )
 //		{ n[0] = d; n[1] = d; n[2] = d; n[3] = d; }
-	vec4f( const vec4f& v )
+	vec4( const vec4& v )
 		{ n[0] = v.n[0]; n[1] = v.n[1]; n[2] = v.n[2]; n[3] = v.n[3]; }
-	vec4f( const vec3f& v )
+	vec4( const vec3<T>& v )
 		{ n[0] = v[0]; n[1] = v[1]; n[2] = v[2]; n[3] = 1.0; }
 
-	vec4f& operator =( const vec4f& v )
+	vec4& operator =( const vec4& v )
 		{ n[0] = v.n[0]; n[1] = v.n[1]; n[2] = v.n[2]; n[3] = v.n[3];
 		  return *this; }
-	vec4f& operator +=( const vec4f& v )
+	vec4& operator +=( const vec4& v )
 		{ n[0] += v.n[0]; n[1] += v.n[1]; n[2] += v.n[2]; n[3] += v.n[3];
 		  return *this; }
-	vec4f& operator -= ( const vec4f& v )
+	vec4& operator -= ( const vec4& v )
 		{ n[0] -= v.n[0]; n[1] -= v.n[1]; n[2] -= v.n[2]; n[3] -= v.n[3];
 		  return *this; }
-	vec4f& operator *= ( const double d )
+	vec4& operator *= ( const T d )
 		{ n[0] *= d; n[1] *= d; n[2] *= d; n[3] *= d; return *this; }
-	vec4f& operator /= ( const double d )
+	vec4& operator /= ( const T d )
 		{ n[0] /= d; n[1] /= d; n[2] /= d; n[3] /= d; return *this; }
-	double& operator []( int i )
+	T& operator []( int i )
 		{ return n[i]; }
-	double operator []( int i ) const 
+	T operator []( int i ) const 
 		{ return n[i]; }
 
 	// Dot product of this and 'b'
-	double dot(const vec4f& b) const
+	T dot(const vec4& b) const
 	{
 		return n[0]*b[0] + n[1]*b[1] + n[2]*b[2] + n[3]*b[3];
 	}
 
 	// Clamps each component to the range 0.0 <= n <= 1.0
-	vec4f clamp() const
+	vec4 clamp() const
 	{
-		vec4f a;
+		vec4 a;
 	
-		a[0] = maximum(0.0, minimum(n[0], 1.0));
-		a[1] = maximum(0.0, minimum(n[1], 1.0));
-		a[2] = maximum(0.0, minimum(n[2], 1.0));
-		a[3] = maximum(0.0, minimum(n[3], 1.0));
+		a[0] = maximum(T(0), minimum(n[0], T(1)));
+		a[1] = maximum(T(0), minimum(n[1], T(1)));
+		a[2] = maximum(T(0), minimum(n[2], T(1)));
+		a[3] = maximum(T(0), minimum(n[3], T(1)));
 
 		return a;
 	}
 
 
-	double length_squared() const
+	T length_squared() const
 		{ return n[0]*n[0] + n[1]*n[1] + n[2]*n[2] + n[3]*n[3]; }
-	double length() const
+	T length() const
 		{ return sqrt( length_squared() ); }
-	vec4f normalize() const
+	vec4 normalize() const
 		// { return *this / length(); }
 	{ 
-		vec4f ret( *this );
+		vec4 ret( *this );
 		ret /= length();
 		return ret;
 	}
 
 public:
-	double n[4];
+	T n[4];
 };
 
-class mat3f
+template <class T>
+class mat3
 {
 public:
-	mat3f()
-		{ v[0] = vec3f(); v[1] = vec3f(); v[2] = vec3f();
+	typedef T value_type;
+
+	mat3()
+		{ v[0] = vec3<T>(); v[1] = vec3<T>(); v[2] = vec3<T>();
 		  v[0][0] = 1.0; v[1][1] = 1.0; v[2][2] = 1.0; }
-	mat3f( const vec3f& v0, const vec3f& v1, const vec3f& v2 )
+	mat3( const vec3<T>& v0, const vec3<T>& v1, const vec3<T>& v2 )
 		{ v[0] = v0; v[1] = v1; v[2] = v2; }
-//	mat3f( const double d )
-//		{ v[0] = vec3f(); v[1] = vec3f(); v[2] = vec3f();
+//	mat3( const T d )
+//		{ v[0] = vec3<T>(); v[1] = vec3<T>(); v[2] = vec3<T>();
 //		  v[0][0] = d; v[1][1] = d; v[2][2] = d; }
-	mat3f( const mat3f& m )
+	mat3( const mat3& m )
 		{ v[0] = m.v[0]; v[1] = m.v[1]; v[2] = m.v[2]; }
 
-	mat3f& operator =( const mat3f& m )
+	mat3& operator =( const mat3& m )
 		{ v[0] = m.v[0]; v[1] = m.v[1]; v[2] = m.v[2]; return *this; }
-	mat3f& operator +=( const mat3f& m )
+	mat3& operator +=( const mat3& m )
 		{ v[0] += m.v[0]; v[1] += m.v[1]; v[2] += m.v[2]; return *this; }
-	mat3f& operator -=( const mat3f& m )
+	mat3& operator -=( const mat3& m )
 		{ v[0] -= m.v[0]; v[1] -= m.v[1]; v[2] -= m.v[2]; return *this; }
-	mat3f& operator *=( const double d )
+	mat3& operator *=( const T d )
 		{ v[0] *= d; v[1] *= d; v[2] *= d; return *this; }
-	mat3f& operator /=( const double d )
+	mat3& operator /=( const T d )
 		{ v[0] /= d; v[1] /= d; v[2] /= d; return *this; }
 
-	vec3f& operator []( int i )
+	vec3<T>& operator []( int i )
 		{ return v[i]; }
-	const vec3f& operator []( int i ) const
+	const vec3<T>& operator []( int i ) const
 		{ return v[i]; }
 	
-	vec3f column( int i ) const
-		{ return vec3f( v[0][i], v[1][i], v[2][i] ); }
+	vec3<T> column( int i ) const
+		{ return vec3<T>( v[0][i], v[1][i], v[2][i] ); }
 
 	// special functions
 
-	mat3f transpose() const
+	mat3 transpose() const
 	{
-		return mat3f( column( 0 ), column( 1 ), column( 2 ) );
+		return mat3( column( 0 ), column( 1 ), column( 2 ) );
 	}
 
-	mat3f inverse() const;
+	mat3 inverse() const;
 
 public:
-	vec3f v[3];
+	vec3<T> v[3];
 };
 
-class mat4f
+template <class T>
+class mat4
 {
 public:
-	mat4f()
-		{ v[0]=vec4f(); v[1]=vec4f(); v[2]=vec4f(); v[3]=vec4f();
+	typedef T value_type;
+
+	mat4()
+		{ v[0]=vec4<T>(); v[1]=vec4<T>(); v[2]=vec4<T>(); v[3]=vec4<T>();
 		  v[0][0]=1.0; v[1][1]=1.0; v[2][2]=1.0; v[3][3]=1.0; }
-	mat4f( const vec4f& v0, const vec4f& v1, const vec4f& v2, const vec4f& v3 )
+	mat4( const vec4<T>& v0, const vec4<T>& v1, const vec4<T>& v2, const vec4<T>& v3 )
 		{ v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3; }
-//	mat4f( const double d )
-//		{ v[0]=vec4f(); v[1]=vec4f(); v[2]=vec4f(); v[3]=vec4f();
+//	mat4( const T d )
+//		{ v[0]=vec4<T>(); v[1]=vec4<T>(); v[2]=vec4<T>(); v[3]=vec4<T>();
 //		  v[0][0]=d; v[1][1]=d; v[2][2]=d; v[3][3]=d; }
-	mat4f( const mat4f& m )
+	mat4( const mat4& m )
 		{ v[0] = m.v[0]; v[1] = m.v[1]; v[2] = m.v[2]; v[3] = m.v[3]; }
 
-	mat4f& operator =( const mat4f& m )
+	mat4& operator =( const mat4& m )
 		{ v[0] = m.v[0]; v[1] = m.v[1]; v[2] = m.v[2]; v[3] = m.v[3];
 		  return *this; }
-	mat4f& operator +=( const mat4f& m )
+	mat4& operator +=( const mat4& m )
 		{ v[0] += m.v[0]; v[1] += m.v[1]; v[2] += m.v[2]; v[3] += m.v[3];
 		  return *this; }
-	mat4f& operator -=( const mat4f& m )
+	mat4& operator -=( const mat4& m )
 		{ v[0] -= m.v[0]; v[1] -= m.v[1]; v[2] -= m.v[2]; v[3] -= m.v[3];
 		  return *this; }
-	mat4f& operator *=( const double d )
+	mat4& operator *=( const T d )
 		{ v[0] *= d; v[1] *= d; v[2] *= d; v[3] *= d; return *this; }
-	mat4f& operator /=( const double d )
+	mat4& operator /=( const T d )
 		{ v[0] /= d; v[1] /= d; v[2] /= d; v[3] /= d; return *this; }
 
-	vec4f& operator []( int i )
+	vec4<T>& operator []( int i )
 		{ return v[i]; }
-	const vec4f& operator []( int i ) const
+	const vec4<T>& operator []( int i ) const
 		{ return v[i]; }
-	vec4f column( int i ) const
-		{ return vec4f( v[0][i], v[1][i], v[2][i], v[3][i] ); }
-
-	mat4f transpose() const
-		{ return mat4f( column( 0 ), column( 1 ), column( 2 ), column( 3 ) ); }
-	mat4f inverse() const;
-	mat3f upper33() const
-		{ return mat3f( vec3f( v[0] ), vec3f( v[1] ), vec3f( v[2] ) ); }
-
-	static mat4f identity()
-	{ return mat4f(
-		vec4f( 1.0, 0.0, 0.0, 0.0 ),
-		vec4f( 0.0, 1.0, 0.0, 0.0 ),
-		vec4f( 0.0, 0.0, 1.0, 0.0 ),
-		vec4f( 0.0, 0.0, 0.0, 1.0 )); }
-
-	static mat4f translate( const vec3f& v )
-	{ return mat4f(
-		vec4f( 1.0, 0.0, 0.0, v[0] ),
-		vec4f( 0.0, 1.0, 0.0, v[1] ),
-		vec4f( 0.0, 0.0, 1.0, v[2] ),
-		vec4f( 0.0, 0.0, 0.0, 1.0 )); }
-
-	static mat4f rotate( const vec3f& axis, const double angle ) { 
-		double c = cos( angle );
-		double s = sin( angle );
-		double t = 1.0 - c;
-
-		vec3f a = axis.normalize();
-		return mat4f(
-			vec4f(t*a[0]*a[0]+c, t*a[0]*a[1]-s*a[2], t*a[0]*a[2]+s*a[1], 0.0),
-			vec4f(t*a[0]*a[1]+s*a[2], t*a[1]*a[1]+c, t*a[1]*a[2]-s*a[0], 0.0),
-			vec4f(t*a[0]*a[2]-s*a[1], t*a[1]*a[2]+s*a[0], t*a[2]*a[2]+c, 0.0),
-			vec4f(0.0, 0.0, 0.0, 1.0) );
+	vec4<T> column( int i ) const
+		{ return vec4<T>( v[0][i], v[1][i], v[2][i], v[3][i] ); }
+
+	mat4 transpose() const
+		{ return mat4( column( 0 ), column( 1 ), column( 2 ), column( 3 ) ); }
+	mat4 inverse() const;
+	mat3<T> upper33() const
+		{ return mat3<T>( vec3<T>( v[0] ), vec3<T>( v[1] ), vec3<T>( v[2] ) ); }
+
+	static mat4 identity()
+	{ return mat4(
+		vec4<T>( 1.0, 0.0, 0.0, 0.0 ),
+		vec4<T>( 0.0, 1.0, 0.0, 0.0 ),
+		vec4<T>( 0.0, 0.0, 1.0, 0.0 ),
+		vec4<T>( 0.0, 0.0, 0.0, 1.0 )); }
+
+	static mat4 translate( const vec3<T>& v )
+	{ return mat4(
+		vec4<T>( 1.0, 0.0, 0.0, v[0] ),
+		vec4<T>( 0.0, 1.0, 0.0, v[1] ),
+		vec4<T>( 0.0, 0.0, 1.0, v[2] ),
+		vec4<T>( 0.0, 0.0, 0.0, 1.0 )); }
+
+	static mat4 rotate( const vec3<T>& axis, const T angle ) { 
+		T c = cos( angle );
+		T s = sin( angle );
+		T t = 1.0 - c;
+
+		vec3<T> a = axis.normalize();
+		return mat4(
+			vec4<T>(t*a[0]*a[0]+c, t*a[0]*a[1]-s*a[2], t*a[0]*a[2]+s*a[1], 0.0),
+			vec4<T>(t*a[0]*a[1]+s*a[2], t*a[1]*a[1]+c, t*a[1]*a[2]-s*a[0], 0.0),
+			vec4<T>(t*a[0]*a[2]-s*a[1], t*a[1]*a[2]+s*a[0], t*a[2]*a[2]+c, 0.0),
+			vec4<T>(0.0, 0.0, 0.0, 1.0) );
 	}
 
-	static mat4f scale( const vec3f& t )
-	{ return mat4f(
-		vec4f( t[0], 0.0, 0.0, 0.0 ),
-		vec4f( 0.0, t[1], 0.0, 0.0 ),
-		vec4f( 0.0, 0.0, t[2], 0.0 ),
-		vec4f( 0.0, 0.0, 0.0, 1.0 )); }
+	static mat4 scale( const vec3<T>& t )
+	{ return mat4(
+		vec4<T>( t[0], 0.0, 0.0, 0.0 ),
+		vec4<T>( 0.0, t[1], 0.0, 0.0 ),
+		vec4<T>( 0.0, 0.0, t[2], 0.0 ),
+		vec4<T>( 0.0, 0.0, 0.0, 1.0 )); }
 
-	static mat4f perspective3D( const double d )
-	{ return mat4f(
-		vec4f( 1.0, 0.0, 0.0, 0.0 ),
-		vec4f( 0.0, 1.0, 0.0, 0.0 ),
-		vec4f( 0.0, 0.0, 1.0, 0.0 ),
-		vec4f( 0.0, 0.0, 1.0/d, 0.0 )); }
+	static mat4 perspective3D( const T d )
+	{ return mat4(
+		vec4<T>( 1.0, 0.0, 0.0, 0.0 ),
+		vec4<T>( 0.0, 1.0, 0.0, 0.0 ),
+		vec4<T>( 0.0, 0.0, 1.0, 0.0 ),
+		vec4<T>( 0.0, 0.0, 1.0/d, 0.0 )); }
 
 public:
-	vec4f v[4];
+	vec4<T> v[4];
 };
 
 /****************************************************************
@@ -319,69 +368,92 @@ mat4f perspective3D(const double d);			    // perspective 3D
 
 // And now, many inline functions are defined.
 
-inline double operator *( const vec3f& a, const vec4f& b )
+template <class T>
+inline T operator *( const vec3<T>& a, const vec4<T>& b )
 {
 	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + b[3];
 }
 
-inline double operator *( const vec4f& b, const vec3f& a )
+template <class T>
+inline T operator *( const vec4<T>& b, const vec3<T>& a )
 {
 	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2] + b[3];
 }
 
-inline vec3f operator -(const vec3f& v)
+template <class T>
+inline vec3<T> operator -(const vec3<T>& v)
 {
-	return vec3f( -v.n[0], -v.n[1], -v.n[2] );
+	return vec3<T>( -v.n[0], -v.n[1], -v.n[2] );
 }
 
-inline vec3f operator +(const vec3f& a, const vec3f& b)
+template <class T>
+inline vec3<T> operator +(const vec3<T>& a, const vec3<T>& b)
 {
-	return vec3f( a.n[0] + b.n[0], a.n[1] + b.n[1], a.n[2] + b.n[2] );
+	vec3<T> r;
+	vec_kernels<T>::add3( r.n, a.n, b.n );
+	return r;
 }
 
-inline vec3f operator -(const vec3f& a, const vec3f& b)
+template <class T>
+inline vec3<T> operator -(const vec3<T>& a, const vec3<T>& b)
 {
-	return vec3f( a.n[0] - b.n[0], a.n[1] - b.n[1], a.n[2] - b.n[2] );
+	vec3<T> r;
+	vec_kernels<T>::sub3( r.n, a.n, b.n );
+	return r;
 }
 
-inline vec3f operator *(const vec3f& a, const double d )
+template <class T>
+inline vec3<T> operator *(const vec3<T>& a, const typename vec3<T>::value_type d )
 {
-	return vec3f( a.n[0] * d, a.n[1] * d, a.n[2] * d );
+	vec3<T> r;
+	vec_kernels<T>::mul3( r.n, a.n, d );
+	return r;
 }
 
-inline vec3f operator *(const double d, const vec3f& a)
+template <class T>
+inline vec3<T> operator *(const typename vec3<T>::value_type d, const vec3<T>& a)
 {
 	return a * d;
 }
 
-inline vec3f operator *(const mat4f& a, const vec3f& v)
+template <class T>
+inline vec3<T> operator *(const mat4<T>& a, const vec3<T>& v)
 {
-	return vec3f( a[0] * v, a[1] * v, a[2] * v ); 
+	vec3<T> r;
+	vec_kernels<T>::mulPoint( r.n, a.v[0].n, v.n );
+	return r;
 }
 
-inline vec3f operator *(const vec3f& v, mat4f& a)
+template <class T>
+inline vec3<T> operator *(const vec3<T>& v, mat4<T>& a)
 {
 	return a.transpose() * v;
 }
 
-inline double operator *(const vec3f& a, const vec3f& b)
+template <class T>
+inline T operator *(const vec3<T>& a, const vec3<T>& b)
 {
-	return a.n[0]*b.n[0] + a.n[1]*b.n[1] + a.n[2]*b.n[2];
+	return vec_kernels<T>::dot3( a.n, b.n );
 }
 
-inline vec3f operator *( const mat3f& a, const vec3f& b )
+template <class T>
+inline vec3<T> operator *( const mat3<T>& a, const vec3<T>& b )
 {
-	return vec3f( a[0]*b, a[1]*b, a[2]*b );
+	return vec3<T>( a[0]*b, a[1]*b, a[2]*b );
 }
 
-inline vec3f operator *( const vec3f& a, const mat3f& b )
+template <class T>
+inline vec3<T> operator *( const vec3<T>& a, const mat3<T>& b )
 {
-	return vec3f( b.column(0)*a, b.column(1)*a, b.column(2)*a );
+	return vec3<T>( b.column(0)*a, b.column(1)*a, b.column(2)*a );
 }
 
-inline vec3f operator /(const vec3f& a, const double d)
+template <class T>
+inline vec3<T> operator /(const vec3<T>& a, const typename vec3<T>::value_type d)
 {
-	return vec3f( a.n[0] / d, a.n[1] / d, a.n[2] / d );
+	vec3<T> r;
+	vec_kernels<T>::div3( r.n, a.n, d );
+	return r;
 }
 
 /* // the vector cross product
@@ -394,274 +466,320 @@ inline vec3f operator ^(const vec3f& a, const vec3f& b)
 }
 */
 
-inline bool operator ==(const vec3f& a, const vec3f& b)
+template <class T>
+inline bool operator ==(const vec3<T>& a, const vec3<T>& b)
 {
 	return a.n[0]==b.n[0] && a.n[1] == b.n[1] && a.n[2] == b.n[2];
 }
 
-inline bool operator !=(const vec3f& a, const vec3f& b)
+template <class T>
+inline bool operator !=(const vec3<T>& a, const vec3<T>& b)
 {
 	return !( a == b );
 }
 
-inline ostream& operator <<( ostream& os, const vec3f& v )
+template <class T>
+inline ostream& operator <<( ostream& os, const vec3<T>& v )
 {
 	return os << v.n[0] << " " << v.n[1] << " " << v.n[2];
 }
 
-inline istream& operator >>( istream& is, vec3f& v )
+template <class T>
+inline istream& operator >>( istream& is, vec3<T>& v )
 {
 	return is >> v.n[0] >> v.n[1] >> v.n[2];
 }
 
-inline void swap( vec3f& a, vec3f& b )
+template <class T>
+inline void swap( vec3<T>& a, vec3<T>& b )
 {
-	vec3f t( a );
+	vec3<T> t( a );
 	a = b;
 	b = t;
 }
 
-inline vec3f minimum( const vec3f& a, const vec3f& b )
+template <class T>
+inline vec3<T> minimum( const vec3<T>& a, const vec3<T>& b )
 {
-	return vec3f( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]) );
+	return vec3<T>( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]) );
 }
 
-inline vec3f maximum(const vec3f& a, const vec3f& b)
+template <class T>
+inline vec3<T> maximum(const vec3<T>& a, const vec3<T>& b)
 {
-	return vec3f( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]) );
+	return vec3<T>( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]) );
 }
 
-inline vec3f prod(const vec3f& a, const vec3f& b )
+template <class T>
+inline vec3<T> prod(const vec3<T>& a, const vec3<T>& b )
 {
-	return vec3f( a.n[0]*b.n[0], a.n[1]*b.n[1], a.n[2]*b.n[2] );
+	vec3<T> r;
+	vec_kernels<T>::prod3( r.n, a.n, b.n );
+	return r;
 }
 
-inline vec4f operator -( const vec4f& v )
+template <class T>
+inline vec4<T> operator -( const vec4<T>& v )
 {
-	return vec4f( -v.n[0], -v.n[1], -v.n[2], -v.n[3] );
+	return vec4<T>( -v.n[0], -v.n[1], -v.n[2], -v.n[3] );
 }
 
-inline vec4f operator +( const vec4f& a, const vec4f& b )
+template <class T>
+inline vec4<T> operator +( const vec4<T>& a, const vec4<T>& b )
 {
-	return vec4f( a.n[0] + b.n[0], a.n[1] + b.n[1], a.n[2] + b.n[2],
+	return vec4<T>( a.n[0] + b.n[0], a.n[1] + b.n[1], a.n[2] + b.n[2],
 		a.n[3] + b.n[3] );
 }
 
-inline vec4f operator -(const vec4f& a, const vec4f& b)
+template <class T>
+inline vec4<T> operator -(const vec4<T>& a, const vec4<T>& b)
 {
-	return vec4f( a.n[0] - b.n[0], a.n[1] - b.n[1], a.n[2] - b.n[2],
+	return vec4<T>( a.n[0] - b.n[0], a.n[1] - b.n[1], a.n[2] - b.n[2],
 		a.n[3] - b.n[3] );
 }
 
-inline vec4f operator *(const vec4f& a, const double d )
+template <class T>
+inline vec4<T> operator *(const vec4<T>& a, const typename vec4<T>::value_type d )
 {
-	return vec4f( a.n[0] * d, a.n[1] * d, a.n[2] * d, a.n[3] * d );
+	return vec4<T>( a.n[0] * d, a.n[1] * d, a.n[2] * d, a.n[3] * d );
 }
 
-inline vec4f operator *(const double d, const vec4f& a)
+template <class T>
+inline vec4<T> operator *(const typename vec4<T>::value_type d, const vec4<T>& a)
 {
 	return a * d;
 }
 
-inline double operator *(const vec4f& a, const vec4f& b)
+template <class T>
+inline T operator *(const vec4<T>& a, const vec4<T>& b)
 {
 	return a.n[0]*b.n[0] + a.n[1]*b.n[1] + a.n[2]*b.n[2] + a.n[3]*b.n[3];
 }
 
-inline vec4f operator *(const mat4f& a, const vec4f& v)
+template <class T>
+inline vec4<T> operator *(const mat4<T>& a, const vec4<T>& v)
 {
-	return vec4f( a[0] * v, a[1] * v, a[2] * v, a[3] * v );
+	vec4<T> r;
+	vec_kernels<T>::mulVec4( r.n, a.v[0].n, v.n );
+	return r;
 }
 
-inline vec4f operator *( const vec4f& v, mat4f& a )
+template <class T>
+inline vec4<T> operator *( const vec4<T>& v, mat4<T>& a )
 {
 	return a.transpose() * v;
 }
 
-inline vec4f operator /(const vec4f& a, const double d)
+template <class T>
+inline vec4<T> operator /(const vec4<T>& a, const typename vec4<T>::value_type d)
 {
-	return vec4f( a.n[0] / d, a.n[1] / d, a.n[2] / d, a.n[3] / d );
+	return vec4<T>( a.n[0] / d, a.n[1] / d, a.n[2] / d, a.n[3] / d );
 }
 
-inline bool operator ==(const vec4f& a, const vec4f& b)
+template <class T>
+inline bool operator ==(const vec4<T>& a, const vec4<T>& b)
 {
 	return a.n[0] == b.n[0] && a.n[1] == b.n[1] && a.n[2] == b.n[2] 
 	    && a.n[3] == b.n[3];
 }
 
-inline bool operator !=(const vec4f& a, const vec4f& b)
+template <class T>
+inline bool operator !=(const vec4<T>& a, const vec4<T>& b)
 {
 	return !( a == b );
 }
 
-inline ostream& operator <<( ostream& os, const vec4f& v )
+template <class T>
+inline ostream& operator <<( ostream& os, const vec4<T>& v )
 {
 	return os << v.n[0] << " " << v.n[1] << " " << v.n[2] << " " << v.n[3];
 }
 
-inline istream& operator >>( istream& is, vec4f& v )
+template <class T>
+inline istream& operator >>( istream& is, vec4<T>& v )
 {
 	return is >> v.n[0] >> v.n[1] >> v.n[2] >> v.n[3];
 }
 
-inline void swap( vec4f& a, vec4f& b )
+template <class T>
+inline void swap( vec4<T>& a, vec4<T>& b )
 {
-	vec4f t( a );
+	vec4<T> t( a );
 	a = b;
 	b = t;
 }
 
-inline vec4f minimum( const vec4f& a, const vec4f& b )
+template <class T>
+inline vec4<T> minimum( const vec4<T>& a, const vec4<T>& b )
 {
-	return vec4f( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]),
+	return vec4<T>( minimum(a.n[0],b.n[0]), minimum(a.n[1],b.n[1]), minimum(a.n[2],b.n[2]),
 	             minimum(a.n[3],b.n[3]) );
 }
 
-inline vec4f maximum(const vec4f& a, const vec4f& b)
+template <class T>
+inline vec4<T> maximum(const vec4<T>& a, const vec4<T>& b)
 {
-	return vec4f( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]),
+	return vec4<T>( maximum(a.n[0],b.n[0]), maximum(a.n[1],b.n[1]), maximum(a.n[2],b.n[2]),
 	             maximum(a.n[3],b.n[3]) );
 }
 
-inline vec4f prod(const vec4f& a, const vec4f& b )
+template <class T>
+inline vec4<T> prod(const vec4<T>& a, const vec4<T>& b )
 {
-	return vec4f( a.n[0]*b.n[0], a.n[1]*b.n[1], a.n[2]*b.n[2], a.n[3]*b.n[3] );
+	return vec4<T>( a.n[0]*b.n[0], a.n[1]*b.n[1], a.n[2]*b.n[2], a.n[3]*b.n[3] );
 }
 
-inline mat3f operator -( const mat3f& a )
+template <class T>
+inline mat3<T> operator -( const mat3<T>& a )
 {
-	return mat3f( -a.v[0], -a.v[1], -a.v[2] );
+	return mat3<T>( -a.v[0], -a.v[1], -a.v[2] );
 }
 
-inline mat3f operator +( const mat3f& a, const mat3f& b )
+template <class T>
+inline mat3<T> operator +( const mat3<T>& a, const mat3<T>& b )
 {
-	return mat3f( a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2] );
+	return mat3<T>( a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2] );
 }
 
-inline mat3f operator -( const mat3f& a, const mat3f& b)
+template <class T>
+inline mat3<T> operator -( const mat3<T>& a, const mat3<T>& b)
 {
-	return mat3f( a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2] );
+	return mat3<T>( a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2] );
 }
 
-inline mat3f operator *( const mat3f& a, const mat3f& b )
+template <class T>
+inline mat3<T> operator *( const mat3<T>& a, const mat3<T>& b )
 {
-	vec3f c0 = b.column( 0 );
-	vec3f c1 = b.column( 1 );
-	vec3f c2 = b.column( 2 );
+	vec3<T> c0 = b.column( 0 );
+	vec3<T> c1 = b.column( 1 );
+	vec3<T> c2 = b.column( 2 );
 
-	return mat3f( 
-		vec3f( a.v[0]*c0, a.v[0]*c1, a.v[0]*c2 ),
-		vec3f( a.v[1]*c0, a.v[1]*c1, a.v[1]*c2 ),
-		vec3f( a.v[2]*c0, a.v[2]*c1, a.v[2]*c2 ) );
+	return mat3<T>( 
+		vec3<T>( a.v[0]*c0, a.v[0]*c1, a.v[0]*c2 ),
+		vec3<T>( a.v[1]*c0, a.v[1]*c1, a.v[1]*c2 ),
+		vec3<T>( a.v[2]*c0, a.v[2]*c1, a.v[2]*c2 ) );
 }
 
-inline mat3f operator *( const mat3f& a, const double d )
+template <class T>
+inline mat3<T> operator *( const mat3<T>& a, const typename mat3<T>::value_type d )
 {
-	return mat3f( a.v[0]*d, a.v[1]*d, a.v[2]*d );
+	return mat3<T>( a.v[0]*d, a.v[1]*d, a.v[2]*d );
 }
 
-inline mat3f operator *( const double d, const mat3f& a )
+template <class T>
+inline mat3<T> operator *( const typename mat3<T>::value_type d, const mat3<T>& a )
 {
-	return mat3f( d*a.v[0], d*a.v[1], d*a.v[2] );
+	return mat3<T>( d*a.v[0], d*a.v[1], d*a.v[2] );
 }
 
-inline mat3f operator /( const mat3f& a, const double d )
+template <class T>
+inline mat3<T> operator /( const mat3<T>& a, const typename mat3<T>::value_type d )
 {
-	return mat3f( a.v[0]/d, a.v[1]/d, a.v[2]/d );
+	return mat3<T>( a.v[0]/d, a.v[1]/d, a.v[2]/d );
 }
 
-inline bool operator ==( const mat3f& a, const mat3f& b )
+template <class T>
+inline bool operator ==( const mat3<T>& a, const mat3<T>& b )
 {
 	return a.v[0]==b.v[0] && a.v[1]==b.v[1] && a.v[2]==b.v[2];
 }
 
-inline bool operator !=( const mat3f& a, const mat3f& b )
+template <class T>
+inline bool operator !=( const mat3<T>& a, const mat3<T>& b )
 {
 	return !( a == b );
 }
 
-inline ostream& operator <<( ostream& os, const mat3f& m )
+template <class T>
+inline ostream& operator <<( ostream& os, const mat3<T>& m )
 {
 	os << m.v[0] << " " << m.v[1] << " " << m.v[2];
 }
 
-inline istream& operator >>( istream& is, mat3f& m )
+template <class T>
+inline istream& operator >>( istream& is, mat3<T>& m )
 {
 	is >> m.v[0] >> m.v[1] >> m.v[2];
 }
 
-inline void swap(mat3f& a, mat3f& b)
+template <class T>
+inline void swap(mat3<T>& a, mat3<T>& b)
 {
 	swap( a.v[0], b.v[0] );
 	swap( a.v[1], b.v[1] );
 	swap( a.v[2], b.v[2] );
 }
 
-inline mat4f operator -( const mat4f& a )
+template <class T>
+inline mat4<T> operator -( const mat4<T>& a )
 {
-	return mat4f( -a.v[0], -a.v[1], -a.v[2], -a.v[3] );
+	return mat4<T>( -a.v[0], -a.v[1], -a.v[2], -a.v[3] );
 }
 
-inline mat4f operator +( const mat4f& a, const mat4f& b )
+template <class T>
+inline mat4<T> operator +( const mat4<T>& a, const mat4<T>& b )
 {
-	return mat4f( a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2], a.v[3]+b.v[3] );
+	return mat4<T>( a.v[0]+b.v[0], a.v[1]+b.v[1], a.v[2]+b.v[2], a.v[3]+b.v[3] );
 }
 
-inline mat4f operator -( const mat4f& a, const mat4f& b )
+template <class T>
+inline mat4<T> operator -( const mat4<T>& a, const mat4<T>& b )
 {
-	return mat4f( a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2], a.v[3]-b.v[3] );
+	return mat4<T>( a.v[0]-b.v[0], a.v[1]-b.v[1], a.v[2]-b.v[2], a.v[3]-b.v[3] );
 }
 
-inline mat4f operator *( const mat4f& a, const mat4f& b )
+template <class T>
+inline mat4<T> operator *( const mat4<T>& a, const mat4<T>& b )
 {
-	vec4f c0 = b.column( 0 );
-	vec4f c1 = b.column( 1 );
-	vec4f c2 = b.column( 2 );
-	vec4f c3 = b.column( 3 );
-
-	return mat4f( 
-		vec4f( a.v[0]*c0, a.v[0]*c1, a.v[0]*c2, a.v[0]*c3 ),
-		vec4f( a.v[1]*c0, a.v[1]*c1, a.v[1]*c2, a.v[1]*c3 ),
-		vec4f( a.v[2]*c0, a.v[2]*c1, a.v[2]*c2, a.v[2]*c3 ),
-		vec4f( a.v[3]*c0, a.v[3]*c1, a.v[3]*c2, a.v[3]*c3 ) );
+	mat4<T> r;
+	vec_kernels<T>::mulMat4( r.v[0].n, a.v[0].n, b.v[0].n );
+	return r;
 }
 
-inline mat4f operator *( const mat4f& a, const double d )
+template <class T>
+inline mat4<T> operator *( const mat4<T>& a, const typename mat4<T>::value_type d )
 {
-	return mat4f( a.v[0]*d, a.v[1]*d, a.v[2]*d, a.v[3]*d );
+	return mat4<T>( a.v[0]*d, a.v[1]*d, a.v[2]*d, a.v[3]*d );
 }
 
-inline mat4f operator *( const double d, const mat4f& a )
+template <class T>
+inline mat4<T> operator *( const typename mat4<T>::value_type d, const mat4<T>& a )
 {
-	return mat4f( d*a.v[0], d*a.v[1], d*a.v[2], d*a.v[3] );
+	return mat4<T>( d*a.v[0], d*a.v[1], d*a.v[2], d*a.v[3] );
 }
 
-inline mat4f operator /( const mat4f& a, const double d )
+template <class T>
+inline mat4<T> operator /( const mat4<T>& a, const typename mat4<T>::value_type d )
 {
-	return mat4f( a.v[0]/d, a.v[1]/d, a.v[2]/d, a.v[3]/d );
+	return mat4<T>( a.v[0]/d, a.v[1]/d, a.v[2]/d, a.v[3]/d );
 }
 
-inline bool operator ==( const mat4f& a, const mat4f& b )
+template <class T>
+inline bool operator ==( const mat4<T>& a, const mat4<T>& b )
 {
 	return a.v[0]==b.v[0] && a.v[1]==b.v[1] && a.v[2]==b.v[2] && a.v[3]==b.v[3];
 }
 
-inline bool operator !=( const mat4f& a, const mat4f& b )
+template <class T>
+inline bool operator !=( const mat4<T>& a, const mat4<T>& b )
 {
 	return !( a == b );
 }
 
-inline ostream& operator <<( ostream& os, const mat4f& m )
+template <class T>
+inline ostream& operator <<( ostream& os, const mat4<T>& m )
 {
 	os << m.v[0] << " " << m.v[1] << " " << m.v[2] << " " << m.v[3];
 }
 
-inline istream& operator >>( istream& is, mat4f& m )
+template <class T>
+inline istream& operator >>( istream& is, mat4<T>& m )
 {
 	is >> m.v[0] >> m.v[1] >> m.v[2] >> m.v[3];
 }
 
-inline void swap( mat4f& a, mat4f& b )
+template <class T>
+inline void swap( mat4<T>& a, mat4<T>& b )
 {
 	swap( a.v[0], b.v[0] );
 	swap( a.v[1], b.v[1] );
@@ -669,11 +787,13 @@ inline void swap( mat4f& a, mat4f& b )
 	swap( a.v[3], b.v[3] );
 }
 
-inline vec3f::vec3f( const vec4f& v ) 
+template <class T>
+inline vec3<T>::vec3( const vec4<T>& v ) 
 { 
 	n[0] = v[0]; 
 	n[1] = v[1]; 
 	n[2] = v[2]; 
+	clearPad();
 }
 /*
 inline vec3f clamp( const vec3f& other )
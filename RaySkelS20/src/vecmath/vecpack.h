@@ -0,0 +1,251 @@
+//
+// vecpack.h
+//
+// Arithmetic on "packs" of doubles, for kernels that work across many
+// independent values -- hits, pixels -- rather than within one vector.  A
+// kernel is written once as a template over the pack type and runs on
+// WidePack, four doubles to an AVX2 register or two to an SSE2 one, and on
+// Pack1, a single double, for the values left over after the last full
+// pack and for builds without SIMD.  Every pack does the same operations
+// in the same order, so a value doesn't depend on which lane it lands in.
+//
+// Besides + - * / there are min, max, comparisons and select, and pow,
+// log and exp worked out from polynomials so that they vectorize too.
+//
+
+#ifndef __VECPACK_H__
+#define __VECPACK_H__
+
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+
+#include "vecsimd.h"
+
+struct Pack1
+{
+	enum { WIDTH = 1 };
+	typedef bool Mask;
+
+	double v;
+
+	Pack1() {}
+	Pack1( double d ) : v( d ) {}
+	static Pack1 load( const double *p ) { return Pack1( *p ); }
+	static Pack1 load( const float *p ) { return Pack1( *p ); }
+	void store( double *p ) const { *p = v; }
+
+	// truncated to whole numbers, which must be from 0 to 255
+	void storeBytes( unsigned char *p ) const { *p = (unsigned char)(int)v; }
+
+	static uint64_t bits( double d ) { uint64_t b; memcpy( &b, &d, sizeof( b ) ); return b; }
+	static double fromBits( uint64_t b ) { double d; memcpy( &d, &b, sizeof( d ) ); return d; }
+};
+
+inline Pack1 operator+( Pack1 a, Pack1 b ) { return Pack1( a.v + b.v ); }
+inline Pack1 operator-( Pack1 a, Pack1 b ) { return Pack1( a.v - b.v ); }
+inline Pack1 operator*( Pack1 a, Pack1 b ) { return Pack1( a.v * b.v ); }
+inline Pack1 operator/( Pack1 a, Pack1 b ) { return Pack1( a.v / b.v ); }
+inline Pack1 vmax( Pack1 a, Pack1 b ) { return a.v > b.v ? a : b; }
+inline Pack1 vmin( Pack1 a, Pack1 b ) { return a.v < b.v ? a : b; }
+inline bool vless( Pack1 a, Pack1 b ) { return a.v < b.v; }
+inline bool vequal( Pack1 a, Pack1 b ) { return a.v == b.v; }
+inline Pack1 vselect( bool m, Pack1 a, Pack1 b ) { return m ? a : b; }
+
+// The biased exponent of x, and x scaled by a power of 2 into [1, 2).
+inline Pack1 vexponent( Pack1 x ) { return Pack1( double( Pack1::bits( x.v ) >> 52 ) ); }
+inline Pack1 vmantissa( Pack1 x )
+{
+	return Pack1( Pack1::fromBits( ( Pack1::bits( x.v ) & 0x000FFFFFFFFFFFFFull ) | 0x3FF0000000000000ull ) );
+}
+
+// 2^n for whole n from -1022 to 1023
+inline Pack1 vpow2( Pack1 n ) { return Pack1( Pack1::fromBits( uint64_t( int64_t( n.v ) + 1023 ) << 52 ) ); }
+
+#if defined(RAY_SIMD_AVX2)
+
+struct Pack4
+{
+	enum { WIDTH = 4 };
+	typedef __m256d Mask;
+
+	__m256d v;
+
+	Pack4() {}
+	Pack4( __m256d r ) : v( r ) {}
+	Pack4( double d ) : v( _mm256_set1_pd( d ) ) {}
+	static Pack4 load( const double *p ) { return Pack4( _mm256_loadu_pd( p ) ); }
+	static Pack4 load( const float *p ) { return Pack4( _mm256_cvtps_pd( _mm_loadu_ps( p ) ) ); }
+	void store( double *p ) const { _mm256_storeu_pd( p, v ); }
+
+	void storeBytes( unsigned char *p ) const
+	{
+		__m128i i = _mm256_cvttpd_epi32( v );
+		i = _mm_packus_epi16( _mm_packs_epi32( i, i ), i );
+		int b = _mm_cvtsi128_si32( i );
+		memcpy( p, &b, 4 );
+	}
+};
+
+inline Pack4 operator+( Pack4 a, Pack4 b ) { return Pack4( _mm256_add_pd( a.v, b.v ) ); }
+inline Pack4 operator-( Pack4 a, Pack4 b ) { return Pack4( _mm256_sub_pd( a.v, b.v ) ); }
+inline Pack4 operator*( Pack4 a, Pack4 b ) { return Pack4( _mm256_mul_pd( a.v, b.v ) ); }
+inline Pack4 operator/( Pack4 a, Pack4 b ) { return Pack4( _mm256_div_pd( a.v, b.v ) ); }
+inline Pack4 vmax( Pack4 a, Pack4 b ) { return Pack4( _mm256_max_pd( a.v, b.v ) ); }
+inline Pack4 vmin( Pack4 a, Pack4 b ) { return Pack4( _mm256_min_pd( a.v, b.v ) ); }
+inline __m256d vless( Pack4 a, Pack4 b ) { return _mm256_cmp_pd( a.v, b.v, _CMP_LT_OQ ); }
+inline __m256d vequal( Pack4 a, Pack4 b ) { return _mm256_cmp_pd( a.v, b.v, _CMP_EQ_OQ ); }
+inline Pack4 vselect( __m256d m, Pack4 a, Pack4 b ) { return Pack4( _mm256_blendv_pd( b.v, a.v, m ) ); }
+
+// Whole numbers below 2^52 are read off, and put in, the low bits of a
+// double between 2^52 and 2^53.
+inline Pack4 vexponent( Pack4 x )
+{
+	__m256i e = _mm256_srli_epi64( _mm256_castpd_si256( x.v ), 52 );
+	__m256d d = _mm256_castsi256_pd( _mm256_or_si256( e, _mm256_set1_epi64x( 0x4330000000000000ll ) ) );
+	return Pack4( _mm256_sub_pd( d, _mm256_set1_pd( 4503599627370496.0 ) ) );
+}
+
+inline Pack4 vmantissa( Pack4 x )
+{
+	__m256i m = _mm256_and_si256( _mm256_castpd_si256( x.v ), _mm256_set1_epi64x( 0x000FFFFFFFFFFFFFll ) );
+	return Pack4( _mm256_castsi256_pd( _mm256_or_si256( m, _mm256_set1_epi64x( 0x3FF0000000000000ll ) ) ) );
+}
+
+inline Pack4 vpow2( Pack4 n )
+{
+	__m256d b = _mm256_add_pd( n.v, _mm256_set1_pd( 4503599627370496.0 + 1023.0 ) );
+	return Pack4( _mm256_castsi256_pd( _mm256_slli_epi64( _mm256_castpd_si256( b ), 52 ) ) );
+}
+
+typedef Pack4 WidePack;
+
+#elif defined(RAY_SIMD_SSE2)
+
+struct Pack2
+{
+	enum { WIDTH = 2 };
+	typedef __m128d Mask;
+
+	__m128d v;
+
+	Pack2() {}
+	Pack2( __m128d r ) : v( r ) {}
+	Pack2( double d ) : v( _mm_set1_pd( d ) ) {}
+	static Pack2 load( const double *p ) { return Pack2( _mm_loadu_pd( p ) ); }
+	static Pack2 load( const float *p )
+	{
+		return Pack2( _mm_cvtps_pd( _mm_castsi128_ps( _mm_loadl_epi64( (const __m128i *)p ) ) ) );
+	}
+	void store( double *p ) const { _mm_storeu_pd( p, v ); }
+
+	void storeBytes( unsigned char *p ) const
+	{
+		__m128i i = _mm_cvttpd_epi32( v );
+		i = _mm_packus_epi16( _mm_packs_epi32( i, i ), i );
+		int b = _mm_cvtsi128_si32( i );
+		memcpy( p, &b, 2 );
+	}
+};
+
+inline Pack2 operator+( Pack2 a, Pack2 b ) { return Pack2( _mm_add_pd( a.v, b.v ) ); }
+inline Pack2 operator-( Pack2 a, Pack2 b ) { return Pack2( _mm_sub_pd( a.v, b.v ) ); }
+inline Pack2 operator*( Pack2 a, Pack2 b ) { return Pack2( _mm_mul_pd( a.v, b.v ) ); }
+inline Pack2 operator/( Pack2 a, Pack2 b ) { return Pack2( _mm_div_pd( a.v, b.v ) ); }
+inline Pack2 vmax( Pack2 a, Pack2 b ) { return Pack2( _mm_max_pd( a.v, b.v ) ); }
+inline Pack2 vmin( Pack2 a, Pack2 b ) { return Pack2( _mm_min_pd( a.v, b.v ) ); }
+inline __m128d vless( Pack2 a, Pack2 b ) { return _mm_cmplt_pd( a.v, b.v ); }
+inline __m128d vequal( Pack2 a, Pack2 b ) { return _mm_cmpeq_pd( a.v, b.v ); }
+inline Pack2 vselect( __m128d m, Pack2 a, Pack2 b )
+{
+	return Pack2( _mm_or_pd( _mm_and_pd( m, a.v ), _mm_andnot_pd( m, b.v ) ) );
+}
+
+inline Pack2 vexponent( Pack2 x )
+{
+	__m128i e = _mm_srli_epi64( _mm_castpd_si128( x.v ), 52 );
+	__m128d d = _mm_castsi128_pd( _mm_or_si128( e, _mm_set1_epi64x( 0x4330000000000000ll ) ) );
+	return Pack2( _mm_sub_pd( d, _mm_set1_pd( 4503599627370496.0 ) ) );
+}
+
+inline Pack2 vmantissa( Pack2 x )
+{
+	__m128i m = _mm_and_si128( _mm_castpd_si128( x.v ), _mm_set1_epi64x( 0x000FFFFFFFFFFFFFll ) );
+	return Pack2( _mm_castsi128_pd( _mm_or_si128( m, _mm_set1_epi64x( 0x3FF0000000000000ll ) ) ) );
+}
+
+inline Pack2 vpow2( Pack2 n )
+{
+	__m128d b = _mm_add_pd( n.v, _mm_set1_pd( 4503599627370496.0 + 1023.0 ) );
+	return Pack2( _mm_castsi128_pd( _mm_slli_epi64( _mm_castpd_si128( b ), 52 ) ) );
+}
+
+typedef Pack2 WidePack;
+
+#else
+
+typedef Pack1 WidePack;
+
+#endif
+
+static const double PACK_LN2_HI = 6.93147180369123816490e-01;	// ln 2, in two parts
+static const double PACK_LN2_LO = 1.90821492927058770002e-10;	// so that n * PACK_LN2_HI is exact
+static const double PACK_LOG2E = 1.44269504088896338700e+00;
+static const double PACK_SQRT2 = 1.41421356237309514547e+00;
+static const double PACK_ROUNDER = 6755399441055744.0;			// 1.5 * 2^52
+
+// ln x for x >= 0; 0 gives a large negative number, not -infinity.  x is
+// 2^e m with m within a factor of sqrt 2 of 1, and ln m = 2 atanh s for
+// s = (m-1)/(m+1), which is at most 0.172 so the series is quick.
+template <class P>
+inline P vlog( P x )
+{
+	typename P::Mask tiny = vless( x, P( DBL_MIN ) );
+	x = vselect( tiny, x * P( 18014398509481984.0 ), x );		// 2^54
+	P e = vexponent( x ) - vselect( tiny, P( 1023.0 + 54.0 ), P( 1023.0 ) );
+	P m = vmantissa( x );
+
+	typename P::Mask big = vless( P( PACK_SQRT2 ), m );
+	m = vselect( big, m * P( 0.5 ), m );
+	e = vselect( big, e + P( 1.0 ), e );
+
+	P s = ( m - P( 1.0 ) ) / ( m + P( 1.0 ) );
+	P s2 = s * s;
+	P q( 2.0 / 21.0 );
+	for( int k = 19; k >= 1; k -= 2 )
+		q = q * s2 + P( 2.0 / k );
+	return e * P( PACK_LN2_HI ) + ( s * q + e * P( PACK_LN2_LO ) );
+}
+
+// e^y for y from -708 to 709: 2^n e^r with r within ln 2 / 2 of 0.
+template <class P>
+inline P vexp( P y )
+{
+	static const double inverseFactorial[] = {
+		1.0, 1.0, 1.0 / 2, 1.0 / 6, 1.0 / 24, 1.0 / 120, 1.0 / 720, 1.0 / 5040,
+		1.0 / 40320, 1.0 / 362880, 1.0 / 3628800, 1.0 / 39916800,
+		1.0 / 479001600, 1.0 / 6227020800.0
+	};
+
+	P n = ( y * P( PACK_LOG2E ) + P( PACK_ROUNDER ) ) - P( PACK_ROUNDER );
+	P r = ( y - n * P( PACK_LN2_HI ) ) - n * P( PACK_LN2_LO );
+	P p( inverseFactorial[13] );
+	for( int k = 12; k >= 0; --k )
+		p = p * r + P( inverseFactorial[k] );
+	return p * vpow2( n );
+}
+
+// x^e for x, e >= 0, as std::pow gives it to about 1e-13 relative.
+template <class P>
+inline P vpow( P x, P e )
+{
+	P y = e * vlog( x );
+	P r = vexp( vmin( vmax( y, P( -708.0 ) ), P( 709.0 ) ) );
+	r = vselect( vless( y, P( -708.0 ) ), P( 0.0 ), r );
+
+	// 0^e is 0, except that 0^0 is 1
+	return vselect( vless( P( 0.0 ), x ), r,
+		vselect( vequal( e, P( 0.0 ) ), P( 1.0 ), P( 0.0 ) ) );
+}
+
+#endif // __VECPACK_H__
@@ -0,0 +1,344 @@
+//
+// vecsimd.h
+//
+// The kernels under the vector and matrix arithmetic in vecmath.h.
+//
+// scalar_kernels is plain C++ and serves every scalar type.  When the
+// compiler targets SSE2 or AVX2, vec_kernels<double> -- the type the
+// shading and transform code runs on -- is replaced with intrinsics, and
+// vec3<double> is padded to four lanes so that it loads as whole
+// registers.  Define RAY_NO_SIMD to build with the scalar kernels
+// everywhere.
+//
+// Every kernel multiplies and adds in the same order as the scalar one,
+// so the backend doesn't change a single bit of the rendered images.
+//
+
+#ifndef __VECSIMD_H__
+#define __VECSIMD_H__
+
+#include <cmath>
+
+#ifndef RAY_NO_SIMD
+#if defined(__AVX2__)
+#define RAY_SIMD_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#define RAY_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+#endif
+
+// How many lanes a vec3<T> holds.  Lanes past the third are padding: the
+// constructors zero them and nothing reads them.
+template <class T>
+struct vec_layout
+{
+	enum { vec3Lanes = 3 };
+};
+
+#if defined(RAY_SIMD_AVX2) || defined(RAY_SIMD_SSE2)
+template <>
+struct vec_layout<double>
+{
+	enum { vec3Lanes = 4 };
+};
+#endif
+
+// Vectors are passed as pointers to their components and matrices as
+// pointers to their 16 components in row order.  The result may be one
+// of the arguments.
+template <class T>
+struct scalar_kernels
+{
+	static void add3( T *r, const T *a, const T *b )
+		{ r[0] = a[0] + b[0]; r[1] = a[1] + b[1]; r[2] = a[2] + b[2]; }
+	static void sub3( T *r, const T *a, const T *b )
+		{ r[0] = a[0] - b[0]; r[1] = a[1] - b[1]; r[2] = a[2] - b[2]; }
+	static void mul3( T *r, const T *a, const T d )
+		{ r[0] = a[0] * d; r[1] = a[1] * d; r[2] = a[2] * d; }
+	static void div3( T *r, const T *a, const T d )
+		{ r[0] = a[0] / d; r[1] = a[1] / d; r[2] = a[2] / d; }
+	static void prod3( T *r, const T *a, const T *b )
+		{ r[0] = a[0] * b[0]; r[1] = a[1] * b[1]; r[2] = a[2] * b[2]; }
+
+	static T dot3( const T *a, const T *b )
+		{ return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+
+	static void cross3( T *r, const T *a, const T *b )
+	{
+		T x = a[1]*b[2] - a[2]*b[1];
+		T y = a[2]*b[0] - a[0]*b[2];
+		T z = a[0]*b[1] - a[1]*b[0];
+		r[0] = x; r[1] = y; r[2] = z;
+	}
+
+	static void normalize3( T *r, const T *a )
+		{ div3( r, a, T( std::sqrt( dot3( a, a ) ) ) ); }
+
+	// m * (v, 1), dropping the fourth row
+	static void mulPoint( T *r, const T *m, const T *v )
+	{
+		T x = v[0]*m[0] + v[1]*m[1] + v[2]*m[2] + m[3];
+		T y = v[0]*m[4] + v[1]*m[5] + v[2]*m[6] + m[7];
+		T z = v[0]*m[8] + v[1]*m[9] + v[2]*m[10] + m[11];
+		r[0] = x; r[1] = y; r[2] = z;
+	}
+
+	static void mulVec4( T *r, const T *m, const T *v )
+	{
+		T t[4];
+		for( int i = 0; i < 4; ++i )
+			t[i] = m[4*i]*v[0] + m[4*i+1]*v[1] + m[4*i+2]*v[2] + m[4*i+3]*v[3];
+		for( int i = 0; i < 4; ++i )
+			r[i] = t[i];
+	}
+
+	// r must not be a or b
+	static void mulMat4( T *r, const T *a, const T *b )
+	{
+		for( int i = 0; i < 4; ++i )
+			for( int j = 0; j < 4; ++j )
+				r[4*i+j] = a[4*i]*b[j] + a[4*i+1]*b[4+j] + a[4*i+2]*b[8+j] + a[4*i+3]*b[12+j];
+	}
+};
+
+template <class T>
+struct vec_kernels
+	: public scalar_kernels<T>
+{
+};
+
+#if defined(RAY_SIMD_AVX2)
+
+// Vectors are only as aligned as their doubles, and on the heap of a
+// 32-bit build that is 8 bytes, so here and in the SSE2 kernels every load
+// and store is an unaligned one.  That costs the same as an aligned one
+// unless it straddles a cache line.
+template <>
+struct vec_kernels<double>
+{
+	static void add3( double *r, const double *a, const double *b )
+		{ _mm256_storeu_pd( r, _mm256_add_pd( _mm256_loadu_pd( a ), _mm256_loadu_pd( b ) ) ); }
+	static void sub3( double *r, const double *a, const double *b )
+		{ _mm256_storeu_pd( r, _mm256_sub_pd( _mm256_loadu_pd( a ), _mm256_loadu_pd( b ) ) ); }
+	static void mul3( double *r, const double *a, const double d )
+		{ _mm256_storeu_pd( r, _mm256_mul_pd( _mm256_loadu_pd( a ), _mm256_set1_pd( d ) ) ); }
+	static void div3( double *r, const double *a, const double d )
+		{ _mm256_storeu_pd( r, _mm256_div_pd( _mm256_loadu_pd( a ), _mm256_set1_pd( d ) ) ); }
+	static void prod3( double *r, const double *a, const double *b )
+		{ _mm256_storeu_pd( r, _mm256_mul_pd( _mm256_loadu_pd( a ), _mm256_loadu_pd( b ) ) ); }
+
+	// (p0 + p1) + p2, as the scalar sum goes
+	static __m128d sum3( __m256d p )
+	{
+		__m128d lo = _mm256_castpd256_pd128( p );
+		__m128d s = _mm_add_sd( lo, _mm_unpackhi_pd( lo, lo ) );
+		return _mm_add_sd( s, _mm256_extractf128_pd( p, 1 ) );
+	}
+
+	static double dot3( const double *a, const double *b )
+		{ return _mm_cvtsd_f64( sum3( _mm256_mul_pd( _mm256_loadu_pd( a ), _mm256_loadu_pd( b ) ) ) ); }
+
+	// a x b = ( a * b.yzx - a.yzx * b ).yzx
+	static void cross3( double *r, const double *a, const double *b )
+	{
+		__m256d va = _mm256_loadu_pd( a );
+		__m256d vb = _mm256_loadu_pd( b );
+		__m256d t = _mm256_sub_pd(
+			_mm256_mul_pd( va, _mm256_permute4x64_pd( vb, _MM_SHUFFLE( 3, 0, 2, 1 ) ) ),
+			_mm256_mul_pd( _mm256_permute4x64_pd( va, _MM_SHUFFLE( 3, 0, 2, 1 ) ), vb ) );
+		_mm256_storeu_pd( r, _mm256_permute4x64_pd( t, _MM_SHUFFLE( 3, 0, 2, 1 ) ) );
+	}
+
+	static void normalize3( double *r, const double *a )
+	{
+		__m256d va = _mm256_loadu_pd( a );
+		__m128d len = _mm_sqrt_sd( _mm_setzero_pd(), sum3( _mm256_mul_pd( va, va ) ) );
+		_mm256_storeu_pd( r, _mm256_div_pd( va, _mm256_broadcastsd_pd( len ) ) );
+	}
+
+	// The columns of m.
+	static void columns( const double *m, __m256d c[4] )
+	{
+		__m256d r0 = _mm256_loadu_pd( m );
+		__m256d r1 = _mm256_loadu_pd( m + 4 );
+		__m256d r2 = _mm256_loadu_pd( m + 8 );
+		__m256d r3 = _mm256_loadu_pd( m + 12 );
+		__m256d t0 = _mm256_unpacklo_pd( r0, r1 );
+		__m256d t1 = _mm256_unpackhi_pd( r0, r1 );
+		__m256d t2 = _mm256_unpacklo_pd( r2, r3 );
+		__m256d t3 = _mm256_unpackhi_pd( r2, r3 );
+		c[0] = _mm256_permute2f128_pd( t0, t2, 0x20 );
+		c[1] = _mm256_permute2f128_pd( t1, t3, 0x20 );
+		c[2] = _mm256_permute2f128_pd( t0, t2, 0x31 );
+		c[3] = _mm256_permute2f128_pd( t1, t3, 0x31 );
+	}
+
+	static void mulPoint( double *r, const double *m, const double *v )
+	{
+		__m256d c[4];
+		columns( m, c );
+		__m256d s = _mm256_add_pd(
+			_mm256_mul_pd( c[0], _mm256_set1_pd( v[0] ) ),
+			_mm256_mul_pd( c[1], _mm256_set1_pd( v[1] ) ) );
+		s = _mm256_add_pd( s, _mm256_mul_pd( c[2], _mm256_set1_pd( v[2] ) ) );
+		s = _mm256_add_pd( s, c[3] );
+		_mm256_storeu_pd( r, _mm256_blend_pd( s, _mm256_setzero_pd(), 0x8 ) );
+	}
+
+	static void mulVec4( double *r, const double *m, const double *v )
+	{
+		__m256d c[4];
+		columns( m, c );
+		__m256d s = _mm256_add_pd(
+			_mm256_mul_pd( c[0], _mm256_set1_pd( v[0] ) ),
+			_mm256_mul_pd( c[1], _mm256_set1_pd( v[1] ) ) );
+		s = _mm256_add_pd( s, _mm256_mul_pd( c[2], _mm256_set1_pd( v[2] ) ) );
+		s = _mm256_add_pd( s, _mm256_mul_pd( c[3], _mm256_set1_pd( v[3] ) ) );
+		_mm256_storeu_pd( r, s );
+	}
+
+	// Row i of the product is the rows of b weighted by row i of a.
+	static void mulMat4( double *r, const double *a, const double *b )
+	{
+		__m256d b0 = _mm256_loadu_pd( b );
+		__m256d b1 = _mm256_loadu_pd( b + 4 );
+		__m256d b2 = _mm256_loadu_pd( b + 8 );
+		__m256d b3 = _mm256_loadu_pd( b + 12 );
+		for( int i = 0; i < 4; ++i ) {
+			const double *ai = a + 4*i;
+			__m256d s = _mm256_add_pd(
+				_mm256_mul_pd( _mm256_set1_pd( ai[0] ), b0 ),
+				_mm256_mul_pd( _mm256_set1_pd( ai[1] ), b1 ) );
+			s = _mm256_add_pd( s, _mm256_mul_pd( _mm256_set1_pd( ai[2] ), b2 ) );
+			s = _mm256_add_pd( s, _mm256_mul_pd( _mm256_set1_pd( ai[3] ), b3 ) );
+			_mm256_storeu_pd( r + 4*i, s );
+		}
+	}
+};
+
+#elif defined(RAY_SIMD_SSE2)
+
+// A vec3<double> is two registers here, (x, y) and (z, 0), loaded and
+// stored unaligned, as the AVX2 ones are.
+template <>
+struct vec_kernels<double>
+{
+	static void add3( double *r, const double *a, const double *b )
+	{
+		_mm_storeu_pd( r, _mm_add_pd( _mm_loadu_pd( a ), _mm_loadu_pd( b ) ) );
+		_mm_storeu_pd( r + 2, _mm_add_pd( _mm_loadu_pd( a + 2 ), _mm_loadu_pd( b + 2 ) ) );
+	}
+	static void sub3( double *r, const double *a, const double *b )
+	{
+		_mm_storeu_pd( r, _mm_sub_pd( _mm_loadu_pd( a ), _mm_loadu_pd( b ) ) );
+		_mm_storeu_pd( r + 2, _mm_sub_pd( _mm_loadu_pd( a + 2 ), _mm_loadu_pd( b + 2 ) ) );
+	}
+	static void mul3( double *r, const double *a, const double d )
+	{
+		__m128d vd = _mm_set1_pd( d );
+		_mm_storeu_pd( r, _mm_mul_pd( _mm_loadu_pd( a ), vd ) );
+		_mm_storeu_pd( r + 2, _mm_mul_pd( _mm_loadu_pd( a + 2 ), vd ) );
+	}
+	static void div3( double *r, const double *a, const double d )
+	{
+		__m128d vd = _mm_set1_pd( d );
+		_mm_storeu_pd( r, _mm_div_pd( _mm_loadu_pd( a ), vd ) );
+		_mm_storeu_pd( r + 2, _mm_div_pd( _mm_loadu_pd( a + 2 ), vd ) );
+	}
+	static void prod3( double *r, const double *a, const double *b )
+	{
+		_mm_storeu_pd( r, _mm_mul_pd( _mm_loadu_pd( a ), _mm_loadu_pd( b ) ) );
+		_mm_storeu_pd( r + 2, _mm_mul_pd( _mm_loadu_pd( a + 2 ), _mm_loadu_pd( b + 2 ) ) );
+	}
+
+	// (p0 + p1) + p2, as the scalar sum goes
+	static __m128d dot( const double *a, const double *b )
+	{
+		__m128d lo = _mm_mul_pd( _mm_loadu_pd( a ), _mm_loadu_pd( b ) );
+		__m128d s = _mm_add_sd( lo, _mm_unpackhi_pd( lo, lo ) );
+		return _mm_add_sd( s, _mm_mul_sd( _mm_load_sd( a + 2 ), _mm_load_sd( b + 2 ) ) );
+	}
+
+	static double dot3( const double *a, const double *b )
+		{ return _mm_cvtsd_f64( dot( a, b ) ); }
+
+	// The shuffles cost more than they save: two lanes do too little of
+	// a cross product, so it stays scalar.
+	static void cross3( double *r, const double *a, const double *b )
+		{ scalar_kernels<double>::cross3( r, a, b ); }
+
+	static void normalize3( double *r, const double *a )
+	{
+		__m128d len = _mm_sqrt_sd( _mm_setzero_pd(), dot( a, a ) );
+		len = _mm_unpacklo_pd( len, len );
+		_mm_storeu_pd( r, _mm_div_pd( _mm_loadu_pd( a ), len ) );
+		_mm_storeu_pd( r + 2, _mm_div_pd( _mm_loadu_pd( a + 2 ), len ) );
+	}
+
+	// Rows i and i+1 of m * v, taking column pairs out of the two rows.
+	static __m128d mulRows( const double *m, const double *v, __m128d w )
+	{
+		__m128d lo0 = _mm_loadu_pd( m ), hi0 = _mm_loadu_pd( m + 2 );
+		__m128d lo1 = _mm_loadu_pd( m + 4 ), hi1 = _mm_loadu_pd( m + 6 );
+		__m128d s = _mm_add_pd(
+			_mm_mul_pd( _mm_unpacklo_pd( lo0, lo1 ), _mm_set1_pd( v[0] ) ),
+			_mm_mul_pd( _mm_unpackhi_pd( lo0, lo1 ), _mm_set1_pd( v[1] ) ) );
+		s = _mm_add_pd( s, _mm_mul_pd( _mm_unpacklo_pd( hi0, hi1 ), _mm_set1_pd( v[2] ) ) );
+		return _mm_add_pd( s, _mm_mul_pd( _mm_unpackhi_pd( hi0, hi1 ), w ) );
+	}
+
+	// The multiply by w = 1 is exact, so this rounds as the scalar
+	// m_i0 x + m_i1 y + m_i2 z + m_i3 does.
+	static void mulPoint( double *r, const double *m, const double *v )
+	{
+		__m128d one = _mm_set1_pd( 1.0 );
+		__m128d xy = mulRows( m, v, one );
+		__m128d zw = mulRows( m + 8, v, one );
+		_mm_storeu_pd( r, xy );
+		_mm_storeu_pd( r + 2, _mm_move_sd( _mm_setzero_pd(), zw ) );
+	}
+
+	static void mulVec4( double *r, const double *m, const double *v )
+	{
+		__m128d w = _mm_set1_pd( v[3] );
+		__m128d xy = mulRows( m, v, w );
+		__m128d zw = mulRows( m + 8, v, w );
+		_mm_storeu_pd( r, xy );
+		_mm_storeu_pd( r + 2, zw );
+	}
+
+	static void mulMat4( double *r, const double *a, const double *b )
+	{
+		for( int h = 0; h < 4; h += 2 ) {
+			__m128d b0 = _mm_loadu_pd( b + h ), b1 = _mm_loadu_pd( b + 4 + h );
+			__m128d b2 = _mm_loadu_pd( b + 8 + h ), b3 = _mm_loadu_pd( b + 12 + h );
+			for( int i = 0; i < 4; ++i ) {
+				const double *ai = a + 4*i;
+				__m128d s = _mm_add_pd(
+					_mm_mul_pd( _mm_set1_pd( ai[0] ), b0 ),
+					_mm_mul_pd( _mm_set1_pd( ai[1] ), b1 ) );
+				s = _mm_add_pd( s, _mm_mul_pd( _mm_set1_pd( ai[2] ), b2 ) );
+				s = _mm_add_pd( s, _mm_mul_pd( _mm_set1_pd( ai[3] ), b3 ) );
+				_mm_storeu_pd( r + 4*i + h, s );
+			}
+		}
+	}
+};
+
+#endif
+
+// The name of the backend vec_kernels<double> was built with.
+inline const char *vecBackend()
+{
+#if defined(RAY_SIMD_AVX2)
+	return "AVX2";
+#elif defined(RAY_SIMD_SSE2)
+	return "SSE2";
+#else
+	return "scalar";
+#endif
+}
+
+#endif // __VECSIMD_H__